@@ -54,19 +54,17 @@ void eventCallback(LairdBt510& beacon, lairdbt510_event_type evt) {
 
 void alarmCallback(LairdBt510& beacon, lairdbt510_event_type alarm) {
   /**
-   * This callback receives alarms from the Laird BT510 beacon. It's important
-   * to note that the library doesn't implement alarm filtering or hysteresis.
-   * If the beacon sends an alarm, it is passed to the callback. The appplication
-   * may implement some filtering (or set/clear hysteresis) to avoid repeat
-   * alerting, if that's desirable.
+   * This callback receives alarms from the Laird BT510 beacon. It is called
+   * once when an alarm is raised, and once when it clears. Use
+   * LairdBt510::setAlarmRenotify() to be reminded of alarms that stay raised.
    */
   switch (alarm)
   {
     case lairdbt510_event_type::MOVEMENT:
-      Log.info("Movement alarm!");
+      Log.info("Movement alarm %s", beacon.isAlarmActive(alarm) ? "raised" : "cleared");
       break;
     case lairdbt510_event_type::ALARM_HIGH_TEMP_1:
-      Log.info("High Temp alarm 1! Temp: %d", beacon.getTemperature());
+      Log.info("High Temp alarm 1 %s! Temp: %d", beacon.isAlarmActive(alarm) ? "raised" : "cleared", beacon.getTemperature());
       break;
     case lairdbt510_event_type::MAGNET_PROXIMITY:
       Log.info("Magnet state changed. Magnet %s near", beacon.magnetNear() ? "is" : "is not");
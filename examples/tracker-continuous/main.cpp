@@ -33,9 +33,8 @@ STARTUP(
 
 void locationGenerationCallback(JSONWriter &writer, LocationPoint &point, const void *context)
 {
-    for (auto i : Scanner.getKontaktTags()) {
-        i.toJson(&writer);
-    }
+    // The nearest tags that fit in the location event
+    Scanner.nearest(writer, 10, 600, SCAN_KONTAKT);
 }
 
 void setup()
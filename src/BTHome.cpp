@@ -15,12 +15,194 @@
  */
 
 #include "BTHome.h"
+#include <math.h>
 
 inline bool BTHome::isBTHome(uint8_t lsb, uint8_t msb) { return (0xD2 == lsb) && (0xFC == msb); } // BTHome UUID is 0xFCD2
 
 Vector<BTHome> BTHome::beacons;
+uint32_t BTHome::undecrypted = 0;
+#ifdef SUPPORT_BTHOME_ENCRYPTION
+uint8_t BTHome::decrypted[BLE_MAX_ADV_DATA_LEN];
+size_t BTHome::decrypted_len = 0;
+bool BTHome::decrypted_duplicate = false;
+#endif
 #define MAX_MANUFACTURER_DATA_LEN 37
 
+#define BTHOME_DEVICE_INFO_ENCRYPTED    0x01
+#define BTHOME_COUNTER_LEN              4
+#define BTHOME_MIC_LEN                  4
+#define BTHOME_VARIABLE_SIZE            0xFF    // Size is given by the first data byte (text and raw objects)
+
+enum bthome_scale : uint8_t {
+    SCALE_1, SCALE_0_1, SCALE_0_01, SCALE_0_001, SCALE_0_000001, SCALE_0_35
+};
+
+static const float bthome_scale_factor[] = { 1.0f, 0.1f, 0.01f, 0.001f, 0.000001f, 0.35f };
+
+struct BTHomeObjectDef {
+    uint8_t size;       // 0 means the object ID is not defined by the specification
+    bool is_signed;
+    uint8_t scale;
+    const char* name;
+};
+
+// Indexed by object ID, from https://bthome.io/format/
+static constexpr BTHomeObjectDef bthome_objects[] = {
+    {1, false, SCALE_1,        "packetId"},            // 0x00
+    {1, false, SCALE_1,        "batteryLevel"},        // 0x01
+    {2, true,  SCALE_0_01,     "temperature"},         // 0x02
+    {2, false, SCALE_0_01,     "humidity"},            // 0x03
+    {3, false, SCALE_0_01,     "pressure"},            // 0x04
+    {3, false, SCALE_0_01,     "illuminance"},         // 0x05
+    {2, false, SCALE_0_01,     "massKg"},              // 0x06
+    {2, false, SCALE_0_01,     "massLb"},              // 0x07
+    {2, true,  SCALE_0_01,     "dewPoint"},            // 0x08
+    {1, false, SCALE_1,        "count"},               // 0x09
+    {3, false, SCALE_0_001,    "energy"},              // 0x0A
+    {3, false, SCALE_0_01,     "power"},               // 0x0B
+    {2, false, SCALE_0_001,    "voltage"},             // 0x0C
+    {2, false, SCALE_1,        "pm25"},                // 0x0D
+    {2, false, SCALE_1,        "pm10"},                // 0x0E
+    {1, false, SCALE_1,        "genericBoolean"},      // 0x0F
+    {1, false, SCALE_1,        "powerState"},          // 0x10
+    {1, false, SCALE_1,        "opening"},             // 0x11
+    {2, false, SCALE_1,        "co2"},                 // 0x12
+    {2, false, SCALE_1,        "tvoc"},                // 0x13
+    {2, false, SCALE_0_01,     "moisture"},            // 0x14
+    {1, false, SCALE_1,        "batteryLow"},          // 0x15
+    {1, false, SCALE_1,        "batteryCharging"},     // 0x16
+    {1, false, SCALE_1,        "carbonMonoxide"},      // 0x17
+    {1, false, SCALE_1,        "cold"},                // 0x18
+    {1, false, SCALE_1,        "connectivity"},        // 0x19
+    {1, false, SCALE_1,        "door"},                // 0x1A
+    {1, false, SCALE_1,        "garageDoor"},          // 0x1B
+    {1, false, SCALE_1,        "gasDetected"},         // 0x1C
+    {1, false, SCALE_1,        "heat"},                // 0x1D
+    {1, false, SCALE_1,        "light"},               // 0x1E
+    {1, false, SCALE_1,        "lock"},                // 0x1F
+    {1, false, SCALE_1,        "moistureDetected"},    // 0x20
+    {1, false, SCALE_1,        "motion"},              // 0x21
+    {1, false, SCALE_1,        "moving"},              // 0x22
+    {1, false, SCALE_1,        "occupancy"},           // 0x23
+    {1, false, SCALE_1,        "plug"},                // 0x24
+    {1, false, SCALE_1,        "presence"},            // 0x25
+    {1, false, SCALE_1,        "problem"},             // 0x26
+    {1, false, SCALE_1,        "running"},             // 0x27
+    {1, false, SCALE_1,        "safety"},              // 0x28
+    {1, false, SCALE_1,        "smoke"},               // 0x29
+    {1, false, SCALE_1,        "sound"},               // 0x2A
+    {1, false, SCALE_1,        "tamper"},              // 0x2B
+    {1, false, SCALE_1,        "vibration"},           // 0x2C
+    {1, false, SCALE_1,        "windowState"},         // 0x2D
+    {1, false, SCALE_1,        "humidity"},            // 0x2E
+    {1, false, SCALE_1,        "moisture"},            // 0x2F
+    {0, false, SCALE_1,        nullptr},               // 0x30
+    {0, false, SCALE_1,        nullptr},               // 0x31
+    {0, false, SCALE_1,        nullptr},               // 0x32
+    {0, false, SCALE_1,        nullptr},               // 0x33
+    {0, false, SCALE_1,        nullptr},               // 0x34
+    {0, false, SCALE_1,        nullptr},               // 0x35
+    {0, false, SCALE_1,        nullptr},               // 0x36
+    {0, false, SCALE_1,        nullptr},               // 0x37
+    {0, false, SCALE_1,        nullptr},               // 0x38
+    {0, false, SCALE_1,        nullptr},               // 0x39
+    {1, false, SCALE_1,        "buttonEvent"},         // 0x3A
+    {0, false, SCALE_1,        nullptr},               // 0x3B
+    {2, false, SCALE_1,        "dimmerEvent"},         // 0x3C (event type, then steps)
+    {2, false, SCALE_1,        "count"},               // 0x3D
+    {4, false, SCALE_1,        "count"},               // 0x3E
+    {2, true,  SCALE_0_1,      "rotation"},            // 0x3F
+    {2, false, SCALE_1,        "distanceMm"},          // 0x40
+    {2, false, SCALE_0_1,      "distanceM"},           // 0x41
+    {3, false, SCALE_0_001,    "duration"},            // 0x42
+    {2, false, SCALE_0_001,    "current"},             // 0x43
+    {2, false, SCALE_0_01,     "speed"},               // 0x44
+    {2, true,  SCALE_0_1,      "temperature"},         // 0x45
+    {1, false, SCALE_0_1,      "uvIndex"},             // 0x46
+    {2, false, SCALE_0_1,      "volume"},              // 0x47
+    {2, false, SCALE_1,        "volumeMl"},            // 0x48
+    {2, false, SCALE_0_001,    "volumeFlowRate"},      // 0x49
+    {2, false, SCALE_0_1,      "voltage"},             // 0x4A
+    {3, false, SCALE_0_001,    "gas"},                 // 0x4B
+    {4, false, SCALE_0_001,    "gas"},                 // 0x4C
+    {4, false, SCALE_0_001,    "energy"},              // 0x4D
+    {4, false, SCALE_0_001,    "volume"},              // 0x4E
+    {4, false, SCALE_0_001,    "water"},               // 0x4F
+    {4, false, SCALE_1,        "timestamp"},           // 0x50
+    {2, false, SCALE_0_001,    "acceleration"},        // 0x51
+    {2, false, SCALE_0_001,    "gyroscope"},           // 0x52
+    {BTHOME_VARIABLE_SIZE, false, SCALE_1, "text"},    // 0x53
+    {BTHOME_VARIABLE_SIZE, false, SCALE_1, "raw"},     // 0x54
+    {4, false, SCALE_0_001,    "volumeStorage"},       // 0x55
+    {2, false, SCALE_1,        "conductivity"},        // 0x56
+    {1, true,  SCALE_1,        "temperature"},         // 0x57
+    {1, true,  SCALE_0_35,     "temperature"},         // 0x58
+    {1, true,  SCALE_1,        "count"},               // 0x59
+    {2, true,  SCALE_1,        "count"},               // 0x5A
+    {4, true,  SCALE_1,        "count"},               // 0x5B
+    {4, true,  SCALE_0_01,     "power"},               // 0x5C
+    {2, true,  SCALE_0_001,    "current"},             // 0x5D
+    {2, false, SCALE_0_01,     "direction"},           // 0x5E
+    {2, false, SCALE_0_1,      "precipitation"},       // 0x5F
+    {1, false, SCALE_1,        "channel"},             // 0x60
+    {2, false, SCALE_1,        "rotationalSpeed"},     // 0x61
+    {4, true,  SCALE_0_000001, "speed"},               // 0x62
+};
+
+// Device information objects live at the top of the ID space
+static constexpr uint8_t BTHOME_DEVICE_OBJECTS_START = 0xF0;
+static constexpr BTHomeObjectDef bthome_device_objects[] = {
+    {2, false, SCALE_1,        "deviceTypeId"},        // 0xF0
+    {4, false, SCALE_1,        "firmwareVersion"},     // 0xF1
+    {3, false, SCALE_1,        "firmwareVersion"},     // 0xF2
+};
+
+static constexpr size_t BTHOME_OBJECT_COUNT = sizeof(bthome_objects) / sizeof(bthome_objects[0]);
+static constexpr size_t BTHOME_DEVICE_OBJECT_COUNT = sizeof(bthome_device_objects) / sizeof(bthome_device_objects[0]);
+
+static const BTHomeObjectDef* bthomeObject(uint8_t objectId)
+{
+    const BTHomeObjectDef* def = nullptr;
+    if (objectId < BTHOME_OBJECT_COUNT)
+    {
+        def = &bthome_objects[objectId];
+    }
+    else if (objectId >= BTHOME_DEVICE_OBJECTS_START && objectId - BTHOME_DEVICE_OBJECTS_START < (int)BTHOME_DEVICE_OBJECT_COUNT)
+    {
+        def = &bthome_device_objects[objectId - BTHOME_DEVICE_OBJECTS_START];
+    }
+    return (def && def->size) ? def : nullptr;
+}
+
+int32_t BTHome::Measurement::rawValue() const
+{
+    const BTHomeObjectDef* def = bthomeObject(objectId);
+    if (def && def->is_signed && def->size < 4)
+    {
+        // Sign extend from the object size
+        uint8_t shift = 32 - def->size * 8;
+        return (int32_t)(raw << shift) >> shift;
+    }
+    return (int32_t)raw;
+}
+
+float BTHome::Measurement::value() const
+{
+    const BTHomeObjectDef* def = bthomeObject(objectId);
+    if (def == nullptr)
+    {
+        return NAN;
+    }
+    float v = def->is_signed ? (float)rawValue() : (float)raw;
+    return v * bthome_scale_factor[def->scale];
+}
+
+const char* BTHome::Measurement::name() const
+{
+    const BTHomeObjectDef* def = bthomeObject(objectId);
+    return def ? def->name : "unknown";
+}
+
 void BTHome::populateData(const BleScanResult *scanResult)
 {
     Beacon::populateData(scanResult);
@@ -29,6 +211,7 @@ void BTHome::populateData(const BleScanResult *scanResult)
     uint8_t buf[BLE_MAX_ADV_DATA_LEN];
     uint8_t count = ADVERTISING_DATA(scanResult).get(BleAdvertisingDataType::SERVICE_DATA, buf, BLE_MAX_ADV_DATA_LEN);
 
+    changed_fields = 0;
     if (!parseBTHomeAdvertisement(buf, count))
     {
         Log.error("BTHome: advertisement parsing failed");
@@ -50,21 +233,72 @@ bool BTHome::isBeacon(const BleScanResult *scanResult)
             hexString += hex;
         }
         Log.trace("BTHome sensor found: %s", hexString.c_str());
+        if (buf[2] & BTHOME_DEVICE_INFO_ENCRYPTED)
+        {
+            // Decrypted here so that no beacon is stored for advertisements that can't be read,
+            // they are counted instead
+#ifdef SUPPORT_BTHOME_ENCRYPTION
+            decrypted_duplicate = false;
+            if (!decrypt(ADDRESS(scanResult), buf, count, decrypted, decrypted_duplicate))
+            {
+                undecrypted++;
+                return false;
+            }
+            decrypted_len = count - BTHOME_COUNTER_LEN - BTHOME_MIC_LEN;
+#else
+            Log.trace("BTHome: encrypted advertisements are not supported");
+            undecrypted++;
+            return false;
+#endif
+        }
         return true;
     }
     return false;
 }
 
-void BTHome::toJson(JSONWriter *writer) const
+void BTHome::fieldsToJson(JSONWriter *writer) const
 {
-    writer->name(address.toString()).beginObject();
-    writer->name("batteryLevel").value(getBatteryLevel());
-    writer->endObject();
+    for (uint8_t i = 0; i < measurement_count; i++)
+    {
+        const Measurement &m = measurements[i];
+        const BTHomeObjectDef* def = bthomeObject(m.objectId);
+        // Several object IDs share a name (temperature, count...), number the repeats of the name
+        uint8_t repeat = 0;
+        for (uint8_t j = 0; j < i; j++)
+        {
+            if (!strcmp(bthomeObject(measurements[j].objectId)->name, def->name))
+            {
+                repeat++;
+            }
+        }
+        if (repeat == 0)
+        {
+            writer->name(def->name);
+        }
+        else
+        {
+            char name[24];
+            snprintf(name, sizeof(name), "%s_%u", def->name, repeat + 1);
+            writer->name(name);
+        }
+        if (def->scale != SCALE_1)
+        {
+            writer->value(m.value());
+        }
+        else if (def->is_signed)
+        {
+            writer->value((int)m.rawValue());
+        }
+        else
+        {
+            writer->value((unsigned int)m.raw);
+        }
+    }
 }
 
-void BTHome::addOrUpdate(const BleScanResult *scanResult)
+BTHome& BTHome::addOrUpdate(const BleScanResult *scanResult)
 {
-    uint8_t i;
+    int i;
     for (i = 0; i < beacons.size(); ++i)
     {
         if (beacons.at(i).getAddress() == ADDRESS(scanResult))
@@ -78,23 +312,99 @@ void BTHome::addOrUpdate(const BleScanResult *scanResult)
         new_beacon.populateData(scanResult);
         new_beacon.missed_scan = 0;
         beacons.append(new_beacon);
+        return beacons.last();
     }
     else
     {
         BTHome &beacon = beacons.at(i);
-        beacon.newly_scanned = false;
         beacon.populateData(scanResult);
         beacon.missed_scan = 0;
+        return beacon;
     }
 }
 
+const BTHome::Measurement* BTHome::findMeasurement(uint8_t objectId, uint8_t index) const
+{
+    for (uint8_t i = 0; i < measurement_count; i++)
+    {
+        if (measurements[i].objectId == objectId && measurements[i].index == index)
+        {
+            return &measurements[i];
+        }
+    }
+    return nullptr;
+}
+
+void BTHome::setMeasurement(uint8_t objectId, uint8_t index, uint32_t raw)
+{
+    Measurement *m = const_cast<Measurement *>(findMeasurement(objectId, index));
+    if (m == nullptr)
+    {
+        if (measurement_count >= BTHOME_MAX_MEASUREMENTS)
+        {
+            return;
+        }
+        m = &measurements[measurement_count++];
+        m->objectId = objectId;
+        m->index = index;
+    }
+    else if (m->raw == raw)
+    {
+        return;
+    }
+    m->raw = raw;
+    // An event value of 0 means no event
+    if (fieldOf(objectId) != BTHOME_FIELD_EVENT || raw != 0)
+    {
+        changed_fields |= fieldOf(objectId);
+    }
+}
+
+uint32_t BTHome::fieldOf(uint8_t objectId)
+{
+    switch (objectId)
+    {
+    case (uint8_t)bthome_object_id::PACKET_ID:
+        return BTHOME_FIELD_PACKET_ID;
+    case (uint8_t)bthome_object_id::BATTERY:
+        return BTHOME_FIELD_BATTERY;
+    case (uint8_t)bthome_object_id::TEMPERATURE:
+    case 0x45:
+        return BTHOME_FIELD_TEMPERATURE;
+    case (uint8_t)bthome_object_id::HUMIDITY:
+    case 0x2E:
+        return BTHOME_FIELD_HUMIDITY;
+    case (uint8_t)bthome_object_id::BUTTON:
+    case (uint8_t)bthome_object_id::DIMMER:
+        return BTHOME_FIELD_EVENT;
+    default:
+        if (objectId >= 0x0F && objectId <= 0x2D)
+        {
+            return BTHOME_FIELD_BINARY;
+        }
+        return BTHOME_FIELD_OTHER;
+    }
+}
+
+int32_t BTHome::getRaw(bthome_object_id id, uint8_t index) const
+{
+    const Measurement *m = findMeasurement((uint8_t)id, index);
+    return m ? m->rawValue() : 0;
+}
+
+float BTHome::getValue(bthome_object_id id, uint8_t index) const
+{
+    const Measurement *m = findMeasurement((uint8_t)id, index);
+    return m ? m->value() : NAN;
+}
+
 // parses the BTHome Data format specified at https://bthome.io/format/
-// min supported length is 9 bytes
+// min supported length is 5 bytes: UUID, device information, and one object
 // Example: D2FC44002D01643A01 (here, a button is pressed: 3A is 01)
 bool BTHome::parseBTHomeAdvertisement(const uint8_t *buf, size_t len)
 {
 
-    if (len < 9)
+    if (len < 5)
     {
         return false;
     }
@@ -106,90 +416,241 @@ bool BTHome::parseBTHomeAdvertisement(const uint8_t *buf, size_t len)
     }
 
     // next byte is the BTHome Device Information (Example: 0x44)
-    // Log.info("BTHome Device Information: %02X", buf[2]);
+    if (buf[2] & BTHOME_DEVICE_INFO_ENCRYPTED)
+    {
+#ifdef SUPPORT_BTHOME_ENCRYPTION
+        // Decrypted by isBeacon()
+        if (decrypted_duplicate)
+        {
+            // Devices repeat each advertisement a few times, nothing new to parse
+            return true;
+        }
+        buf = decrypted;
+        len = decrypted_len;
+#else
+        return false;
+#endif
+    }
 
     // now parse the rest of the data
     size_t offset = 3; // start after UUID and device info
 
+    // Object IDs decoded in this advertisement, used to number repeated objects
+    uint8_t decoded[BTHOME_MAX_MEASUREMENTS];
+    uint8_t decoded_count = 0;
+
     while (offset + 1 < len)
     {
         uint8_t objectId = buf[offset++];
-        parseField(objectId, buf, offset);
+        uint8_t index = 0;
+        for (uint8_t i = 0; i < decoded_count; i++)
+        {
+            if (decoded[i] == objectId)
+            {
+                index++;
+            }
+        }
+        if (!parseField(objectId, buf, len, offset, index))
+        {
+            return false;
+        }
+        if (decoded_count < BTHOME_MAX_MEASUREMENTS)
+        {
+            decoded[decoded_count++] = objectId;
+        }
     }
 
-    // Log the parsed data
-    Log.trace("Parsed BTHome Advertisement: Packet ID: %d, Battery Level: %d%%, Illuminance: %.2f lx, Window State: %d, Button Event: %d, Rotation: %.1f",
-              packetId, batteryLevel, illuminance * 0.01, windowState, buttonEvent, rotation * 0.1);
+    // Pressing a button twice sends the same value twice, a new packet ID tells them apart.
+    // A value of 0 means no event.
+    if (changed_fields & BTHOME_FIELD_PACKET_ID)
+    {
+        for (uint8_t i = 0; i < decoded_count; i++)
+        {
+            if (fieldOf(decoded[i]) != BTHOME_FIELD_EVENT)
+            {
+                continue;
+            }
+            uint8_t index = 0;
+            for (uint8_t j = 0; j < i; j++)
+            {
+                if (decoded[j] == decoded[i])
+                {
+                    index++;
+                }
+            }
+            const Measurement *m = findMeasurement(decoded[i], index);
+            if (m && m->raw != 0)
+            {
+                changed_fields |= BTHOME_FIELD_EVENT;
+            }
+        }
+    }
 
     return true;
 }
 
-void BTHome::parseField(uint8_t objectId, const uint8_t *buf, size_t &offset)
+bool BTHome::parseField(uint8_t objectId, const uint8_t *buf, size_t len, size_t &offset, uint8_t index)
 {
-    switch (objectId)
+    const BTHomeObjectDef* def = bthomeObject(objectId);
+    if (def == nullptr)
     {
+        // The size of an object that isn't in the specification can't be known, so the rest
+        // of the advertisement can't be parsed reliably
+        Log.trace("parseField() - Unknown object ID: 0x%02X", objectId);
+        return false;
+    }
 
-    case 0x00: // packet id (uint8, 1 byte)
-        if (offset + 1 <= 31)
+    if (def->size == BTHOME_VARIABLE_SIZE)
+    {
+        // Text and raw objects aren't stored, skip them using their length byte
+        size_t size = buf[offset];
+        if (offset + 1 + size > len)
         {
-            packetId = buf[offset];
-            offset += 1;
+            return false;
         }
-        break;
+        offset += 1 + size;
+        return true;
+    }
 
-    case 0x01: // Measurement: Battery level (uint8, 1 byte)
-        if (offset + 1 <= 31)
-        {
-            batteryLevel = buf[offset];
-            offset += 1;
-        }
-        break;
+    if (offset + def->size > len)
+    {
+        return false;
+    }
+    uint32_t raw = 0;
+    for (uint8_t i = 0; i < def->size; i++)
+    {
+        raw |= (uint32_t)buf[offset + i] << (8 * i); // little endian
+    }
+    offset += def->size;
+    setMeasurement(objectId, index, raw);
+    return true;
+}
+
+#ifdef SUPPORT_BTHOME_ENCRYPTION
+Vector<BTHome::EncryptionKey> BTHome::keys;
 
-    case 0x05: // Illuminance (uint24, 0.01)
-        if (offset + 3 <= 31)
+BTHome::EncryptionKey* BTHome::findKey(const BleAddress& address)
+{
+    for (auto& k : keys)
+    {
+        if (k.address == address)
         {
-            illuminance = littleEndianToUInt24(&buf[offset]);
-            offset += 3;
+            return &k;
         }
-        break;
+    }
+    return nullptr;
+}
 
-    case 0x2D: // Measurement: Window (uint8, 1 byte)
-        if (offset + 1 <= 31)
+bool BTHome::setEncryptionKey(const BleAddress& address, const uint8_t key[AES128_KEY_SIZE])
+{
+    EncryptionKey entry;
+    entry.address = address;
+    entry.cipher.setKey(key);
+    // The nonce is the MAC address (most significant byte first), the UUID, device info and counter
+    for (uint8_t i = 0; i < 6; i++)
+    {
+        entry.nonce_prefix[i] = address[5 - i];
+    }
+    entry.nonce_prefix[6] = 0xD2;
+    entry.nonce_prefix[7] = 0xFC;
+    entry.last_counter = 0;
+    entry.counter_valid = false;
+    SINGLE_THREADED_BLOCK() {
+        EncryptionKey* existing = findKey(address);
+        if (existing)
         {
-            windowState = buf[offset];
-            offset += 1;
+            *existing = entry;
         }
-        break;
-
-    case 0x3A: // Event: button
-        if (offset + 1 <= 31)
+        else
         {
-            buttonEvent = buf[offset];
-            offset += 1;
+            keys.append(entry);
         }
-        break;
+    }
+    return true;
+}
 
-    case 0x3F: // Rotation (sint16, 0.1)
-        if (offset + 2 <= 31)
+bool BTHome::setEncryptionKey(const BleAddress& address, const char* key)
+{
+    if (key == nullptr || strlen(key) != AES128_KEY_SIZE * 2)
+    {
+        Log.error("BTHome: encryption key must be %d hex characters", AES128_KEY_SIZE * 2);
+        return false;
+    }
+    uint8_t bytes[AES128_KEY_SIZE];
+    for (uint8_t i = 0; i < AES128_KEY_SIZE * 2; i++)
+    {
+        char c = key[i];
+        uint8_t nibble;
+        if (c >= '0' && c <= '9') nibble = c - '0';
+        else if (c >= 'a' && c <= 'f') nibble = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') nibble = c - 'A' + 10;
+        else
         {
-            rotation = littleEndianToInt16(&buf[offset]);
-            offset += 2;
+            Log.error("BTHome: encryption key must be %d hex characters", AES128_KEY_SIZE * 2);
+            return false;
         }
-        break;
-
-    // Add cases for other measurement types as needed
-    default:
-        Log.info("parseField() - Unknown measurement type: 0x%02X", objectId);
-        return;
+        bytes[i / 2] = (i % 2) ? (bytes[i / 2] | nibble) : (uint8_t)(nibble << 4);
     }
+    return setEncryptionKey(address, bytes);
 }
 
-int16_t BTHome::littleEndianToInt16(const uint8_t *data)
+void BTHome::removeEncryptionKey(const BleAddress& address)
 {
-    return (int16_t)((data[1] << 8) | data[0]);
+    SINGLE_THREADED_BLOCK() {
+        for (int i = 0; i < keys.size(); i++)
+        {
+            if (keys.at(i).address == address)
+            {
+                keys.removeAt(i);
+                break;
+            }
+        }
+    }
 }
 
-uint32_t BTHome::littleEndianToUInt24(const uint8_t *data)
+// Encrypted format: UUID, device info, ciphertext, counter (uint32, little endian), MIC (4 bytes)
+// https://bthome.io/encryption/
+bool BTHome::decrypt(const BleAddress& address, const uint8_t *buf, size_t len, uint8_t *out, bool &duplicate)
 {
-    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16);
+    if (len < 3 + 2 + BTHOME_COUNTER_LEN + BTHOME_MIC_LEN)
+    {
+        return false;
+    }
+    EncryptionKey* key = findKey(address);
+    if (key == nullptr)
+    {
+        Log.trace("BTHome: no encryption key for %s", address.toString().c_str());
+        return false;
+    }
+
+    // Check the replay counter before spending any time on decryption
+    const uint8_t *counter = &buf[len - BTHOME_COUNTER_LEN - BTHOME_MIC_LEN];
+    uint32_t count = (uint32_t)counter[0] | ((uint32_t)counter[1] << 8) | ((uint32_t)counter[2] << 16) | ((uint32_t)counter[3] << 24);
+    if (key->counter_valid && count <= key->last_counter)
+    {
+        duplicate = (count == key->last_counter);
+        if (!duplicate)
+        {
+            Log.trace("BTHome: stale counter %lu from %s", (unsigned long)count, address.toString().c_str());
+        }
+        return duplicate;
+    }
+
+    uint8_t nonce[13];
+    memcpy(nonce, key->nonce_prefix, sizeof(key->nonce_prefix));
+    nonce[8] = buf[2];
+    memcpy(&nonce[9], counter, BTHOME_COUNTER_LEN);
+
+    size_t cipher_len = len - 3 - BTHOME_COUNTER_LEN - BTHOME_MIC_LEN;
+    if (!key->cipher.ccmDecrypt(nonce, &buf[3], cipher_len, &buf[len - BTHOME_MIC_LEN], BTHOME_MIC_LEN, &out[3]))
+    {
+        Log.trace("BTHome: MIC check failed for %s", address.toString().c_str());
+        return false;
+    }
+    // Only authenticated frames move the counter forward
+    key->last_counter = count;
+    key->counter_valid = true;
+    memcpy(out, buf, 3);
+    return true;
 }
+#endif
@@ -24,42 +24,142 @@
 #define BTHOME_H
 
 #include "beacon.h"
+#ifdef SUPPORT_BTHOME_ENCRYPTION
+#include "aes128.h"
+#endif
+
+#define BTHOME_MAX_MEASUREMENTS 12
+
+// BTHome v2 object IDs, see https://bthome.io/format/
+enum class bthome_object_id : uint8_t {
+    PACKET_ID       = 0x00,
+    BATTERY         = 0x01,
+    TEMPERATURE     = 0x02,
+    HUMIDITY        = 0x03,
+    PRESSURE        = 0x04,
+    ILLUMINANCE     = 0x05,
+    WINDOW          = 0x2D,
+    BUTTON          = 0x3A,
+    DIMMER          = 0x3C,
+    ROTATION        = 0x3F
+};
+
+// Groups of objects reported as changed with UPDATED callbacks, see fieldOf()
+enum bthome_field_t : uint32_t {
+    BTHOME_FIELD_PACKET_ID      = 0x01,
+    BTHOME_FIELD_BATTERY        = 0x02,
+    BTHOME_FIELD_TEMPERATURE    = 0x04,
+    BTHOME_FIELD_HUMIDITY       = 0x08,
+    BTHOME_FIELD_BINARY         = 0x10,     // Binary sensors: window, door, motion...
+    BTHOME_FIELD_EVENT          = 0x20,     // Button and dimmer events, set for each new event even if the value repeats
+    BTHOME_FIELD_OTHER          = 0x40
+};
 
 class BTHome : public Beacon
 {
 public:
-    BTHome() : Beacon(SCAN_BTHOME){};
+    BTHome() : Beacon(SCAN_BTHOME), measurement_count(0) {};
     ~BTHome() = default;
 
-    void toJson(JSONWriter *writer) const override;
+    /**
+     * One decoded BTHome object. The value is stored raw, as it came over the air,
+     * and is scaled according to the object definition when requested.
+     */
+    struct Measurement {
+        uint32_t raw;
+        uint8_t objectId;
+        uint8_t index;      // Occurrence of this object ID in the advertisement, for devices with multiple buttons, etc.
+
+        int32_t rawValue() const;
+        float value() const;
+        const char* name() const;
+    };
+
+    void fieldsToJson(JSONWriter *writer) const override;
 
-    int getPacketId() const { return packetId; }
-    int getBatteryLevel() const { return batteryLevel; }
-    int getButtonEvent() const { return buttonEvent; }
-    int getWindowState() const { return windowState; }
-    int getRotation() const { return rotation; }
-    int getIlluminance() const { return illuminance; }
+    int getPacketId() const { return getRaw(bthome_object_id::PACKET_ID); }
+    int getBatteryLevel() const { return getRaw(bthome_object_id::BATTERY); }
+    int getButtonEvent() const { return getRaw(bthome_object_id::BUTTON); }
+    int getWindowState() const { return getRaw(bthome_object_id::WINDOW); }
+    int getRotation() const { return getRaw(bthome_object_id::ROTATION); }
+    int getIlluminance() const { return getRaw(bthome_object_id::ILLUMINANCE); }
+
+    /**
+     * Get the raw value of an object, as sent by the device. Returns 0 if the object hasn't been received.
+     */
+    int32_t getRaw(bthome_object_id id, uint8_t index = 0) const;
+    /**
+     * Get the value of an object, with the scaling factor of the BTHome specification applied.
+     * Returns NAN if the object hasn't been received.
+     */
+    float getValue(bthome_object_id id, uint8_t index = 0) const;
+    bool hasMeasurement(bthome_object_id id, uint8_t index = 0) const { return findMeasurement((uint8_t)id, index) != nullptr; }
+
+    /**
+     * Get the bthome_field_t group that an object ID belongs to.
+     */
+    static uint32_t fieldOf(uint8_t objectId);
+
+    uint8_t getMeasurementCount() const { return measurement_count; }
+    const Measurement& getMeasurement(uint8_t i) const { return measurements[i]; }
+
+    /**
+     * Number of encrypted advertisements that were ignored: no key for the device, a failed
+     * MIC check, a replayed counter, or no SUPPORT_BTHOME_ENCRYPTION. No beacon is stored for them.
+     */
+    static uint32_t getUndecryptedCount() { return undecrypted; }
+
+#ifdef SUPPORT_BTHOME_ENCRYPTION
+    /**
+     * Set the key used to decrypt the advertisements of a device that has encryption enabled.
+     * Advertisements from encrypted devices without a key are ignored.
+     *
+     * Setting the key again for the same device resets its replay counter.
+     *
+     * @param address   address of the device
+     * @param key       16 byte AES key, or 32 character hex string
+     * @return false if the key is not valid
+     */
+    static bool setEncryptionKey(const BleAddress& address, const uint8_t key[AES128_KEY_SIZE]);
+    static bool setEncryptionKey(const BleAddress& address, const char* key);
+    static void removeEncryptionKey(const BleAddress& address);
+#endif
 
 private:
-    int packetId = 0;
-    int batteryLevel = 0;
-    int buttonEvent = 0;
-    int windowState = 0;
-    int rotation = 0;
-    int illuminance = 0;
+    Measurement measurements[BTHOME_MAX_MEASUREMENTS];
+    uint8_t measurement_count;
 
     friend class Beaconscanner;
     static Vector<BTHome> beacons;
+    static uint32_t undecrypted;
     void populateData(const BleScanResult *scanResult) override;
     static bool isBeacon(const BleScanResult *scanResult);
-    static void addOrUpdate(const BleScanResult *scanResult);
+    static BTHome& addOrUpdate(const BleScanResult *scanResult);
 
     bool parseBTHomeAdvertisement(const uint8_t *buf, size_t len);
-    void parseField(uint8_t objectId, const uint8_t *buf, size_t &offset);
-    int16_t littleEndianToInt16(const uint8_t *data);
-    uint32_t littleEndianToUInt24(const uint8_t *data);
+    bool parseField(uint8_t objectId, const uint8_t *buf, size_t len, size_t &offset, uint8_t index);
+    const Measurement* findMeasurement(uint8_t objectId, uint8_t index) const;
+    void setMeasurement(uint8_t objectId, uint8_t index, uint32_t raw);
 
     static inline bool isBTHome(uint8_t lsb, uint8_t msb);
+
+#ifdef SUPPORT_BTHOME_ENCRYPTION
+    // Per device decryption state, kept apart from the beacons so it survives the beacon being removed
+    struct EncryptionKey {
+        BleAddress address;
+        Aes128 cipher;              // Expanded key schedule
+        uint8_t nonce_prefix[8];    // MAC address and UUID, the start of every nonce for this device
+        uint32_t last_counter;
+        bool counter_valid;
+    };
+    static Vector<EncryptionKey> keys;
+    static EncryptionKey* findKey(const BleAddress& address);
+    static bool decrypt(const BleAddress& address, const uint8_t *buf, size_t len, uint8_t *out, bool &duplicate);
+    // The advertisement decrypted by isBeacon(), taken by addOrUpdate()
+    static uint8_t decrypted[BLE_MAX_ADV_DATA_LEN];
+    static size_t decrypted_len;
+    static bool decrypted_duplicate;
+#endif
 };
 
 #endif
\ No newline at end of file
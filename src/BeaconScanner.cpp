@@ -23,11 +23,12 @@
 #define PUBLISH_CHUNK 622
 #endif
 #define IBEACON_JSON_SIZE 119
-#define KONTAKT_JSON_SIZE 93
+#define KONTAKT_JSON_SIZE 175
 #define EDDYSTONE_JSON_SIZE 260
 #define LAIRDBT510_JSON_SIZE 100
-#define BTHOME_JSON_SIZE 100
-#define RUUVI_JSON_SIZE 100
+#define BTHOME_JSON_SIZE 250
+#define RUUVI_JSON_SIZE 250
+#define CUSTOM_JSON_SIZE 150
 
 #define IBEACON_CHUNK       ( PUBLISH_CHUNK / IBEACON_JSON_SIZE )
 #define KONTAKT_CHUNK       ( PUBLISH_CHUNK / KONTAKT_JSON_SIZE )
@@ -35,6 +36,7 @@
 #define LAIRDBT510_CHUNK    ( PUBLISH_CHUNK / LAIRDBT510_JSON_SIZE )
 #define BTHOME_CHUNK        ( PUBLISH_CHUNK / BTHOME_JSON_SIZE )
 #define RUUVI_CHUNK         ( PUBLISH_CHUNK / RUUVI_JSON_SIZE )
+#define CUSTOM_CHUNK        ( PUBLISH_CHUNK / CUSTOM_JSON_SIZE )
 
 #define IBEACON_NONSAVER    ( 5000 / IBEACON_JSON_SIZE )
 #define KONTAKT_NONSAVER    ( 5000 / KONTAKT_JSON_SIZE )
@@ -42,6 +44,7 @@
 #define LAIRDBT510_NONSAVER ( 5000 / LAIRDBT510_JSON_SIZE )
 #define BTHOME_NONSAVER     ( 5000 / BTHOME_JSON_SIZE )
 #define RUUVI_NONSAVER      ( 5000 / RUUVI_JSON_SIZE )
+#define CUSTOM_NONSAVER     ( 5000 / CUSTOM_JSON_SIZE )
 
 Beaconscanner *Beaconscanner::_instance = nullptr;
 
@@ -49,16 +52,44 @@ template<typename T>
 String Beaconscanner::getJson(Vector<T>* beacons, uint8_t count, void *context)
 {
     Beaconscanner *ctx = (Beaconscanner *)context;
+    int oversized = 0;
     ctx->writer->beginObject();
-    SINGLE_THREADED_BLOCK() {
-    while(count > 0 && !beacons->isEmpty())
+    while (count > 0)
     {
-        beacons->takeFirst().toJson(ctx->writer);
+        T beacon;
+        bool taken = false;
+        SINGLE_THREADED_BLOCK() {
+            if (!beacons->isEmpty()) {
+                // Measured first, the count is only an estimate and the writer silently truncates
+                JSONBufferWriter counter(nullptr, 0);
+                beacons->first().toJson(&counter);
+                size_t needed = counter.dataSize() + 1;     // And the separator
+                bool fits = ctx->writer->dataSize() + needed + 1 <= ctx->writer->bufferSize();
+                if (fits || ctx->writer->dataSize() <= 1) {
+                    ctx->dropped(beacons->first());
+                    beacon = beacons->takeFirst();
+                    taken = true;
+                    if (fits) {
+                        beacon.toJson(ctx->writer);
+                    } else {
+                        oversized++;    // Can't fit in any event
+                    }
+                }
+                // Otherwise it starts the next chunk
+            }
+        }
+        if (!taken) {
+            break;
+        }
+        // A BT510 being configured gives up its connection, outside of the lock
+        abandon(beacon);
         count--;
     }
+    if (oversized) {
+        Log.warn("%d beacons larger than an event, dropped", oversized);
     }
     ctx->writer->endObject();
-    return String::format("%.*s", ctx->writer->dataSize(), ctx->writer->buffer());
+    return String::format("%.*s", (int)std::min(ctx->writer->dataSize(), ctx->writer->bufferSize()), ctx->writer->buffer());
 }
 
 void custom_scan_params() {
@@ -88,6 +119,7 @@ void custom_scan_params() {
     BLE.setScanParameters(&scanParams); 
 }
 
+// The beacons are stored under the lock, the application reads them from its own thread
 void Beaconscanner::processScan(Vector<BleScanResult> scans) {
     while(!scans.isEmpty()) {
         BleScanResult scan = scans.takeFirst();
@@ -96,37 +128,65 @@ void Beaconscanner::processScan(Vector<BleScanResult> scans) {
 #ifdef SUPPORT_IBEACON
         else if ((_flags & SCAN_IBEACON) && iBeaconScan::isBeacon(scanResult) && !iPublished.contains(ADDRESS(scanResult)))
         {
-            iBeaconScan::addOrUpdate(scanResult);
+            SINGLE_THREADED_BLOCK() {
+                ingested(iBeaconScan::addOrUpdate(scanResult), scanResult);
+            }
         }
 #endif
 #ifdef SUPPORT_KONTAKT
         else if ((_flags & SCAN_KONTAKT) && KontaktTag::isTag(scanResult) && !kPublished.contains(ADDRESS(scanResult)))
         {
-            KontaktTag::addOrUpdate(scanResult);
+            SINGLE_THREADED_BLOCK() {
+                KontaktTag& k = KontaktTag::addOrUpdate(scanResult);
+                ingested(k, scanResult);
+                checkMotion(k);
+            }
         }
 #endif
 #ifdef SUPPORT_EDDYSTONE 
         else if ((_flags & SCAN_EDDYSTONE) && Eddystone::isBeacon(scanResult) && !ePublished.contains(ADDRESS(scanResult)))
         {
-            Eddystone::addOrUpdate(scanResult);
+            SINGLE_THREADED_BLOCK() {
+                Eddystone& e = Eddystone::addOrUpdate(scanResult);
+                ingested(e, scanResult);
+#ifdef SUPPORT_KKMSMART
+                checkMotion(e);
+#endif
+            }
         }
 #endif
 #ifdef SUPPORT_LAIRDBT510
         else if ((_flags & SCAN_LAIRDBT510) && LairdBt510::isBeacon(scanResult) && !lPublished.contains(ADDRESS(scanResult)))
         {
-            LairdBt510::addOrUpdate(scanResult);
+            SINGLE_THREADED_BLOCK() {
+                ingested(LairdBt510::addOrUpdate(scanResult), scanResult);
+            }
         }
 #endif
 #ifdef SUPPORT_BTHOME
         else if ((_flags & SCAN_BTHOME) && BTHome::isBeacon(scanResult) && !sPublished.contains(ADDRESS(scanResult)))
         {
-            BTHome::addOrUpdate(scanResult);
+            SINGLE_THREADED_BLOCK() {
+                ingested(BTHome::addOrUpdate(scanResult), scanResult);
+            }
         }
 #endif
 #ifdef SUPPORT_RUUVI
         else if ((_flags & SCAN_RUUVI) && Ruuvi::isBeacon(scanResult) && !rPublished.contains(ADDRESS(scanResult)))
         {
-            Ruuvi::addOrUpdate(scanResult);
+            SINGLE_THREADED_BLOCK() {
+                Ruuvi& r = Ruuvi::addOrUpdate(scanResult);
+                ingested(r, scanResult);
+                checkMotion(r);
+            }
+        }
+#endif
+#ifdef SUPPORT_CUSTOM
+        else if ((_flags & SCAN_CUSTOM) && CustomBeacon::isBeacon(scanResult) && !cPublished.contains(ADDRESS(scanResult)))
+        {
+            SINGLE_THREADED_BLOCK() {
+                ingested(CustomBeacon::addOrUpdate(scanResult), scanResult);
+            }
         }
 #endif
         else if (_customCallback) {
@@ -138,6 +198,22 @@ void Beaconscanner::processScan(Vector<BleScanResult> scans) {
 void Beaconscanner::customScan(uint16_t duration, bool rate_limit)
 {
     custom_scan_params();
+    _priority.clear();
+    _devices.clear();
+    _ranking.clear();
+    _ranked.clear();
+    for (uint8_t i = 0; i < BEACON_INDEX_COUNT; i++) {
+        _index[i].clear();
+    }
+    _index_keys.clear();
+    _index_dirty = false;
+    if (_changes_on) {
+        // Consumers start over
+        _changes.clear();
+        _stamps.clear();
+        _tombstones = 0;
+        _lost_generation = _generation;
+    }
 #ifdef SUPPORT_KONTAKT
     kPublished.clear();
     KontaktTag::beacons.clear();
@@ -152,10 +228,9 @@ void Beaconscanner::customScan(uint16_t duration, bool rate_limit)
 #endif
 #ifdef SUPPORT_LAIRDBT510
     lPublished.clear();
-    LairdBt510::beacons.clear();
-#endif
-#ifdef SUPPORT_LAIRDBT510
-    lPublished.clear();
+    for (auto& l : LairdBt510::beacons) {
+        abandon(l);
+    }
     LairdBt510::beacons.clear();
 #endif
 #ifdef SUPPORT_BTHOME
@@ -165,12 +240,17 @@ void Beaconscanner::customScan(uint16_t duration, bool rate_limit)
 #ifdef SUPPORT_RUUVI
     rPublished.clear();
     Ruuvi::beacons.clear();
+#endif
+#ifdef SUPPORT_CUSTOM
+    cPublished.clear();
+    CustomBeacon::beacons.clear();
 #endif
     long int elapsed = millis();
     while(millis() - elapsed < duration*1000)
     {
         Vector<BleScanResult> cur_responses = BLE.scan();
         processScan(cur_responses);
+        publishPriority();
 #ifdef SUPPORT_IBEACON
         if (_publish && (  
             (_memory_saver && iBeaconScan::beacons.size() >= IBEACON_CHUNK) ||
@@ -248,8 +328,21 @@ void Beaconscanner::customScan(uint16_t duration, bool rate_limit)
             }
             publish(SCAN_RUUVI, rate_limit);
         }
-    }
 #endif
+#ifdef SUPPORT_CUSTOM
+        if (_publish && (
+            (_memory_saver && CustomBeacon::beacons.size() >= CUSTOM_CHUNK) ||
+            (!_memory_saver && CustomBeacon::beacons.size() >= CUSTOM_NONSAVER)
+        ))
+        {
+            for (uint8_t i=0;i < CUSTOM_CHUNK;i++)
+            {
+                cPublished.append(CustomBeacon::beacons.at(i).getAddress());
+            }
+            publish(SCAN_CUSTOM, rate_limit);
+        }
+#endif
+    }
 }
 
 void Beaconscanner::scanAndPublish(uint16_t duration, int flags, const char* eventName, PublishFlags pFlags, bool memory_saver, bool rate_limit)
@@ -285,6 +378,10 @@ void Beaconscanner::scanAndPublish(uint16_t duration, int flags, const char* eve
     while (!Ruuvi::beacons.isEmpty())
         publish(SCAN_RUUVI, rate_limit);
 #endif
+#ifdef SUPPORT_CUSTOM
+    while (!CustomBeacon::beacons.isEmpty())
+        publish(SCAN_CUSTOM, rate_limit);
+#endif
 }
 
 void Beaconscanner::scan(uint16_t duration, int flags)
@@ -314,6 +411,7 @@ void Beaconscanner::scan_thread(void *param) {
 
 void Beaconscanner::startContinuous(int flags) {
     _flags = flags;
+    _publish = false;
     _run = true;
     if (_thread == nullptr) 
         _thread = new Thread("scan_thread", scan_thread);
@@ -324,265 +422,1645 @@ void Beaconscanner::stopContinuous() {
 }
 
 void Beaconscanner::loop() {
-#ifdef SUPPORT_IBEACON
-    for (auto& i : iBeaconScan::beacons) {
-        if (_callback && i.newly_scanned) {
-            _callback(i, NEW);
-            i.newly_scanned = false;
+    loop(0);
+}
+
+bool Beaconscanner::loop(uint32_t max_micros) {
+    uint32_t start = micros();
+    // Each call resumes with the step that ran out of time, so a busy step can't starve the others
+    for (uint8_t n = 0; n < LOOP_STEPS; n++) {
+        bool finished = true;
+        switch (_loop_step) {
+            case LOOP_EVENTS:
+                finished = deliverEvents(start, max_micros);
+                break;
+            case LOOP_DEVICES:
+                finished = runDevices(start, max_micros);
+                break;
+            case LOOP_SWEEP:
+                finished = sweep(start, max_micros);
+                break;
+        }
+        if (!finished) {
+            return false;
+        }
+        _loop_step = (_loop_step + 1) % LOOP_STEPS;
+        if (expired(start, max_micros)) {
+            break;
         }
     }
-#endif
-#ifdef SUPPORT_EDDYSTONE
-    for (auto& e : Eddystone::beacons) {
-        if (_callback && e.newly_scanned) {
-            _callback(e, NEW);
-            e.newly_scanned = false;
+    return getBacklog() == 0;
+}
+
+uint32_t Beaconscanner::getBacklog() const {
+    uint32_t backlog = _event_count;
+    if (_sweeping && _sweep_type > SCAN_CUSTOM) {
+        backlog += std::max(_devices.size() - _loop_cursor, 0);
+    } else if (_sweeping) {
+        backlog += std::max(count(_sweep_type) - _loop_cursor, 0);
+        for (uint8_t type = _sweep_type << 1; type <= SCAN_CUSTOM; type <<= 1) {
+            backlog += count(type);
+        }
+        backlog += _devices.size();
+    } else if (_scan_done) {
+        for (uint8_t type = SCAN_IBEACON; type <= SCAN_CUSTOM; type <<= 1) {
+            backlog += count(type);
         }
+        backlog += _devices.size();
     }
+    return backlog;
+}
+
+bool Beaconscanner::deliverEvents(uint32_t start, uint32_t max_micros) {
+    ScanEvent event;
+    while (takeEvent(event)) {
+        if (event.event & (MOVED | STILL)) {
+            motionTransition(event.address, event.event == MOVED);
+        }
+        switch (event.beacon_type)
+        {
+            case 0:
+            {
+                BeaconDevice device;
+                bool found = false;
+                SINGLE_THREADED_BLOCK() {
+                    BeaconDevice* d = findDevice(event.address);
+                    if (d) {
+                        device = *d;
+                        found = true;
+                    }
+                }
+                if (found && _deviceCallback) {
+                    _deviceCallback(device, (callback_type)event.event);
+                }
+                break;
+            }
+#ifdef SUPPORT_IBEACON
+            case SCAN_IBEACON:
+                deliver(iBeaconScan::beacons, event);
+                break;
 #endif
 #ifdef SUPPORT_KONTAKT
-    for (KontaktTag& k : KontaktTag::beacons) {
-        if (_callback && k.newly_scanned) {
-            _callback(k, NEW);
-            k.newly_scanned = false;
-        }
-    }
+            case SCAN_KONTAKT:
+                deliver(KontaktTag::beacons, event);
+                break;
+#endif
+#ifdef SUPPORT_EDDYSTONE
+            case SCAN_EDDYSTONE:
+                deliver(Eddystone::beacons, event);
+                break;
 #endif
 #ifdef SUPPORT_LAIRDBT510
-    for (LairdBt510& l : LairdBt510::beacons) {
-        if (_callback && l.newly_scanned) {
-            _callback(l, NEW);
-            l.newly_scanned = false;
-        }
-        l.loop();
-    }
+            case SCAN_LAIRDBT510:
+                deliver(LairdBt510::beacons, event);
+                break;
 #endif
 #ifdef SUPPORT_BTHOME
-    for (BTHome& s : BTHome::beacons) {
-        if (_callback && s.newly_scanned) {
-            _callback(s, NEW);
-            s.newly_scanned = false;
-        }
-    }
+            case SCAN_BTHOME:
+                deliver(BTHome::beacons, event);
+                break;
 #endif
 #ifdef SUPPORT_RUUVI
-    for (Ruuvi& r : Ruuvi::beacons) {
-        if (_callback && r.newly_scanned) {
-            _callback(r, NEW);
-            r.newly_scanned = false;
+            case SCAN_RUUVI:
+                deliver(Ruuvi::beacons, event);
+                break;
+#endif
+#ifdef SUPPORT_CUSTOM
+            case SCAN_CUSTOM:
+                deliver(CustomBeacon::beacons, event);
+                break;
+#endif
+            default:
+                break;
+        }
+        if (expired(start, max_micros)) {
+            return _event_count == 0;
         }
     }
-#endif
+    return true;
+}
 
-    if (_scan_done) {
-#ifdef SUPPORT_IBEACON
-        for (auto& i : iBeaconScan::beacons) {
-            if (i.missed_scan >= _clear_missed) {
-                if (_callback) {
-                    _callback(i, REMOVED);
-                }
-                i.missed_scan = -1; // Use an invalid value to mark for removal
-            } else {
-                i.missed_scan++;
-            }
+bool Beaconscanner::keyBefore(uint8_t type, const BleAddress& address, const Beacon& beacon) {
+    if (type != beacon.type) {
+        return type < beacon.type;
+    }
+    BleAddress other = beacon.getAddress();
+    for (uint8_t i = 0; i < BLE_SIG_ADDR_LEN; i++) {
+        if (address[i] != other[i]) {
+            return address[i] < other[i];
         }
-        SINGLE_THREADED_BLOCK() {
-            for (int i = 0; i < iBeaconScan::beacons.size(); i++) {
-                if (iBeaconScan::beacons.at(i).missed_scan < 0) {
-                    iBeaconScan::beacons.removeAt(i);
-                    i--;
-                }
-            }
+    }
+    return false;
+}
+
+// Binary search for the entry of the beacon, or where to insert it
+template<typename E>
+int Beaconscanner::findKey(const Vector<E>& entries, const Beacon& beacon, bool& found) {
+    int low = 0, high = entries.size();
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (keyBefore(entries.at(mid).type, entries.at(mid).address, beacon)) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
-#endif
-#ifdef SUPPORT_EDDYSTONE
-        for (auto& e : Eddystone::beacons) {
-            if (e.missed_scan >= _clear_missed) {
-                if (_callback) {
-                    _callback(e, REMOVED);
-                }
-                e.missed_scan = -1;
-            } else {
-                e.missed_scan++;
-            }
+    }
+    found = low < entries.size() && entries.at(low).type == beacon.type && entries.at(low).address == beacon.getAddress();
+    return low;
+}
+
+template<typename T>
+static T* findBeacon(Vector<T>& beacons, const BleAddress& address) {
+    for (auto& b : beacons) {
+        if (b.getAddress() == address) {
+            return &b;
         }
-        SINGLE_THREADED_BLOCK() {
-            for (int i = 0; i < Eddystone::beacons.size(); i++) {
-                if (Eddystone::beacons.at(i).missed_scan < 0) {
-                    Eddystone::beacons.removeAt(i);
-                    i--;
-                }
+    }
+    return nullptr;
+}
+
+// The callbacks get a copy, the scan thread may grow the Vector while they run
+template<typename T>
+void Beaconscanner::deliver(Vector<T>& beacons, const ScanEvent& event) {
+    T beacon;
+    bool found = false;
+    uint32_t fields = 0;
+    SINGLE_THREADED_BLOCK() {
+        T* b = nullptr;
+        if (event.position < beacons.size() && beacons.at(event.position).getAddress() == event.address) {
+            b = &beacons.at(event.position);
+        } else {
+            // Moved down by a removal since the event was queued
+            b = findBeacon(beacons, event.address);
+        }
+        if (b) {
+            beacon = *b;
+            found = true;
+            if (event.event == UPDATED) {
+                fields = b->pending_fields;
+                b->pending_fields = 0;
             }
         }
+    }
+    if (found && (event.event != UPDATED || fields)) {
+        notify(beacon, (callback_type)event.event, fields);
+    }
+}
+
+template<typename T>
+static int positionIn(const Vector<T>& beacons, const Beacon& beacon) {
+    if (beacons.isEmpty()) {
+        return -1;
+    }
+    int position = &static_cast<const T&>(beacon) - &beacons.at(0);
+    return (position >= 0 && position < beacons.size()) ? position : -1;
+}
+
+// Position of a stored beacon in its Vector, -1 for a copy
+int Beaconscanner::positionOf(const Beacon& beacon) const {
+    switch (beacon.type)
+    {
+#ifdef SUPPORT_IBEACON
+        case SCAN_IBEACON:
+            return positionIn(iBeaconScan::beacons, beacon);
 #endif
 #ifdef SUPPORT_KONTAKT
-        for (auto& k : KontaktTag::beacons) {
-            if (k.missed_scan >= _clear_missed) {
-                if (_callback) {
-                    _callback(k, REMOVED);
-                } 
-                k.missed_scan = -1;
-            } else {
-                k.missed_scan++;
-            }
-        }
-        SINGLE_THREADED_BLOCK() {
-            for (int i = 0; i < KontaktTag::beacons.size(); i++) {
-                if (KontaktTag::beacons.at(i).missed_scan < 0) {
-                    KontaktTag::beacons.removeAt(i);
-                    i--;
-                }
-            }
-        }
+        case SCAN_KONTAKT:
+            return positionIn(KontaktTag::beacons, beacon);
+#endif
+#ifdef SUPPORT_EDDYSTONE
+        case SCAN_EDDYSTONE:
+            return positionIn(Eddystone::beacons, beacon);
 #endif
 #ifdef SUPPORT_LAIRDBT510
-        for (auto& l : LairdBt510::beacons) {
-            if (l.state_ == LairdBt510::State::IDLE && l.missed_scan >= _clear_missed) {
-                if (_callback) {
-                    _callback(l, REMOVED);
-                }
-                l.missed_scan = -1;
-            } else {
-                l.missed_scan++;
-            }
-        }
-        SINGLE_THREADED_BLOCK() {
-            for (int i = 0; i < LairdBt510::beacons.size(); i++) {
-                if (LairdBt510::beacons.at(i).missed_scan < 0) {
-                    LairdBt510::beacons.removeAt(i);
-                    i--;
-                }
-            }
-        }
+        case SCAN_LAIRDBT510:
+            return positionIn(LairdBt510::beacons, beacon);
 #endif
 #ifdef SUPPORT_BTHOME
-        for (auto& s : BTHome::beacons) {
-            if (s.missed_scan >= _clear_missed) {
-                if (_callback) {
-                    _callback(s, REMOVED);
-                }
-                s.missed_scan = -1;
-            } else {
-                s.missed_scan++;
-            }
+        case SCAN_BTHOME:
+            return positionIn(BTHome::beacons, beacon);
+#endif
+#ifdef SUPPORT_RUUVI
+        case SCAN_RUUVI:
+            return positionIn(Ruuvi::beacons, beacon);
+#endif
+#ifdef SUPPORT_CUSTOM
+        case SCAN_CUSTOM:
+            return positionIn(CustomBeacon::beacons, beacon);
+#endif
+        default:
+            return -1;
+    }
+}
+
+bool Beaconscanner::runDevices(uint32_t start, uint32_t max_micros) {
+#ifdef SUPPORT_LAIRDBT510
+    while (_loop_cursor < LairdBt510::beacons.size()) {
+        LairdBt510::beacons.at(_loop_cursor++).loop();
+        if (expired(start, max_micros) && _loop_cursor < LairdBt510::beacons.size()) {
+            return false;
         }
+    }
+    _loop_cursor = 0;
+    if (LairdBt510Scheduler::_instance) {
+        LairdBt510Scheduler::_instance->loop();
+    }
+#endif
+#ifdef SUPPORT_IBEACON
+    iBeaconScan::updateRegions(false, _clear_missed);
+#endif
+    publishPriority();
+    publishMotion();
+    return true;
+}
+
+bool Beaconscanner::removable(const Beacon&) {
+    return true;
+}
+
+#ifdef SUPPORT_LAIRDBT510
+// BT510 sensors are kept while connected, even if they stop advertising
+bool Beaconscanner::removable(const LairdBt510& l) {
+    return l.state_ == LairdBt510::State::IDLE;
+}
+#endif
+
+// Called from the scan thread for each advertisement, and from loop() by the sweep
+void Beaconscanner::checkMotion(Beacon& beacon, MotionDetector& motion) {
+    bool transition;
+    bool moving;
+    SINGLE_THREADED_BLOCK() {
+        transition = motion.takeTransition();
+        moving = motion.isMoving();
+    }
+    if (transition) {
+        queueEvent(beacon, moving ? MOVED : STILL);
+    }
+}
+
+template<typename T>
+bool Beaconscanner::sweep(Vector<T>& beacons, uint32_t start, uint32_t max_micros) {
+    while (_loop_cursor < beacons.size()) {
+        // Expired beacons are removed right away, so that an advertisement arriving before the
+        // next loop() can't bring back a beacon that was already reported as REMOVED
+        T removed;
+        bool remove = false;
         SINGLE_THREADED_BLOCK() {
-            for (int i = 0; i < BTHome::beacons.size(); i++) {
-                if (BTHome::beacons.at(i).missed_scan < 0) {
-                    BTHome::beacons.removeAt(i);
-                    i--;
+            T& b = beacons.at(_loop_cursor);
+            int8_t missed = b.missed_scan;
+            if (_track_devices) {
+                // Kept while the device advertises as any type
+                const BeaconDevice* device = findDevice(b.getAddress());
+                if (device) {
+                    missed = device->missed_scan;
                 }
             }
-        }
-#endif
-#ifdef SUPPORT_RUUVI
-        for (auto& r : Ruuvi::beacons) {
-            if (r.missed_scan >= _clear_missed) {
-                if (_callback) {
-                    _callback(r, REMOVED);
-                }
-                r.missed_scan = -1;
+            if ((missed >= _clear_missed || orphaned(b)) && removable(b)) {
+                removed = b;
+                remove = true;
+                dropped(b);
+                beacons.removeAt(_loop_cursor);
             } else {
-                r.missed_scan++;
+                b.missed_scan++;
+                // Tags that stopped advertising still go STILL
+                checkMotion(b);
+                _loop_cursor++;
             }
         }
-        SINGLE_THREADED_BLOCK() {
-            for (int i = 0; i < Ruuvi::beacons.size(); i++) {
-                if (Ruuvi::beacons.at(i).missed_scan < 0) {
-                    Ruuvi::beacons.removeAt(i);
-                    i--;
-                }
-            }
+        if (remove) {
+            notify(removed, REMOVED);
+        }
+        if (expired(start, max_micros) && _loop_cursor < beacons.size()) {
+            return false;
         }
-#endif
-        _scan_done = false;
     }
+    return true;
 }
 
-void Beaconscanner::publish(const char* eventName, int type, bool rate_limit)
-{
-    _eventName = eventName;
+bool Beaconscanner::sweep(uint32_t start, uint32_t max_micros) {
+    if (!_sweeping) {
+        if (!_scan_done) {
+            return true;
+        }
+        // A scan period that ends during the sweep sets _scan_done again, for the next sweep
+        _scan_done = false;
+        _sweeping = true;
 #ifdef SUPPORT_IBEACON
-    if (type & SCAN_IBEACON) {
-        while (!iBeaconScan::beacons.isEmpty()) {
-            publish(SCAN_IBEACON, rate_limit);
+        iBeaconScan::updateRegions(true, _clear_missed);
+#endif
+        for (auto& d : _devices) {
+            if (d.seen) {
+                d.missed_scan = 0;
+            } else if (d.missed_scan < INT8_MAX) {
+                d.missed_scan++;
+            }
+            d.seen = false;
         }
+        _sweep_type = SCAN_IBEACON;
+        _loop_cursor = 0;
     }
+    for (; _sweep_type <= SCAN_CUSTOM; _sweep_type <<= 1, _loop_cursor = 0) {
+        bool finished = true;
+        switch (_sweep_type) {
+#ifdef SUPPORT_IBEACON
+            case SCAN_IBEACON:
+                finished = sweep(iBeaconScan::beacons, start, max_micros);
+                break;
 #endif
 #ifdef SUPPORT_KONTAKT
-    if (type & SCAN_KONTAKT) {
-        while (!KontaktTag::beacons.isEmpty()) {
-            publish(SCAN_KONTAKT, rate_limit);
-        }
-    }
+            case SCAN_KONTAKT:
+                finished = sweep(KontaktTag::beacons, start, max_micros);
+                break;
 #endif
 #ifdef SUPPORT_EDDYSTONE
-    if (type & SCAN_EDDYSTONE) {
-        while (!Eddystone::beacons.isEmpty()) {
-            publish(SCAN_EDDYSTONE, rate_limit);
-        }
-    }
+            case SCAN_EDDYSTONE:
+                finished = sweep(Eddystone::beacons, start, max_micros);
+                break;
 #endif
 #ifdef SUPPORT_LAIRDBT510
-    if (type & SCAN_LAIRDBT510) {
-        while (!LairdBt510::beacons.isEmpty()) {
-            publish(SCAN_LAIRDBT510, rate_limit);
-        }
-    }
+            case SCAN_LAIRDBT510:
+                finished = sweep(LairdBt510::beacons, start, max_micros);
+                break;
 #endif
 #ifdef SUPPORT_BTHOME
-    if (type & SCAN_BTHOME) {
-        while (!BTHome::beacons.isEmpty()) {
-            publish(SCAN_BTHOME, rate_limit);
-        }
-    }
+            case SCAN_BTHOME:
+                finished = sweep(BTHome::beacons, start, max_micros);
+                break;
 #endif
 #ifdef SUPPORT_RUUVI
-    if (type & SCAN_RUUVI) {
-        while (!Ruuvi::beacons.isEmpty()) {
-            publish(SCAN_RUUVI, rate_limit);
+            case SCAN_RUUVI:
+                finished = sweep(Ruuvi::beacons, start, max_micros);
+                break;
+#endif
+#ifdef SUPPORT_CUSTOM
+            case SCAN_CUSTOM:
+                finished = sweep(CustomBeacon::beacons, start, max_micros);
+                break;
+#endif
+            default:
+                break;
+        }
+        if (!finished) {
+            return false;
         }
     }
-#endif
+    if (!sweepDevices(start, max_micros)) {
+        return false;
+    }
+    _sweeping = false;
+    _loop_cursor = 0;
+    return true;
 }
 
-void Beaconscanner::publish(int type, bool rate_limit)
-{
-    char *buf = new char[PUBLISH_CHUNK];
-    writer = new JSONBufferWriter(buf, PUBLISH_CHUNK);
-    while (millis() - _last_publish < 1000) {
-        delay(50);
+bool Beaconscanner::sweepDevices(uint32_t start, uint32_t max_micros) {
+    while (_loop_cursor < _devices.size()) {
+        BeaconDevice removed;
+        bool remove = false;
+        SINGLE_THREADED_BLOCK() {
+            BeaconDevice& d = _devices.at(_loop_cursor);
+            if (d.missed_scan >= _clear_missed) {
+                // The sweep of each type removed the beacons of the device, unless they are kept
+                // for another reason. It goes away with the last one.
+                for (uint8_t type = SCAN_IBEACON; type <= SCAN_CUSTOM; type <<= 1) {
+                    if ((d.types & type) && !find(type, d.address)) {
+                        d.types &= ~type;
+                    }
+                }
+                remove = (d.types == 0);
+            }
+            if (remove) {
+                removed = d;
+                _devices.removeAt(_loop_cursor);
+            } else {
+                _loop_cursor++;
+            }
+        }
+        if (remove && _deviceCallback) {
+            _deviceCallback(removed, REMOVED);
+        }
+        if (expired(start, max_micros) && _loop_cursor < _devices.size()) {
+            return false;
+        }
     }
+    return true;
+}
+
+int Beaconscanner::count(uint8_t type) const {
     switch (type)
     {
 #ifdef SUPPORT_IBEACON
         case SCAN_IBEACON:
-            Particle.publish(String::format("%s-ibeacon", _eventName), getJson(&iBeaconScan::beacons, std::min(IBEACON_CHUNK, iBeaconScan::beacons.size()), this),_pFlags);
-            break;
+            return iBeaconScan::beacons.size();
 #endif
 #ifdef SUPPORT_KONTAKT
         case SCAN_KONTAKT:
-            Particle.publish(String::format("%s-kontakt", _eventName), getJson(&KontaktTag::beacons, std::min(KONTAKT_CHUNK, KontaktTag::beacons.size()), this),_pFlags);
-            break;
+            return KontaktTag::beacons.size();
 #endif
 #ifdef SUPPORT_EDDYSTONE
         case SCAN_EDDYSTONE:
-            Particle.publish(String::format("%s-eddystone", _eventName), getJson(&Eddystone::beacons, std::min(EDDYSTONE_CHUNK, Eddystone::beacons.size()),this), _pFlags);
-            break;
+            return Eddystone::beacons.size();
 #endif
 #ifdef SUPPORT_LAIRDBT510
         case SCAN_LAIRDBT510:
-            Particle.publish(String::format("%s-lairdbt510", _eventName), getJson(&LairdBt510::beacons, std::min(LAIRDBT510_CHUNK, LairdBt510::beacons.size()), this), _pFlags);
-            break;
+            return LairdBt510::beacons.size();
 #endif
 #ifdef SUPPORT_BTHOME
         case SCAN_BTHOME:
-            Particle.publish(String::format("%s-bthome", _eventName), getJson(&BTHome::beacons, std::min(BTHOME_CHUNK, BTHome::beacons.size()), this), _pFlags);
-            break;
+            return BTHome::beacons.size();
 #endif
 #ifdef SUPPORT_RUUVI
         case SCAN_RUUVI:
-            Particle.publish(String::format("%s-ruuvi", _eventName), getJson(&Ruuvi::beacons, std::min(RUUVI_CHUNK, Ruuvi::beacons.size()), this), _pFlags);
+            return Ruuvi::beacons.size();
+#endif
+#ifdef SUPPORT_CUSTOM
+        case SCAN_CUSTOM:
+            return CustomBeacon::beacons.size();
+#endif
+        default:
+            return 0;
+    }
+}
+
+void Beaconscanner::motionTransition(const BleAddress& address, bool moving) {
+    if (_motionEventName) {
+        for (auto& m : _motionEvents) {
+            if (m.address == address) {
+                // Not published yet, only the latest state matters
+                m.moving = moving;
+                return;
+            }
+        }
+        _motionEvents.append({address, moving});
+    }
+}
+
+void Beaconscanner::ingested(Beacon& beacon, const BleScanResult* scanResult) {
+    if (_changes_on && (beacon.newly_scanned || beacon.changed_fields)) {
+        stamp(beacon, beacon.newly_scanned ? NEW : UPDATED);
+    }
+    if (_track_devices) {
+        noteDevice(beacon, RSSI(scanResult));
+    }
+    if (_indexes && !_index_dirty && positionOf(beacon) >= 0) {
+        updateIndexes(beacon, positionOf(beacon));
+    }
+    if (beacon.newly_scanned) {
+        beacon.newly_scanned = false;
+        queueEvent(beacon, NEW);
+    } else if (beacon.changed_fields && (_update_types & beacon.type)) {
+        queueEvent(beacon, UPDATED);
+    }
+    if (beacon.changed_fields & _priority_fields[typeIndex(beacon.type)]) {
+        queuePriority(beacon);
+    }
+    beacon.changed_fields = 0;
+    if (beacon.proximity.takeTransition() && (_zone_types & beacon.type)) {
+        queueEvent(beacon, ZONE);
+    }
+    if (_ranking_on) {
+        rank(beacon);
+    }
+}
+
+void Beaconscanner::queuePriority(const Beacon& beacon) {
+    if (!_priorityEventName && !_publish) {
+        return;
+    }
+    SINGLE_THREADED_BLOCK() {
+        for (const auto& p : _priority) {
+            if (p.beacon_type == beacon.type && p.address == beacon.getAddress()) {
+                return;     // Already waiting, it is published with its latest data
+            }
+        }
+        if (_priority.size() < BEACON_EVENT_QUEUE_SIZE) {
+            ScanEvent p;
+            p.address = beacon.getAddress();
+            p.beacon_type = beacon.type;
+            p.event = UPDATED;
+            _priority.append(p);
+        }
+    }
+}
+
+int Beaconscanner::compare(const BleAddress& a, const BleAddress& b) {
+    for (uint8_t i = 0; i < BLE_SIG_ADDR_LEN; i++) {
+        if (a[i] != b[i]) {
+            return a[i] < b[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+// Binary search of the sorted devices. Returns the index of the device, or where it would be inserted.
+int Beaconscanner::findDevice(const BleAddress& address, bool& found) const {
+    int low = 0, high = _devices.size();
+    while (low < high) {
+        int mid = (low + high) / 2;
+        int c = compare(_devices.at(mid).address, address);
+        if (c == 0) {
+            found = true;
+            return mid;
+        }
+        if (c < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    found = false;
+    return low;
+}
+
+BeaconDevice* Beaconscanner::findDevice(const BleAddress& address) {
+    bool found;
+    int index = findDevice(address, found);
+    return found ? &_devices.at(index) : nullptr;
+}
+
+Beaconscanner& Beaconscanner::trackDevices(bool enable) {
+    _track_devices = enable;
+    if (!enable) {
+        SINGLE_THREADED_BLOCK() {
+            _devices.clear();
+        }
+    }
+    return *this;
+}
+
+void Beaconscanner::noteDevice(const Beacon& beacon, int8_t rssi) {
+    bool found;
+    SINGLE_THREADED_BLOCK() {
+        int index = findDevice(beacon.getAddress(), found);
+        if (!found) {
+            BeaconDevice device;
+            device.address = beacon.getAddress();
+            _devices.insert(index, device);
+        }
+        BeaconDevice& device = _devices.at(index);
+        device.types |= beacon.type;
+        device.seen = true;
+        device.proximity.update(rssi);
+    }
+    if (!found && _deviceCallback) {
+        SINGLE_THREADED_BLOCK() {
+            pushEvent(beacon.getAddress(), 0, NEW);
+        }
+    }
+}
+
+static const char* typeName(uint8_t type) {
+    switch (type) {
+        case SCAN_IBEACON: return "ibeacon";
+        case SCAN_KONTAKT: return "kontakt";
+        case SCAN_EDDYSTONE: return "eddystone";
+        case SCAN_LAIRDBT510: return "lairdbt510";
+        case SCAN_BTHOME: return "bthome";
+        case SCAN_RUUVI: return "ruuvi";
+        default: return "custom";
+    }
+}
+
+// The address and RSSI, then the data of each type
+void Beaconscanner::deviceToJson(const BeaconDevice& device, JSONWriter& writer) {
+    writer.name(device.address.toString()).beginObject();
+    writer.name("rssi").value(device.getRssi());
+    for (uint8_t type = SCAN_IBEACON; type <= SCAN_CUSTOM; type <<= 1) {
+        Beacon* beacon = (device.types & type) ? find(type, device.address) : nullptr;
+        if (beacon) {
+            writer.name(typeName(type)).beginObject();
+            beacon->fieldsToJson(&writer);
+            writer.endObject();
+        }
+    }
+    writer.endObject();
+}
+
+void Beaconscanner::publishDevices(const char* eventName, PublishFlags pFlags) {
+    char *buf = new char[PUBLISH_CHUNK];
+    int index = 0;
+    while (index < _devices.size()) {
+        JSONBufferWriter deviceWriter(buf, PUBLISH_CHUNK);
+        deviceWriter.beginObject();
+        while (index < _devices.size()) {
+            bool full = false;
+            SINGLE_THREADED_BLOCK() {
+                const BeaconDevice& device = _devices.at(index);
+                // Measured first, the JSONBufferWriter silently truncates what doesn't fit
+                JSONBufferWriter counter(nullptr, 0);
+                deviceToJson(device, counter);
+                size_t needed = counter.dataSize() + 1;     // And the separator
+                if (deviceWriter.dataSize() + needed + 1 <= PUBLISH_CHUNK) {
+                    deviceToJson(device, deviceWriter);
+                } else if (deviceWriter.dataSize() > 1) {
+                    full = true;        // Next event
+                }
+                // A device larger than an event is skipped
+            }
+            if (full) {
+                break;
+            }
+            index++;
+        }
+        deviceWriter.endObject();
+        while (millis() - _last_publish < 1000) {
+            delay(50);
+        }
+        Particle.publish(String::format("%s-device", eventName), String::format("%.*s", (int)std::min(deviceWriter.dataSize(), deviceWriter.bufferSize()), deviceWriter.buffer()), pFlags);
+        _last_publish = millis();
+    }
+    delete[] buf;
+}
+
+bool Beaconscanner::publishPriority() {
+    const char* eventName = _priorityEventName ? _priorityEventName : (_publish ? _eventName : nullptr);
+    if (eventName == nullptr || _priority.isEmpty() || millis() - _last_publish < 1000) {
+        return false;
+    }
+    char *buf = new char[PUBLISH_CHUNK];
+    JSONBufferWriter priorityWriter(buf, PUBLISH_CHUNK);
+    priorityWriter.beginObject();
+    while (!_priority.isEmpty()) {
+        ScanEvent p;
+        bool full = false, oversized = false;
+        SINGLE_THREADED_BLOCK() {
+            p = _priority.first();
+            Beacon* beacon = find(p.beacon_type, p.address);
+            if (beacon) {
+                // Measured first, the JSONBufferWriter silently truncates what doesn't fit
+                JSONBufferWriter counter(nullptr, 0);
+                beacon->toJson(&counter);
+                size_t needed = counter.dataSize() + 1;     // And the separator
+                if (priorityWriter.dataSize() + needed + 1 <= PUBLISH_CHUNK) {
+                    beacon->toJson(&priorityWriter);
+                } else if (priorityWriter.dataSize() > 1) {
+                    full = true;        // Next slot
+                } else {
+                    oversized = true;   // Can't fit in any event
+                }
+            }
+            if (!full) {
+                _priority.removeAt(0);
+            }
+        }
+        if (oversized) {
+            Log.warn("Priority entry for %s is larger than an event, dropped", p.address.toString().c_str());
+        }
+        if (full) {
+            break;
+        }
+    }
+    priorityWriter.endObject();
+    bool published = priorityWriter.dataSize() > 2;
+    if (published) {
+        Particle.publish(String::format("%s-priority", eventName), String::format("%.*s", (int)std::min(priorityWriter.dataSize(), priorityWriter.bufferSize()), priorityWriter.buffer()),
+            _priorityEventName ? _priorityFlags : _pFlags);
+        _last_publish = millis();
+    }
+    delete[] buf;
+    return published;
+}
+
+void Beaconscanner::queueEvent(Beacon& beacon, callback_type event) {
+    if (!_callback && _subscriptions.isEmpty() && !(_motionEventName && (event & (MOVED | STILL)))) {
+        return;     // Nobody is listening
+    }
+    SINGLE_THREADED_BLOCK() {
+        if (event == UPDATED && beacon.pending_fields) {
+            // Still in the queue, merge the changes into it
+            beacon.pending_fields |= beacon.changed_fields;
+        } else if (pushEvent(beacon.getAddress(), beacon.type, event, std::max(positionOf(beacon), 0)) && event == UPDATED) {
+            beacon.pending_fields = beacon.changed_fields;
+        }
+    }
+}
+
+// Must be called in a SINGLE_THREADED_BLOCK. Device events have a beacon_type of 0.
+bool Beaconscanner::pushEvent(const BleAddress& address, uint8_t beacon_type, uint8_t event, uint16_t position) {
+    if (_event_count == BEACON_EVENT_QUEUE_SIZE) {
+        _events_dropped++;
+        return false;
+    }
+    ScanEvent& e = _events[(_event_head + _event_count) % BEACON_EVENT_QUEUE_SIZE];
+    e.address = address;
+    e.position = position;
+    e.beacon_type = beacon_type;
+    e.event = event;
+    _event_count++;
+    return true;
+}
+
+bool Beaconscanner::takeEvent(ScanEvent& event) {
+    bool taken = false;
+    SINGLE_THREADED_BLOCK() {
+        if (_event_count > 0) {
+            event = _events[_event_head];
+            _event_head = (_event_head + 1) % BEACON_EVENT_QUEUE_SIZE;
+            _event_count--;
+            taken = true;
+        }
+    }
+    return taken;
+}
+
+void Beaconscanner::notify(Beacon& beacon, callback_type event, uint32_t fields) {
+    // The application callback predates UPDATED and ZONE, it only gets the events it always had
+    if (_callback && event != UPDATED && event != ZONE) {
+        _callback(beacon, event);
+    }
+    // By index, a callback may unsubscribe
+    for (int i = 0; ; i++) {
+        Subscription sub;
+        bool more;
+        SINGLE_THREADED_BLOCK() {
+            more = i < _subscriptions.size();
+            if (more) {
+                sub = _subscriptions.at(i);
+            }
+        }
+        if (!more) {
+            break;
+        }
+        if ((sub.events & event) && (sub.types & beacon.type) && (sub.any_address || sub.address == beacon.getAddress()) &&
+            (event != UPDATED || (sub.fields & fields))) {
+            sub.callback(beacon, event, fields, sub.context);
+        }
+    }
+}
+
+Beaconscanner& Beaconscanner::subscribe(BeaconEventCallback callback, void* context, int events, int types, const BleAddress* address, uint32_t fields) {
+    Subscription sub;
+    sub.callback = callback;
+    sub.context = context;
+    sub.events = events;
+    sub.types = types;
+    sub.fields = fields;
+    sub.any_address = (address == nullptr);
+    if (address) {
+        sub.address = *address;
+    }
+    // The scan thread checks the subscriptions before queueing events
+    SINGLE_THREADED_BLOCK() {
+        _subscriptions.append(sub);
+        if (events & UPDATED) {
+            _update_types |= types;
+        }
+        if (events & ZONE) {
+            _zone_types |= types;
+        }
+    }
+    return *this;
+}
+
+Beaconscanner& Beaconscanner::unsubscribe(BeaconEventCallback callback, void* context) {
+    SINGLE_THREADED_BLOCK() {
+        _update_types = 0;
+        _zone_types = 0;
+        for (int i = 0; i < _subscriptions.size(); i++) {
+            const Subscription& sub = _subscriptions.at(i);
+            if (sub.callback == callback && sub.context == context) {
+                _subscriptions.removeAt(i);
+                i--;
+                continue;
+            }
+            if (sub.events & UPDATED) {
+                _update_types |= sub.types;
+            }
+            if (sub.events & ZONE) {
+                _zone_types |= sub.types;
+            }
+        }
+    }
+    return *this;
+}
+
+Beacon* Beaconscanner::find(uint8_t type, const BleAddress& address) {
+    switch (type)
+    {
+#ifdef SUPPORT_IBEACON
+        case SCAN_IBEACON:
+            return findBeacon(iBeaconScan::beacons, address);
+#endif
+#ifdef SUPPORT_KONTAKT
+        case SCAN_KONTAKT:
+            return findBeacon(KontaktTag::beacons, address);
+#endif
+#ifdef SUPPORT_EDDYSTONE
+        case SCAN_EDDYSTONE:
+            return findBeacon(Eddystone::beacons, address);
+#endif
+#ifdef SUPPORT_LAIRDBT510
+        case SCAN_LAIRDBT510:
+            return findBeacon(LairdBt510::beacons, address);
+#endif
+#ifdef SUPPORT_BTHOME
+        case SCAN_BTHOME:
+            return findBeacon(BTHome::beacons, address);
+#endif
+#ifdef SUPPORT_RUUVI
+        case SCAN_RUUVI:
+            return findBeacon(Ruuvi::beacons, address);
+#endif
+#ifdef SUPPORT_CUSTOM
+        case SCAN_CUSTOM:
+            return findBeacon(CustomBeacon::beacons, address);
+#endif
+        default:
+            return nullptr;
+    }
+}
+
+int Beaconscanner::forEach(int types, BeaconVisitor visitor, void* context, int8_t min_rssi, uint32_t seen_since) {
+    bool stop = false;
+    int visited = 0;
+    SINGLE_THREADED_BLOCK() {
+#ifdef SUPPORT_IBEACON
+        if (types & SCAN_IBEACON) {
+            visited += visit(iBeaconScan::beacons, visitor, context, min_rssi, seen_since, stop);
+        }
+#endif
+#ifdef SUPPORT_KONTAKT
+        if (types & SCAN_KONTAKT) {
+            visited += visit(KontaktTag::beacons, visitor, context, min_rssi, seen_since, stop);
+        }
+#endif
+#ifdef SUPPORT_EDDYSTONE
+        if (types & SCAN_EDDYSTONE) {
+            visited += visit(Eddystone::beacons, visitor, context, min_rssi, seen_since, stop);
+        }
+#endif
+#ifdef SUPPORT_LAIRDBT510
+        if (types & SCAN_LAIRDBT510) {
+            visited += visit(LairdBt510::beacons, visitor, context, min_rssi, seen_since, stop);
+        }
+#endif
+#ifdef SUPPORT_BTHOME
+        if (types & SCAN_BTHOME) {
+            visited += visit(BTHome::beacons, visitor, context, min_rssi, seen_since, stop);
+        }
+#endif
+#ifdef SUPPORT_RUUVI
+        if (types & SCAN_RUUVI) {
+            visited += visit(Ruuvi::beacons, visitor, context, min_rssi, seen_since, stop);
+        }
+#endif
+#ifdef SUPPORT_CUSTOM
+        if (types & SCAN_CUSTOM) {
+            visited += visit(CustomBeacon::beacons, visitor, context, min_rssi, seen_since, stop);
+        }
+#endif
+    }
+    return visited;
+}
+
+Beaconscanner& Beaconscanner::setIndexes(int indexes) {
+    SINGLE_THREADED_BLOCK() {
+        _indexes = indexes;
+        for (uint8_t i = 0; i < BEACON_INDEX_COUNT; i++) {
+            _index[i].clear();
+        }
+        _index_keys.clear();
+        // Built on the next query
+        _index_dirty = (indexes != 0);
+    }
+    return *this;
+}
+
+// FNV-1a, like the iBeacon region UUIDs
+uint32_t Beaconscanner::hashNamespace(const uint8_t* name) {
+    uint32_t hash = 2166136261UL;
+    for (uint8_t i = 0; i < 10; i++) {
+        hash = (hash ^ name[i]) * 16777619UL;
+    }
+    return hash;
+}
+
+bool Beaconscanner::indexKey(const Beacon& beacon, uint8_t index, uint32_t& key) {
+    switch (1 << index)
+    {
+#ifdef SUPPORT_IBEACON
+        case INDEX_IBEACON_ID:
+            if (beacon.type == SCAN_IBEACON) {
+                const iBeaconScan& ibeacon = static_cast<const iBeaconScan&>(beacon);
+                key = ((uint32_t)ibeacon.getMajor() << 16) | ibeacon.getMinor();
+                return true;
+            }
+            return false;
+#endif
+#ifdef SUPPORT_EDDYSTONE
+        case INDEX_EDDYSTONE_NAMESPACE:
+            if (beacon.type == SCAN_EDDYSTONE && static_cast<const Eddystone&>(beacon).getUid().found) {
+                key = hashNamespace(static_cast<const Eddystone&>(beacon).getUid().getNamespace());
+                return true;
+            }
+            return false;
+#endif
+        case INDEX_LAST_SEEN:
+            key = beacon.last_seen / BEACON_INDEX_BUCKET_MS;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Binary search for the first entry of the index with this key or a greater one
+int Beaconscanner::findIndexed(uint8_t index, uint32_t key) const {
+    const Vector<IndexEntry>& entries = _index[index];
+    int low = 0, high = entries.size();
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (entries.at(mid).key < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+void Beaconscanner::updateIndexes(const Beacon& beacon, uint16_t position) {
+    SINGLE_THREADED_BLOCK() {
+        bool found = false;
+        int slot = findKey(_index_keys, beacon, found);
+        IndexKeys keys = {};
+        if (found) {
+            keys = _index_keys.at(slot);
+        } else {
+            keys.address = beacon.getAddress();
+            keys.type = beacon.type;
+        }
+        for (uint8_t index = 0; index < BEACON_INDEX_COUNT; index++) {
+            if (!(_indexes & (1 << index))) {
+                continue;
+            }
+            uint32_t key = 0;
+            bool has_key = indexKey(beacon, index, key);
+            bool indexed = keys.indexed & (1 << index);
+            if (indexed && has_key && key == keys.keys[index]) {
+                continue;
+            }
+            Vector<IndexEntry>& entries = _index[index];
+            if (indexed) {
+                uint32_t old_key = keys.keys[index];
+                for (int i = findIndexed(index, old_key); i < entries.size() && entries.at(i).key == old_key; i++) {
+                    if (entries.at(i).type == beacon.type && entries.at(i).address == beacon.getAddress()) {
+                        entries.removeAt(i);
+                        break;
+                    }
+                }
+                keys.indexed &= ~(1 << index);
+            }
+            if (has_key) {
+                IndexEntry entry;
+                entry.key = key;
+                entry.address = beacon.getAddress();
+                entry.position = position;
+                entry.type = beacon.type;
+                entries.insert(findIndexed(index, key), entry);
+                keys.keys[index] = key;
+                keys.indexed |= (1 << index);
+            }
+        }
+        if (found && keys.indexed) {
+            _index_keys.at(slot) = keys;
+        } else if (found) {
+            _index_keys.removeAt(slot);
+        } else if (keys.indexed) {
+            _index_keys.insert(slot, keys);
+        }
+    }
+}
+
+template<typename T>
+void Beaconscanner::indexAll(Vector<T>& beacons) {
+    for (int i = 0; i < beacons.size(); i++) {
+        const Beacon& beacon = beacons.at(i);
+        IndexKeys keys = {};
+        keys.address = beacon.getAddress();
+        keys.type = beacon.type;
+        for (uint8_t index = 0; index < BEACON_INDEX_COUNT; index++) {
+            uint32_t key = 0;
+            if ((_indexes & (1 << index)) && indexKey(beacon, index, key)) {
+                IndexEntry entry;
+                entry.key = key;
+                entry.address = beacon.getAddress();
+                entry.position = i;
+                entry.type = beacon.type;
+                _index[index].insert(findIndexed(index, key), entry);
+                keys.keys[index] = key;
+                keys.indexed |= (1 << index);
+            }
+        }
+        bool found = false;
+        int slot = findKey(_index_keys, beacon, found);
+        if (keys.indexed && !found) {
+            _index_keys.insert(slot, keys);
+        }
+    }
+}
+
+// Called with the scan thread held off
+void Beaconscanner::rebuildIndexes() {
+    for (uint8_t i = 0; i < BEACON_INDEX_COUNT; i++) {
+        _index[i].clear();
+    }
+    _index_keys.clear();
+#ifdef SUPPORT_IBEACON
+    indexAll(iBeaconScan::beacons);
+#endif
+#ifdef SUPPORT_KONTAKT
+    indexAll(KontaktTag::beacons);
+#endif
+#ifdef SUPPORT_EDDYSTONE
+    indexAll(Eddystone::beacons);
+#endif
+#ifdef SUPPORT_LAIRDBT510
+    indexAll(LairdBt510::beacons);
+#endif
+#ifdef SUPPORT_BTHOME
+    indexAll(BTHome::beacons);
+#endif
+#ifdef SUPPORT_RUUVI
+    indexAll(Ruuvi::beacons);
+#endif
+#ifdef SUPPORT_CUSTOM
+    indexAll(CustomBeacon::beacons);
+#endif
+    _index_dirty = false;
+}
+
+Beacon* Beaconscanner::at(uint8_t type, int position) {
+    if (position >= count(type)) {
+        return nullptr;
+    }
+    switch (type)
+    {
+#ifdef SUPPORT_IBEACON
+        case SCAN_IBEACON:
+            return &iBeaconScan::beacons.at(position);
+#endif
+#ifdef SUPPORT_KONTAKT
+        case SCAN_KONTAKT:
+            return &KontaktTag::beacons.at(position);
+#endif
+#ifdef SUPPORT_EDDYSTONE
+        case SCAN_EDDYSTONE:
+            return &Eddystone::beacons.at(position);
+#endif
+#ifdef SUPPORT_LAIRDBT510
+        case SCAN_LAIRDBT510:
+            return &LairdBt510::beacons.at(position);
+#endif
+#ifdef SUPPORT_BTHOME
+        case SCAN_BTHOME:
+            return &BTHome::beacons.at(position);
+#endif
+#ifdef SUPPORT_RUUVI
+        case SCAN_RUUVI:
+            return &Ruuvi::beacons.at(position);
+#endif
+#ifdef SUPPORT_CUSTOM
+        case SCAN_CUSTOM:
+            return &CustomBeacon::beacons.at(position);
+#endif
+        default:
+            return nullptr;
+    }
+}
+
+bool Beaconscanner::matches(const Beacon& beacon, const BeaconQuery& query, void* context) {
+    int types = query.types;
+    if (query.major >= 0 || query.minor >= 0) {
+        types &= SCAN_IBEACON;
+    }
+    if (query.eddystone_namespace) {
+        types &= SCAN_EDDYSTONE;
+    }
+    if (!(beacon.type & types) || !passes(beacon, query.min_rssi, query.seen_since)) {
+        return false;
+    }
+#ifdef SUPPORT_IBEACON
+    if (beacon.type == SCAN_IBEACON) {
+        const iBeaconScan& ibeacon = static_cast<const iBeaconScan&>(beacon);
+        if ((query.major >= 0 && ibeacon.getMajor() != query.major) ||
+            (query.minor >= 0 && ibeacon.getMinor() != query.minor)) {
+            return false;
+        }
+    }
+#endif
+#ifdef SUPPORT_EDDYSTONE
+    if (beacon.type == SCAN_EDDYSTONE && query.eddystone_namespace) {
+        const Eddystone& eddystone = static_cast<const Eddystone&>(beacon);
+        if (!eddystone.getUid().found || memcmp(eddystone.getUid().getNamespace(), query.eddystone_namespace, 10)) {
+            return false;
+        }
+    }
+#endif
+    return !query.predicate || query.predicate(beacon, context);
+}
+
+int Beaconscanner::query(const BeaconQuery& query, BeaconVisitor visitor, void* context) {
+    bool stop = false;
+    int visited = 0;
+    SINGLE_THREADED_BLOCK() {
+        if (_indexes && _index_dirty) {
+            rebuildIndexes();
+        }
+        // The narrowest index that covers the query, if any
+        int index = -1;
+        uint32_t low = 0, high = UINT32_MAX;
+        if (query.major >= 0 && (_indexes & INDEX_IBEACON_ID)) {
+            index = 0;
+            low = (uint32_t)query.major << 16;
+            high = low | ((query.minor >= 0) ? query.minor : 0xFFFF);
+            low |= (query.minor >= 0) ? query.minor : 0;
+        } else if (query.eddystone_namespace && (_indexes & INDEX_EDDYSTONE_NAMESPACE)) {
+            index = 1;
+            low = high = hashNamespace(query.eddystone_namespace);
+        } else if (query.seen_since && (_indexes & INDEX_LAST_SEEN)) {
+            index = 2;
+            low = query.seen_since / BEACON_INDEX_BUCKET_MS;
+        }
+        if (index >= 0) {
+            const Vector<IndexEntry>& entries = _index[index];
+            for (int i = findIndexed(index, low); i < entries.size() && entries.at(i).key <= high && !stop; i++) {
+                const IndexEntry& entry = entries.at(i);
+                Beacon* beacon = at(entry.type, entry.position);
+                if (!beacon || beacon->getAddress() != entry.address) {
+                    // Moved by a removal the scanner wasn't told about
+                    _index_dirty = true;
+                    beacon = find(entry.type, entry.address);
+                }
+                if (beacon && matches(*beacon, query, context)) {
+                    visited++;
+                    stop = !visitor(*beacon, context);
+                }
+            }
+        } else {
+            // The Vectors of the types asked for
+#ifdef SUPPORT_IBEACON
+            if (query.types & SCAN_IBEACON) {
+                visited += queryAll(iBeaconScan::beacons, query, visitor, context, stop);
+            }
+#endif
+#ifdef SUPPORT_KONTAKT
+            if (query.types & SCAN_KONTAKT) {
+                visited += queryAll(KontaktTag::beacons, query, visitor, context, stop);
+            }
+#endif
+#ifdef SUPPORT_EDDYSTONE
+            if (query.types & SCAN_EDDYSTONE) {
+                visited += queryAll(Eddystone::beacons, query, visitor, context, stop);
+            }
+#endif
+#ifdef SUPPORT_LAIRDBT510
+            if (query.types & SCAN_LAIRDBT510) {
+                visited += queryAll(LairdBt510::beacons, query, visitor, context, stop);
+            }
+#endif
+#ifdef SUPPORT_BTHOME
+            if (query.types & SCAN_BTHOME) {
+                visited += queryAll(BTHome::beacons, query, visitor, context, stop);
+            }
+#endif
+#ifdef SUPPORT_RUUVI
+            if (query.types & SCAN_RUUVI) {
+                visited += queryAll(Ruuvi::beacons, query, visitor, context, stop);
+            }
+#endif
+#ifdef SUPPORT_CUSTOM
+            if (query.types & SCAN_CUSTOM) {
+                visited += queryAll(CustomBeacon::beacons, query, visitor, context, stop);
+            }
+#endif
+        }
+    }
+    return visited;
+}
+
+// A beacon is leaving its store
+void Beaconscanner::dropped(Beacon& beacon) {
+    // A budgeted loop() that stopped past the beacon resumes one position lower
+    bool cursor_type = (_loop_step == LOOP_SWEEP && _sweeping && beacon.type == _sweep_type) ||
+                       (_loop_step == LOOP_DEVICES && beacon.type == SCAN_LAIRDBT510);
+    if (cursor_type && positionOf(beacon) >= 0 && positionOf(beacon) < _loop_cursor) {
+        _loop_cursor--;
+    }
+    unrank(beacon);
+    if (_indexes) {
+        // The beacons after it move down
+        _index_dirty = true;
+    }
+    if (_changes_on) {
+        stamp(beacon, REMOVED);
+    }
+}
+
+// First entry with this generation or a later one
+int Beaconscanner::findChange(uint32_t generation) const {
+    int low = 0, high = _changes.size();
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (_changes.at(mid).generation < generation) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+void Beaconscanner::stamp(Beacon& beacon, callback_type change) {
+    SINGLE_THREADED_BLOCK() {
+        // Each beacon has a single entry, for its last change
+        bool stamped = false;
+        int slot = findKey(_stamps, beacon, stamped);
+        if (stamped) {
+            int i = findChange(_stamps.at(slot).generation);
+            if (i < _changes.size() && _changes.at(i).generation == _stamps.at(slot).generation) {
+                _changes.removeAt(i);
+            }
+        }
+        ChangeEntry entry;
+        entry.address = beacon.getAddress();
+        entry.generation = ++_generation;
+        entry.type = beacon.type;
+        entry.change = change;
+        _changes.append(entry);
+        if (change == REMOVED) {
+            // The tombstone stays, a beacon added again at this address gets its own entry
+            if (stamped) {
+                _stamps.removeAt(slot);
+            }
+        } else if (stamped) {
+            _stamps.at(slot).generation = _generation;
+            if (change == NEW) {
+                _stamps.at(slot).added_generation = _generation;
+            }
+        } else {
+            StampEntry s;
+            s.address = beacon.getAddress();
+            s.type = beacon.type;
+            s.generation = _generation;
+            s.added_generation = (change == NEW) ? _generation : 0;
+            _stamps.insert(slot, s);
+        }
+        if (change == REMOVED && ++_tombstones > BEACON_TOMBSTONE_COUNT) {
+            for (int i = 0; i < _changes.size(); i++) {
+                if (_changes.at(i).change == REMOVED) {
+                    _lost_generation = _changes.at(i).generation;
+                    _changes.removeAt(i);
+                    _tombstones--;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+template<typename T>
+void Beaconscanner::stampAll(Vector<T>& beacons) {
+    SINGLE_THREADED_BLOCK() {
+        for (int i = 0; i < beacons.size(); i++) {
+            stamp(beacons.at(i), NEW);
+        }
+    }
+}
+
+bool Beaconscanner::changesSince(uint32_t& generation, BeaconChangeVisitor visitor, void* context, int types) {
+    if (!_changes_on) {
+        _changes_on = true;
+#ifdef SUPPORT_IBEACON
+        stampAll(iBeaconScan::beacons);
+#endif
+#ifdef SUPPORT_KONTAKT
+        stampAll(KontaktTag::beacons);
+#endif
+#ifdef SUPPORT_EDDYSTONE
+        stampAll(Eddystone::beacons);
+#endif
+#ifdef SUPPORT_LAIRDBT510
+        stampAll(LairdBt510::beacons);
+#endif
+#ifdef SUPPORT_BTHOME
+        stampAll(BTHome::beacons);
+#endif
+#ifdef SUPPORT_RUUVI
+        stampAll(Ruuvi::beacons);
+#endif
+#ifdef SUPPORT_CUSTOM
+        stampAll(CustomBeacon::beacons);
+#endif
+    }
+    bool complete = true;
+    SINGLE_THREADED_BLOCK() {
+        // A removal after the generation may have been forgotten, start over
+        complete = generation >= _lost_generation;
+        uint32_t since = complete ? generation : 0;
+        generation = _generation;
+        for (int i = findChange(since + 1); i < _changes.size(); i++) {
+            const ChangeEntry& entry = _changes.at(i);
+            if (!(entry.type & types)) {
+                continue;
+            }
+            BeaconChange c;
+            c.address = entry.address;
+            c.type = entry.type;
+            c.generation = entry.generation;
+            c.beacon = nullptr;
+            c.change = REMOVED;
+            if (entry.change != REMOVED) {
+                c.beacon = find(entry.type, entry.address);
+                if (c.beacon == nullptr) {
+                    continue;
+                }
+                bool stamped = false;
+                int slot = findKey(_stamps, *c.beacon, stamped);
+                c.change = (stamped && _stamps.at(slot).added_generation > since) ? NEW : UPDATED;
+            }
+            if (!visitor(c, context)) {
+                generation = entry.generation;
+                break;
+            }
+        }
+    }
+    return complete;
+}
+
+// Binary search for the RSSI the beacon was ranked with, then through the beacons with the same RSSI
+int Beaconscanner::findRank(const Beacon& beacon, int8_t rssi) const {
+    int low = 0, high = _ranking.size();
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (_ranking.at(mid).rssi > rssi) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (int i = low; i < _ranking.size() && _ranking.at(i).rssi == rssi; i++) {
+        if (_ranking.at(i).type == beacon.type && _ranking.at(i).address == beacon.getAddress()) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void Beaconscanner::rank(Beacon& beacon) {
+    int8_t rssi = beacon.getRssi();
+    SINGLE_THREADED_BLOCK() {
+        bool ranked = false;
+        int slot = findKey(_ranked, beacon, ranked);
+        int i = ranked ? findRank(beacon, _ranked.at(slot).rssi) : -1;
+        if (ranked && _ranked.at(slot).rssi == rssi) {
+            // Unchanged
+        } else if (i < 0) {
+            // After the beacons with the same RSSI
+            int low = 0, high = _ranking.size();
+            while (low < high) {
+                int mid = (low + high) / 2;
+                if (_ranking.at(mid).rssi >= rssi) {
+                    low = mid + 1;
+                } else {
+                    high = mid;
+                }
+            }
+            BeaconRank entry;
+            entry.address = beacon.getAddress();
+            entry.type = beacon.type;
+            entry.rssi = rssi;
+            _ranking.insert(low, entry);
+            if (ranked) {
+                _ranked.at(slot).rssi = rssi;
+            } else {
+                _ranked.insert(slot, entry);
+            }
+        } else {
+            // The RSSI is smoothed, the beacon only moves by a few places
+            _ranking.at(i).rssi = rssi;
+            while (i > 0 && _ranking.at(i - 1).rssi < rssi) {
+                std::swap(_ranking.at(i - 1), _ranking.at(i));
+                i--;
+            }
+            while (i + 1 < _ranking.size() && _ranking.at(i + 1).rssi > rssi) {
+                std::swap(_ranking.at(i + 1), _ranking.at(i));
+                i++;
+            }
+            _ranked.at(slot).rssi = rssi;
+        }
+    }
+}
+
+void Beaconscanner::unrank(Beacon& beacon) {
+    if (!_ranking_on) {
+        return;
+    }
+    SINGLE_THREADED_BLOCK() {
+        bool ranked = false;
+        int slot = findKey(_ranked, beacon, ranked);
+        if (ranked) {
+            int i = findRank(beacon, _ranked.at(slot).rssi);
+            if (i >= 0) {
+                _ranking.removeAt(i);
+            }
+            _ranked.removeAt(slot);
+        }
+    }
+}
+
+template<typename T>
+void Beaconscanner::rankAll(Vector<T>& beacons) {
+    SINGLE_THREADED_BLOCK() {
+        for (int i = 0; i < beacons.size(); i++) {
+            rank(beacons.at(i));
+        }
+    }
+}
+
+Vector<BeaconRank> Beaconscanner::nearest(uint8_t k, int types) {
+    if (!_ranking_on) {
+        // From now on, beacons are ranked as their advertisements are processed
+        _ranking_on = true;
+#ifdef SUPPORT_IBEACON
+        rankAll(iBeaconScan::beacons);
+#endif
+#ifdef SUPPORT_KONTAKT
+        rankAll(KontaktTag::beacons);
+#endif
+#ifdef SUPPORT_EDDYSTONE
+        rankAll(Eddystone::beacons);
+#endif
+#ifdef SUPPORT_LAIRDBT510
+        rankAll(LairdBt510::beacons);
+#endif
+#ifdef SUPPORT_BTHOME
+        rankAll(BTHome::beacons);
+#endif
+#ifdef SUPPORT_RUUVI
+        rankAll(Ruuvi::beacons);
+#endif
+#ifdef SUPPORT_CUSTOM
+        rankAll(CustomBeacon::beacons);
+#endif
+    }
+    Vector<BeaconRank> result;
+    result.reserve(k);
+    SINGLE_THREADED_BLOCK() {
+        for (int i = 0; i < _ranking.size() && result.size() < k; i++) {
+            if (_ranking.at(i).type & types) {
+                result.append(_ranking.at(i));
+            }
+        }
+    }
+    return result;
+}
+
+int Beaconscanner::nearest(JSONWriter& writer, uint8_t k, size_t max_size, int types) {
+    int written = 0;
+    size_t size = 0;
+    for (const BeaconRank& r : nearest(k, types)) {
+        bool full = false;
+        SINGLE_THREADED_BLOCK() {
+            Beacon* beacon = find(r.type, r.address);
+            if (beacon) {
+                // Measured first, a JSONWriter can't tell how much it holds
+                JSONBufferWriter counter(nullptr, 0);
+                beacon->toJson(&counter);
+                size_t needed = counter.dataSize() + 1;     // And the separator
+                full = size + needed > max_size;
+                if (!full) {
+                    beacon->toJson(&writer);
+                    size += needed;
+                    written++;
+                }
+            }
+        }
+        if (full) {
+            break;
+        }
+    }
+    return written;
+}
+
+void Beaconscanner::publishMotion() {
+    if (_motionEventName == nullptr || _motionEvents.isEmpty() || millis() - _last_publish < 1000) {
+        return;
+    }
+    char *buf = new char[PUBLISH_CHUNK];
+    JSONBufferWriter motionWriter(buf, PUBLISH_CHUNK);
+    motionWriter.beginObject();
+    // Each entry is the address and the state, about 32 characters
+    while (!_motionEvents.isEmpty() && motionWriter.dataSize() + 32 < PUBLISH_CHUNK) {
+        MotionEvent m = _motionEvents.takeFirst();
+        motionWriter.name(m.address.toString()).value(m.moving ? "moved" : "still");
+    }
+    motionWriter.endObject();
+    Particle.publish(String::format("%s-motion", _motionEventName), String::format("%.*s", (int)std::min(motionWriter.dataSize(), motionWriter.bufferSize()), motionWriter.buffer()), _motionFlags);
+    _last_publish = millis();
+    delete[] buf;
+}
+
+void Beaconscanner::publish(const char* eventName, int type, bool rate_limit)
+{
+    _eventName = eventName;
+#ifdef SUPPORT_IBEACON
+    if (type & SCAN_IBEACON) {
+        while (!iBeaconScan::beacons.isEmpty()) {
+            publish(SCAN_IBEACON, rate_limit);
+        }
+    }
+#endif
+#ifdef SUPPORT_KONTAKT
+    if (type & SCAN_KONTAKT) {
+        while (!KontaktTag::beacons.isEmpty()) {
+            publish(SCAN_KONTAKT, rate_limit);
+        }
+    }
+#endif
+#ifdef SUPPORT_EDDYSTONE
+    if (type & SCAN_EDDYSTONE) {
+        while (!Eddystone::beacons.isEmpty()) {
+            publish(SCAN_EDDYSTONE, rate_limit);
+        }
+    }
+#endif
+#ifdef SUPPORT_LAIRDBT510
+    if (type & SCAN_LAIRDBT510) {
+        while (!LairdBt510::beacons.isEmpty()) {
+            publish(SCAN_LAIRDBT510, rate_limit);
+        }
+    }
+#endif
+#ifdef SUPPORT_BTHOME
+    if (type & SCAN_BTHOME) {
+        while (!BTHome::beacons.isEmpty()) {
+            publish(SCAN_BTHOME, rate_limit);
+        }
+    }
+#endif
+#ifdef SUPPORT_RUUVI
+    if (type & SCAN_RUUVI) {
+        while (!Ruuvi::beacons.isEmpty()) {
+            publish(SCAN_RUUVI, rate_limit);
+        }
+    }
+#endif
+#ifdef SUPPORT_CUSTOM
+    if (type & SCAN_CUSTOM) {
+        while (!CustomBeacon::beacons.isEmpty()) {
+            publish(SCAN_CUSTOM, rate_limit);
+        }
+    }
+#endif
+}
+
+void Beaconscanner::publish(int type, bool rate_limit)
+{
+    char *buf = new char[PUBLISH_CHUNK];
+    writer = new JSONBufferWriter(buf, PUBLISH_CHUNK);
+    while (millis() - _last_publish < 1000) {
+        delay(50);
+    }
+    // Priority beacons take this slot, the chunk waits for the next one
+    if (publishPriority()) {
+        while (millis() - _last_publish < 1000) {
+            delay(50);
+        }
+    }
+    switch (type)
+    {
+#ifdef SUPPORT_IBEACON
+        case SCAN_IBEACON:
+            Particle.publish(String::format("%s-ibeacon", _eventName), getJson(&iBeaconScan::beacons, std::min(IBEACON_CHUNK, iBeaconScan::beacons.size()), this),_pFlags);
+            break;
+#endif
+#ifdef SUPPORT_KONTAKT
+        case SCAN_KONTAKT:
+            Particle.publish(String::format("%s-kontakt", _eventName), getJson(&KontaktTag::beacons, std::min(KONTAKT_CHUNK, KontaktTag::beacons.size()), this),_pFlags);
+            break;
+#endif
+#ifdef SUPPORT_EDDYSTONE
+        case SCAN_EDDYSTONE:
+            Particle.publish(String::format("%s-eddystone", _eventName), getJson(&Eddystone::beacons, std::min(EDDYSTONE_CHUNK, Eddystone::beacons.size()),this), _pFlags);
+            break;
+#endif
+#ifdef SUPPORT_LAIRDBT510
+        case SCAN_LAIRDBT510:
+            Particle.publish(String::format("%s-lairdbt510", _eventName), getJson(&LairdBt510::beacons, std::min(LAIRDBT510_CHUNK, LairdBt510::beacons.size()), this), _pFlags);
+            break;
+#endif
+#ifdef SUPPORT_BTHOME
+        case SCAN_BTHOME:
+            Particle.publish(String::format("%s-bthome", _eventName), getJson(&BTHome::beacons, std::min(BTHOME_CHUNK, BTHome::beacons.size()), this), _pFlags);
+            break;
+#endif
+#ifdef SUPPORT_RUUVI
+        case SCAN_RUUVI:
+            Particle.publish(String::format("%s-ruuvi", _eventName), getJson(&Ruuvi::beacons, std::min(RUUVI_CHUNK, Ruuvi::beacons.size()), this), _pFlags);
+            break;
+#endif
+#ifdef SUPPORT_CUSTOM
+        case SCAN_CUSTOM:
+            Particle.publish(String::format("%s-custom", _eventName), getJson(&CustomBeacon::beacons, std::min(CUSTOM_CHUNK, CustomBeacon::beacons.size()), this), _pFlags);
             break;
 #endif
         default:
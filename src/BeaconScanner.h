@@ -20,6 +20,8 @@
 #include "config.h"
 
 #include "Particle.h"
+#include "motion.h"
+#include "beaconDevice.h"
 #ifdef SUPPORT_IBEACON
 #include "iBeacon-scan.h"
 #endif
@@ -38,17 +40,89 @@
 #ifdef SUPPORT_RUUVI
 #include "ruuvi.h"
 #endif
+#ifdef SUPPORT_CUSTOM
+#include "customBeacon.h"
+#endif
 
 // This is the type that will be returned in the callback function, whether a tag has
-// entered the area of the device, or left the area.
+// entered the area of the device, or left the area. Tags with an accelerometer or movement
+// counter (Kontakt, KKM, Ruuvi) also report when they start moving or come to rest.
+// UPDATED and ZONE are only delivered to subscriptions, when decoded values of a beacon change,
+// and when it settles in another proximity zone.
 typedef enum {
   NEW        = 0x01,
-  REMOVED    = 0x02
+  REMOVED    = 0x02,
+  MOVED      = 0x04,
+  STILL      = 0x08,
+  UPDATED    = 0x10,
+  ZONE       = 0x20
 } callback_type;
 
 typedef void (*BeaconScanCallback)(Beacon& beacon, callback_type type);
+// fields holds the fields that changed for UPDATED events (see the *_field_t enum of each beacon type), 0 otherwise
+typedef void (*BeaconEventCallback)(Beacon& beacon, callback_type type, uint32_t fields, void* context);
+// Only NEW and REMOVED are delivered for devices
+typedef void (*BeaconDeviceCallback)(const BeaconDevice& device, callback_type type);
+// Return false to stop visiting
+typedef bool (*BeaconVisitor)(const Beacon& beacon, void* context);
+
+// A change reported by Scanner.changesSince()
+struct BeaconChange {
+  const Beacon* beacon;     // nullptr for REMOVED
+  BleAddress address;
+  uint8_t type;
+  callback_type change;     // NEW, UPDATED or REMOVED
+  uint32_t generation;
+};
+typedef bool (*BeaconChangeVisitor)(const BeaconChange& change, void* context);
+
+// The conditions of Scanner.query(). Beacons must meet all of them.
+struct BeaconQuery {
+  int types;
+  int8_t min_rssi;                      // Smoothed RSSI
+  uint32_t seen_since;                  // millis() time of the last advertisement, 0 for any
+  int32_t major, minor;                 // iBeacons only, -1 for any
+  const uint8_t* eddystone_namespace;   // Eddystone UID namespace, 10 bytes. nullptr for any
+  // Any other condition, called with the context passed to query(). nullptr for none
+  bool (*predicate)(const Beacon& beacon, void* context);
+
+  BeaconQuery() :
+    types(SCAN_IBEACON | SCAN_KONTAKT | SCAN_EDDYSTONE | SCAN_LAIRDBT510 | SCAN_BTHOME | SCAN_RUUVI | SCAN_CUSTOM),
+    min_rssi(INT8_MIN),
+    seen_since(0),
+    major(-1),
+    minor(-1),
+    eddystone_namespace(nullptr),
+    predicate(nullptr) {};
+};
+
+// Bucket size of INDEX_LAST_SEEN. Beacons move in the index once per bucket.
+#ifndef BEACON_INDEX_BUCKET_MS
+#define BEACON_INDEX_BUCKET_MS 5000
+#endif
 typedef void (*CustomBeaconCallback)(const BleScanResult *scanResult);
 
+// A beacon returned by Scanner.nearest(). Use Scanner.getBeacon() with the address and type to get its data.
+struct BeaconRank {
+  BleAddress address;
+  uint8_t type;
+  int8_t rssi;      // Smoothed RSSI
+};
+
+// Events are queued as advertisements are processed, and delivered by loop(). When the
+// queue is full, new events are dropped.
+#ifndef BEACON_EVENT_QUEUE_SIZE
+#define BEACON_EVENT_QUEUE_SIZE 64
+#endif
+
+// Removed beacons remembered for changesSince(). Consumers that fall further behind are told to start over.
+#ifndef BEACON_TOMBSTONE_COUNT
+#define BEACON_TOMBSTONE_COUNT 32
+#endif
+
+// Number of ble_scanner_config_t types
+#define BEACON_TYPE_COUNT 7
+
 class Beaconscanner
 {
 public:
@@ -84,7 +158,7 @@ public:
    * @param duration  How long to scan for, in seconds. Default: 5 seconds
    * @param flags     Which type of beacons to scan for. Default: all
    */
-  void scan(uint16_t duration = 5, int flags = (SCAN_IBEACON | SCAN_KONTAKT | SCAN_EDDYSTONE | SCAN_LAIRDBT510 | SCAN_BTHOME | SCAN_RUUVI));
+  void scan(uint16_t duration = 5, int flags = (SCAN_IBEACON | SCAN_KONTAKT | SCAN_EDDYSTONE | SCAN_LAIRDBT510 | SCAN_BTHOME | SCAN_RUUVI | SCAN_CUSTOM));
 
   /**
    * The device will continuously scan on a separate thread, not blocking the main application. The
@@ -96,7 +170,7 @@ public:
    * 
    * @param flags   Which type of beacons to scan for. Default: all
    */
-  void startContinuous(int flags = (SCAN_IBEACON | SCAN_KONTAKT | SCAN_EDDYSTONE | SCAN_LAIRDBT510 | SCAN_BTHOME | SCAN_RUUVI));
+  void startContinuous(int flags = (SCAN_IBEACON | SCAN_KONTAKT | SCAN_EDDYSTONE | SCAN_LAIRDBT510 | SCAN_BTHOME | SCAN_RUUVI | SCAN_CUSTOM));
   /**
    * Suspend the thread that scans continuously.
    */
@@ -132,6 +206,225 @@ public:
    * @param callback  The function to be called
    */
   Beaconscanner& setCallback(BeaconScanCallback callback) { _callback = callback; return *this; };
+  /**
+   * Register a callback for some events only, in addition to the one set with setCallback().
+   * Several callbacks can be registered.
+   * 
+   * This works in continuous mode only. Must periodically call Scanner.loop() for this to
+   * function.
+   * 
+   * Changes of several advertisements that arrive before loop() is called are merged into a
+   * single UPDATED event.
+   * 
+   * The beacon passed to the callback is a copy, taken when the event is delivered, so that
+   * the scan thread can keep updating the beacons while the callback runs. Use getBeacon()
+   * to act on the stored beacon, for example to configure a BT510.
+   * 
+   * @param callback  The function to be called
+   * @param context   Passed back to the callback
+   * @param events    The callback_type values to receive, OR'ed together. Default: all except UPDATED
+   * @param types     The types of beacons to receive events for. Default: all
+   * @param address   Only receive events for this beacon. Default: all beacons
+   * @param fields    Only receive UPDATED events when one of these fields changed. Default: all
+   */
+  Beaconscanner& subscribe(BeaconEventCallback callback, void* context,
+      int events = (NEW | REMOVED | MOVED | STILL),
+      int types = (SCAN_IBEACON | SCAN_KONTAKT | SCAN_EDDYSTONE | SCAN_LAIRDBT510 | SCAN_BTHOME | SCAN_RUUVI | SCAN_CUSTOM),
+      const BleAddress* address = nullptr,
+      uint32_t fields = 0xFFFFFFFF);
+  /**
+   * Remove the subscriptions made with this callback and context.
+   */
+  Beaconscanner& unsubscribe(BeaconEventCallback callback, void* context);
+  /**
+   * Number of events that were lost because loop() was not called often enough to
+   * empty the queue.
+   */
+  uint32_t getDroppedEvents() const { return _events_dropped; };
+  /**
+   * Publish an event each time a tag starts moving or comes to rest, instead of publishing its
+   * raw accelerometer data. The event is named <eventName>-motion and holds an object with the
+   * address of each tag that changed, and "moved" or "still".
+   * 
+   * This works in continuous mode only. Must periodically call Scanner.loop() for this to
+   * function. Pass nullptr to stop publishing.
+   * 
+   * @param eventName the name of the event to publish
+   * @param pFlags    Publish flags, such as PRIVATE
+   */
+  Beaconscanner& publishMotion(const char* eventName, PublishFlags pFlags = PRIVATE) {
+    _motionEventName = eventName;
+    _motionFlags = pFlags;
+    return *this;
+  };
+  /**
+   * Publish beacons as soon as the rate limit allows when one of their priority fields changes,
+   * such as a button press or an alarm, instead of waiting for a full chunk of their type. The
+   * event is named <eventName>-priority and holds the same JSON as publish(). The beacons are
+   * still published with the others later on.
+   * 
+   * scanAndPublish() does this with its own event name, unless another one is set here. In
+   * continuous mode, Scanner.loop() must be called periodically. Pass nullptr to stop publishing.
+   * 
+   * @param eventName the name of the event to publish
+   * @param pFlags    Publish flags, such as PRIVATE
+   */
+  Beaconscanner& publishPriority(const char* eventName, PublishFlags pFlags = PRIVATE) {
+    _priorityEventName = eventName;
+    _priorityFlags = pFlags;
+    return *this;
+  };
+  /**
+   * Set the fields that make a beacon of this type a priority, using the *_field_t enum of the type.
+   * Defaults: Kontakt button, BTHome button and dimmer events, BT510 alarms and Ruuvi movement counter.
+   * 0 turns priority publishing off for the type.
+   */
+  Beaconscanner& setPriorityFields(ble_scanner_config_t type, uint32_t fields) {
+    _priority_fields[typeIndex(type)] = fields;
+    return *this;
+  };
+  /**
+   * Set the proximity zones, used for ZONE callbacks and Beacon::getZone(). A beacon changes zone
+   * once its smoothed RSSI has been past the boundary by the hysteresis for the dwell time.
+   * 
+   * @param immediate_dbm RSSI at or above which a beacon is immediate
+   * @param near_dbm      RSSI at or above which a beacon is near, it is far below
+   * @param hysteresis_db how far past a boundary the RSSI must go
+   * @param dwell_seconds how long the RSSI must stay in the new zone
+   */
+  Beaconscanner& setProximityZones(int8_t immediate_dbm, int8_t near_dbm, uint8_t hysteresis_db, uint16_t dwell_seconds) {
+    ProximityFilter::setZones(immediate_dbm, near_dbm, hysteresis_db, dwell_seconds * 1000UL);
+    return *this;
+  };
+  /**
+   * Set the thresholds for motion detection, used for MOVED and STILL callbacks.
+   * 
+   * @param moved_mg      deviation from the resting orientation, in milli-g, above which a tag is moving
+   * @param still_mg      deviation below which a tag is at rest
+   * @param still_seconds how long a tag must be at rest before it is reported STILL
+   */
+  Beaconscanner& setMotionThresholds(uint16_t moved_mg, uint16_t still_mg, uint16_t still_seconds) {
+    MotionDetector::setThresholds(moved_mg, still_mg, still_seconds);
+    return *this;
+  };
+  /**
+   * Keep a record of each physical device, linking the beacons of all the types it advertises
+   * as from the same address. The beacons of a device are then removed together, once the
+   * device has missed the scans set with setMissedCount(), instead of each type on its own.
+   * 
+   * This works in continuous mode only. Must periodically call Scanner.loop() for this to
+   * function.
+   */
+  Beaconscanner& trackDevices(bool enable = true);
+  /**
+   * The devices tracked since trackDevices() was called, sorted by address
+   */
+  const Vector<BeaconDevice>& getDevices() const { return _devices; };
+  /**
+   * Register a callback that will be called once per device when it enters or leaves the area,
+   * however many beacon types it advertises as. Requires trackDevices().
+   */
+  Beaconscanner& setDeviceCallback(BeaconDeviceCallback callback) { _deviceCallback = callback; return *this; };
+  /**
+   * The beacon of this type with this address, nullptr if there is none
+   */
+  Beacon* getBeacon(const BleAddress& address, ble_scanner_config_t type) { return find(type, address); };
+  /**
+   * Publish the tracked devices, one entry per device with its RSSI and the data of each of
+   * its beacon types, in events named <eventName>-device. Unlike publish(), the beacons are
+   * not consumed. Requires trackDevices().
+   * 
+   * This is a blocking call.
+   * 
+   * @param eventName the name of the event to publish
+   * @param pFlags    Publish flags, such as PRIVATE
+   */
+  void publishDevices(const char* eventName, PublishFlags pFlags = PRIVATE);
+  /**
+   * Call the visitor for each beacon of these types, in place, without copying it. The scan
+   * thread is held off meanwhile, so the beacons don't change or move while they are visited,
+   * and the visitor should be short. Beacons that don't pass the filters are skipped.
+   * 
+   * @param types       the types of beacons to visit
+   * @param visitor     called with each beacon, returns false to stop
+   * @param context     passed back to the visitor
+   * @param min_rssi    only visit beacons with a smoothed RSSI at least this strong. Default: all
+   * @param seen_since  only visit beacons heard at or after this millis() time. Default: all
+   * @return the number of beacons visited
+   */
+  int forEach(int types, BeaconVisitor visitor, void* context = nullptr, int8_t min_rssi = INT8_MIN, uint32_t seen_since = 0);
+  /**
+   * Same as forEach(), for one type, so that the visitor gets the beacon as that type:
+   * Scanner.forEach<KontaktTag>([](const KontaktTag& tag, void* context) { ...; return true; });
+   */
+  template<typename T>
+  int forEach(bool (*visitor)(const T& beacon, void* context), void* context = nullptr, int8_t min_rssi = INT8_MIN, uint32_t seen_since = 0) {
+    bool stop = false;
+    int visited = 0;
+    SINGLE_THREADED_BLOCK() {
+      visited = visit(T::beacons, visitor, context, min_rssi, seen_since, stop);
+    }
+    return visited;
+  };
+  /**
+   * Call the visitor for each beacon added, updated or removed since a generation, oldest
+   * change first. Each change to the stores is stamped with a new generation, so several parts
+   * of the application can each keep their own generation and poll for what changed, without
+   * callbacks. A beacon that changed several times is only visited once. UPDATED means that
+   * decoded values changed, not only the RSSI.
+   * 
+   * The first call starts stamping changes; pass 0 to get all the beacons as NEW. Changes are
+   * visited with the scan thread held off, like forEach().
+   * 
+   * @param generation  the generation returned by the previous call, updated for the next call
+   * @param visitor     called with each change, returns false to stop. The next call resumes there
+   * @param context     passed back to the visitor
+   * @param types       the types of beacons to report. Default: all
+   * @return false if removals since generation were forgotten, see BEACON_TOMBSTONE_COUNT. All the
+   *         beacons are then visited as NEW, and the application should forget the others.
+   */
+  bool changesSince(uint32_t& generation, BeaconChangeVisitor visitor, void* context = nullptr, int types = (SCAN_IBEACON | SCAN_KONTAKT | SCAN_EDDYSTONE | SCAN_LAIRDBT510 | SCAN_BTHOME | SCAN_RUUVI | SCAN_CUSTOM));
+  /**
+   * Keep secondary indexes, so that query() doesn't go through all the beacons of the types
+   * asked for. Indexes are kept up to date as advertisements come in, and rebuilt after
+   * beacons are removed.
+   * 
+   * @param indexes the beacon_index_t indexes to keep, OR'ed together. 0 for none
+   */
+  Beaconscanner& setIndexes(int indexes);
+  /**
+   * Call the visitor for each beacon that meets the conditions of the query, in place, with the
+   * scan thread held off like forEach(). When an index covers the iBeacon major, the Eddystone
+   * namespace or the time of the last advertisement, only the beacons it points to are looked
+   * at. Otherwise, the beacons of the types in the query are.
+   * 
+   * @param query   the conditions
+   * @param visitor called with each beacon, returns false to stop
+   * @param context passed back to the visitor and to the predicate of the query
+   * @return the number of beacons visited
+   */
+  int query(const BeaconQuery& query, BeaconVisitor visitor, void* context = nullptr);
+  /**
+   * The k beacons with the strongest smoothed RSSI, strongest first. The first call starts
+   * keeping the beacons ordered by RSSI as advertisements come in, so later calls only go
+   * through the first entries instead of sorting all the beacons.
+   * 
+   * @param k     how many beacons
+   * @param types the types of beacons to include. Default: all
+   */
+  Vector<BeaconRank> nearest(uint8_t k, int types = (SCAN_IBEACON | SCAN_KONTAKT | SCAN_EDDYSTONE | SCAN_LAIRDBT510 | SCAN_BTHOME | SCAN_RUUVI | SCAN_CUSTOM));
+  /**
+   * Same as nearest(), but writes each beacon with toJson(), and stops before the beacon that
+   * would take the JSON past max_size more characters. Meant for adding the nearest beacons to
+   * a payload with a size limit, such as the Tracker location event.
+   * 
+   * @param writer    where the beacons are written, inside an object
+   * @param k         how many beacons at most
+   * @param max_size  how many characters can be added to the writer
+   * @param types     the types of beacons to include. Default: all
+   * @return the number of beacons written
+   */
+  int nearest(JSONWriter& writer, uint8_t k, size_t max_size, int types = (SCAN_IBEACON | SCAN_KONTAKT | SCAN_EDDYSTONE | SCAN_LAIRDBT510 | SCAN_BTHOME | SCAN_RUUVI | SCAN_CUSTOM));
   /**
    * Call loop from the application in order to have callbacks as well as missed beacon
    * removal work.
@@ -139,6 +432,19 @@ public:
    * Must call it periodically while in continuous mode.
    */
   void loop();
+  /**
+   * Same as loop(), but returns once max_micros have been spent, plus the time of the callback
+   * or beacon being handled. The next call resumes where this one stopped. 0 means no limit.
+   * 
+   * @param max_micros  time budget of this call, in microseconds
+   * @return true if all the pending work was done, false if there is a backlog left
+   */
+  bool loop(uint32_t max_micros);
+  /**
+   * Number of events waiting to be delivered, plus beacons still to be checked for removal.
+   * If it keeps growing, loop() isn't given enough time.
+   */
+  uint32_t getBacklog() const;
 
   /**
    * Register a callback that will be called when a broadcast is scanned, but it doesn't
@@ -157,7 +463,7 @@ public:
    * @param eventName the name of the event to publish. The library will add -<beacon-type> to the event name
    * @param type      the type of beacons to publish. If blank, it'll publish all
    */
-  void publish(const char* eventName, int type = (SCAN_IBEACON | SCAN_KONTAKT | SCAN_EDDYSTONE | SCAN_LAIRDBT510 | SCAN_BTHOME | SCAN_RUUVI), bool rate_limit = true);
+  void publish(const char* eventName, int type = (SCAN_IBEACON | SCAN_KONTAKT | SCAN_EDDYSTONE | SCAN_LAIRDBT510 | SCAN_BTHOME | SCAN_RUUVI | SCAN_CUSTOM), bool rate_limit = true);
 
   /**
    * Get Vectors of the tags that have been detected
@@ -181,6 +487,9 @@ public:
 #ifdef SUPPORT_RUUVI
   Vector<Ruuvi>& getRuuvi() {return Ruuvi::beacons;};
 #endif
+#ifdef SUPPORT_CUSTOM
+  Vector<CustomBeacon>& getCustomBeacons() {return CustomBeacon::beacons;};
+#endif
 
   template<typename T> static String getJson(Vector<T>* beacons, uint8_t count, void* context);
 
@@ -193,6 +502,187 @@ private:
   unsigned long _last_publish;
   PublishFlags _pFlags;
   const char* _eventName;
+  const char* _motionEventName;
+  PublishFlags _motionFlags;
+  struct MotionEvent {
+    BleAddress address;
+    bool moving;
+  };
+  Vector<MotionEvent> _motionEvents;
+  void motionTransition(const BleAddress& address, bool moving);
+  void publishMotion();
+  const char* _priorityEventName;
+  PublishFlags _priorityFlags;
+  uint32_t _priority_fields[BEACON_TYPE_COUNT];
+  static uint8_t typeIndex(uint8_t type) { return __builtin_ctz(type); };
+  struct ScanEvent {
+    BleAddress address;
+    uint16_t position;      // In the Vector of the beacon, checked against the address when delivered
+    uint8_t beacon_type;
+    uint8_t event;
+  };
+  ScanEvent _events[BEACON_EVENT_QUEUE_SIZE];
+  uint16_t _event_head, _event_count;
+  uint32_t _events_dropped;
+  struct Subscription {
+    BeaconEventCallback callback;
+    void* context;
+    BleAddress address;
+    int events, types;
+    uint32_t fields;
+    bool any_address;
+  };
+  Vector<Subscription> _subscriptions;
+  Vector<ScanEvent> _priority;   // Beacons waiting for a priority publish
+  void queuePriority(const Beacon& beacon);
+  bool publishPriority();
+  int _update_types;      // Beacon types that a subscription wants UPDATED events for
+  int _zone_types;        // Same for ZONE
+  void ingested(Beacon& beacon, const BleScanResult* scanResult);
+  void queueEvent(Beacon& beacon, callback_type event);
+  bool pushEvent(const BleAddress& address, uint8_t beacon_type, uint8_t event, uint16_t position = 0);
+  template<typename T> void deliver(Vector<T>& beacons, const ScanEvent& event);
+  int positionOf(const Beacon& beacon) const;
+  // Tables of scanner state about the beacons are sorted by type and address, see findKey()
+  static bool keyBefore(uint8_t type, const BleAddress& address, const Beacon& beacon);
+  template<typename E> static int findKey(const Vector<E>& entries, const Beacon& beacon, bool& found);
+  // Beacons ordered by smoothed RSSI, strongest first, once nearest() has been called
+  Vector<BeaconRank> _ranking;
+  // The same entries by type and address, to find the RSSI each beacon was ranked with
+  Vector<BeaconRank> _ranked;
+  bool _ranking_on;
+  void rank(Beacon& beacon);
+  void unrank(Beacon& beacon);
+  int findRank(const Beacon& beacon, int8_t rssi) const;
+  template<typename T> void rankAll(Vector<T>& beacons);
+  // The last change of each beacon and the tombstones of removed ones, by generation, once changesSince() has been called
+  struct ChangeEntry {
+    BleAddress address;
+    uint32_t generation;
+    uint8_t type;
+    uint8_t change;
+  };
+  Vector<ChangeEntry> _changes;
+  // The generations of the last change and of the addition of each beacon, by type and address
+  struct StampEntry {
+    BleAddress address;
+    uint8_t type;
+    uint32_t generation;
+    uint32_t added_generation;
+  };
+  Vector<StampEntry> _stamps;
+  bool _changes_on;
+  uint32_t _generation, _lost_generation;
+  uint16_t _tombstones;
+  void stamp(Beacon& beacon, callback_type change);
+  int findChange(uint32_t generation) const;
+  template<typename T> void stampAll(Vector<T>& beacons);
+  void dropped(Beacon& beacon);
+  struct IndexEntry {
+    uint32_t key;
+    BleAddress address;
+    uint16_t position;
+    uint8_t type;
+  };
+  // Each index is sorted by key
+  Vector<IndexEntry> _index[BEACON_INDEX_COUNT];
+  // The keys each beacon is indexed with, by type and address
+  struct IndexKeys {
+    BleAddress address;
+    uint8_t type;
+    uint8_t indexed;      // The indexes that have an entry for the beacon
+    uint32_t keys[BEACON_INDEX_COUNT];
+  };
+  Vector<IndexKeys> _index_keys;
+  int _indexes;
+  bool _index_dirty;      // Beacons moved in their Vector, positions must be rebuilt
+  static uint32_t hashNamespace(const uint8_t* name);
+  static bool indexKey(const Beacon& beacon, uint8_t index, uint32_t& key);
+  int findIndexed(uint8_t index, uint32_t key) const;
+  void updateIndexes(const Beacon& beacon, uint16_t position);
+  void rebuildIndexes();
+  template<typename T> void indexAll(Vector<T>& beacons);
+  Beacon* at(uint8_t type, int position);
+  static bool matches(const Beacon& beacon, const BeaconQuery& query, void* context);
+  template<typename T>
+  static int queryAll(const Vector<T>& beacons, const BeaconQuery& query, BeaconVisitor visitor, void* context, bool& stop) {
+    int visited = 0;
+    for (int i = 0; i < beacons.size() && !stop; i++) {
+      if (matches(beacons.at(i), query, context)) {
+        visited++;
+        stop = !visitor(beacons.at(i), context);
+      }
+    }
+    return visited;
+  }
+  static bool passes(const Beacon& beacon, int8_t min_rssi, uint32_t seen_since) {
+    return beacon.getRssi() >= min_rssi && (seen_since == 0 || (int32_t)(beacon.getLastSeen() - seen_since) >= 0);
+  }
+  template<typename T, typename V>
+  static int visit(const Vector<T>& beacons, V visitor, void* context, int8_t min_rssi, uint32_t seen_since, bool& stop) {
+    int visited = 0;
+    for (int i = 0; i < beacons.size() && !stop; i++) {
+      const T& beacon = beacons.at(i);
+      if (passes(beacon, min_rssi, seen_since)) {
+        visited++;
+        stop = !visitor(beacon, context);
+      }
+    }
+    return visited;
+  }
+  bool takeEvent(ScanEvent& event);
+  void notify(Beacon& beacon, callback_type event, uint32_t fields = 0);
+  Beacon* find(uint8_t type, const BleAddress& address);
+  int count(uint8_t type) const;
+  // loop() runs these steps in turn, and resumes with the one that ran out of time
+  enum LoopStep: uint8_t {
+    LOOP_EVENTS, LOOP_DEVICES, LOOP_SWEEP, LOOP_STEPS
+  };
+  uint8_t _loop_step, _sweep_type;
+  int _loop_cursor;       // Position in the beacons of the step that ran out of time
+  bool _sweeping;
+  static bool expired(uint32_t start, uint32_t max_micros) {
+    return max_micros && (uint32_t)(micros() - start) >= max_micros;
+  }
+  bool deliverEvents(uint32_t start, uint32_t max_micros);
+  bool runDevices(uint32_t start, uint32_t max_micros);
+  bool sweep(uint32_t start, uint32_t max_micros);
+  template<typename T> bool sweep(Vector<T>& beacons, uint32_t start, uint32_t max_micros);
+  static bool removable(const Beacon& beacon);
+#ifdef SUPPORT_LAIRDBT510
+  static bool removable(const LairdBt510& beacon);
+#endif
+  // Called before a beacon is dropped by publish() or a new scan, whatever it is doing
+  static void abandon(Beacon&) {}
+#ifdef SUPPORT_LAIRDBT510
+  static void abandon(LairdBt510& beacon) { beacon.abort(); }
+#endif
+  // Removed by the sweep whether or not it is still advertising
+  static bool orphaned(const Beacon&) { return false; }
+#ifdef SUPPORT_CUSTOM
+  static bool orphaned(const CustomBeacon& beacon) { return beacon.getParser() == nullptr; }
+#endif
+  // Queue MOVED or STILL for the tags with a motion detector
+  void checkMotion(Beacon&) {}
+#ifdef SUPPORT_KONTAKT
+  void checkMotion(KontaktTag& beacon) { checkMotion(beacon, beacon.motion); }
+#endif
+#ifdef SUPPORT_KKMSMART
+  void checkMotion(Eddystone& beacon) { checkMotion(beacon, beacon.motion); }
+#endif
+#ifdef SUPPORT_RUUVI
+  void checkMotion(Ruuvi& beacon) { checkMotion(beacon, beacon.motion); }
+#endif
+  void checkMotion(Beacon& beacon, MotionDetector& motion);
+  bool _track_devices;
+  Vector<BeaconDevice> _devices;
+  BeaconDeviceCallback _deviceCallback;
+  static int compare(const BleAddress& a, const BleAddress& b);
+  int findDevice(const BleAddress& address, bool& found) const;
+  BeaconDevice* findDevice(const BleAddress& address);
+  void noteDevice(const Beacon& beacon, int8_t rssi);
+  void deviceToJson(const BeaconDevice& device, JSONWriter& writer);
+  bool sweepDevices(uint32_t start, uint32_t max_micros);
 #ifdef SUPPORT_KONTAKT
   Vector<BleAddress> kPublished;
 #endif
@@ -210,6 +700,9 @@ private:
 #endif
 #ifdef SUPPORT_RUUVI
   Vector<BleAddress> rPublished;
+#endif
+#ifdef SUPPORT_CUSTOM
+  Vector<BleAddress> cPublished;
 #endif
   Thread* _thread;
   static Beaconscanner* _instance;
@@ -221,15 +714,50 @@ private:
   BeaconScanCallback _callback;
   CustomBeaconCallback _customCallback;
   Beaconscanner() :
+      _publish(false),
       _memory_saver(false),
       _run(false),
       _scan_done(false),
       _clear_missed(1),
       _scan_period(10),
       _last_publish(0),
+      _motionEventName(nullptr),
+      _priorityEventName(nullptr),
+      _priority_fields{},
+      _event_head(0),
+      _event_count(0),
+      _events_dropped(0),
+      _update_types(0),
+      _zone_types(0),
+      _ranking_on(false),
+      _changes_on(false),
+      _generation(0),
+      _lost_generation(0),
+      _tombstones(0),
+      _indexes(0),
+      _index_dirty(false),
+      _loop_step(LOOP_EVENTS),
+      _sweep_type(SCAN_IBEACON),
+      _loop_cursor(0),
+      _sweeping(false),
+      _track_devices(false),
+      _deviceCallback(nullptr),
       _thread(nullptr),
       _callback(nullptr),
-      _customCallback(nullptr) {};
+      _customCallback(nullptr) {
+#ifdef SUPPORT_KONTAKT
+    setPriorityFields(SCAN_KONTAKT, KONTAKT_FIELD_BUTTON | KONTAKT_FIELD_CLICK_ID);
+#endif
+#ifdef SUPPORT_LAIRDBT510
+    setPriorityFields(SCAN_LAIRDBT510, LAIRDBT510_FIELD_ALARMS);
+#endif
+#ifdef SUPPORT_BTHOME
+    setPriorityFields(SCAN_BTHOME, BTHOME_FIELD_EVENT);
+#endif
+#ifdef SUPPORT_RUUVI
+    setPriorityFields(SCAN_RUUVI, RUUVI_FIELD_MOVEMENT);
+#endif
+  };
 };
 
 #define Scanner Beaconscanner::instance()
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2024 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AES128_H
+#define AES128_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define AES128_KEY_SIZE     16
+#define AES128_BLOCK_SIZE   16
+
+/**
+ * Minimal AES-128 block cipher (encryption direction only), enough to implement
+ * CCM mode as used by encrypted BLE advertisements.
+ *
+ * The key schedule is expanded once in setKey() and kept in the object, so it can
+ * be cached and reused for every packet from the same device.
+ */
+class Aes128 {
+public:
+    Aes128() = default;
+    ~Aes128() = default;
+
+    void setKey(const uint8_t key[AES128_KEY_SIZE]);
+    void encrypt(const uint8_t in[AES128_BLOCK_SIZE], uint8_t out[AES128_BLOCK_SIZE]) const;
+
+    /**
+     * Decrypt and authenticate a CCM message with a 13 byte nonce (L = 2) and no associated data.
+     * 
+     * @param nonce     13 byte nonce
+     * @param in        ciphertext
+     * @param len       length of the ciphertext, must be smaller than 65536
+     * @param mic       message integrity code received with the message
+     * @param mic_len   length of the MIC: 4, 6, 8, 10, 12, 14 or 16
+     * @param out       buffer for the plaintext, at least len bytes. Can be the same as in.
+     * @return true if the MIC matches
+     */
+    bool ccmDecrypt(const uint8_t nonce[13], const uint8_t *in, size_t len, const uint8_t *mic, uint8_t mic_len, uint8_t *out) const;
+
+private:
+    uint8_t round_keys_[AES128_BLOCK_SIZE * 11];
+};
+
+#endif
@@ -20,6 +20,7 @@
 #include "config.h"
 #include "Particle.h"
 #include "os-version-macros.h"
+#include "proximity.h"
 
 typedef enum ble_scanner_config_t {
   SCAN_IBEACON         = 0x01,
@@ -27,38 +28,58 @@ typedef enum ble_scanner_config_t {
   SCAN_EDDYSTONE       = 0x04,
   SCAN_LAIRDBT510      = 0x08,
   SCAN_BTHOME          = 0x10,
-  SCAN_RUUVI           = 0x20
+  SCAN_RUUVI           = 0x20,
+  SCAN_CUSTOM          = 0x40     // Types registered with CustomBeacon::addParser()
 } ble_scanner_config_t;
 
+// Secondary indexes used by Scanner.query(), see Scanner.setIndexes()
+typedef enum {
+  INDEX_IBEACON_ID          = 0x01,     // iBeacon major and minor
+  INDEX_EDDYSTONE_NAMESPACE = 0x02,     // Eddystone UID namespace
+  INDEX_LAST_SEEN           = 0x04      // Time of the last advertisement, by BEACON_INDEX_BUCKET_MS
+} beacon_index_t;
+
+#define BEACON_INDEX_COUNT 3
+
 class Beacon {
 public:
     int8_t missed_scan;
     BleAddress getAddress() const { return address;}
-    int8_t getRssi() const {return (int8_t)(rssi/rssi_count);}
+    // Smoothed RSSI
+    int8_t getRssi() const {return proximity.getRssi();}
+    proximity_zone_t getZone() const {return proximity.getZone();}
+    // millis() of the last advertisement
+    uint32_t getLastSeen() const {return last_seen;}
     virtual void toJson(JSONWriter *writer) const {
         writer->name(address.toString()).beginObject();
+        fieldsToJson(writer);
         writer->endObject();
     };
+    // The decoded values, without the address. Used on their own for merged devices.
+    virtual void fieldsToJson(JSONWriter *writer) const {};
     bool newly_scanned;
     ble_scanner_config_t type;
 
     Beacon(ble_scanner_config_t _type) :
         newly_scanned(true),
         type(_type),
-        rssi(0), 
-        rssi_count(0) {};
+        last_seen(0),
+        changed_fields(0),
+        pending_fields(0) {};
 
 protected:
+    friend class Beaconscanner;
     BleAddress address;
-    int16_t rssi;
-    uint8_t rssi_count;
+    ProximityFilter proximity;
+    uint32_t last_seen;
+    // Decoded fields that changed in the last advertisement. The bits are defined by each
+    // beacon type, and reported with UPDATED callbacks.
+    uint32_t changed_fields;
+    // Fields changed since the UPDATED event in the queue was delivered
+    uint32_t pending_fields;
     virtual void populateData(const BleScanResult *scanResult) {
-        rssi += RSSI(scanResult);
-        rssi_count++;
-        if (rssi_count > 5) {
-            rssi = rssi/rssi_count;
-            rssi_count = 1;
-        }
+        proximity.update(RSSI(scanResult));
+        last_seen = millis();
     };
 };
 
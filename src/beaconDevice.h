@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2024 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BEACON_DEVICE_H
+#define BEACON_DEVICE_H
+
+#include "beacon.h"
+
+/**
+ * A physical device, that may advertise as several beacon types from the same address,
+ * such as a Kontakt tag sending iBeacon, Eddystone and Kontakt telemetry frames.
+ *
+ * The decoded data stays in the beacons of each type, use Scanner.getBeacon() with the
+ * address to get them. The device has its own RSSI, smoothed over the advertisements of
+ * all the types.
+ */
+class BeaconDevice {
+public:
+    BeaconDevice() :
+        types(0),
+        missed_scan(0),
+        seen(true) {};
+    ~BeaconDevice() = default;
+
+    BleAddress getAddress() const { return address; }
+    // The ble_scanner_config_t types seen from this device, OR'ed together
+    int getTypes() const { return types; }
+    bool has(ble_scanner_config_t type) const { return types & type; }
+    int8_t getRssi() const { return proximity.getRssi(); }
+    proximity_zone_t getZone() const { return proximity.getZone(); }
+
+private:
+    friend class Beaconscanner;
+    BleAddress address;
+    ProximityFilter proximity;
+    uint8_t types;
+    int8_t missed_scan;
+    bool seen;          // Advertised during the current scan period
+};
+
+#endif
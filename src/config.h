@@ -30,4 +30,8 @@
 // KKM SMART requires support for Eddystone as well
 #define SUPPORT_KKMSMART
 #define SUPPORT_BTHOME
-#define SUPPORT_RUUVI
\ No newline at end of file
+// Decryption of encrypted BTHome advertisements requires support for BTHome as well
+#define SUPPORT_BTHOME_ENCRYPTION
+#define SUPPORT_RUUVI
+// Beacon types registered by the application, see customBeacon.h
+#define SUPPORT_CUSTOM
\ No newline at end of file
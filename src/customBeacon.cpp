@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2024 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "customBeacon.h"
+
+Vector<CustomBeacon> CustomBeacon::beacons;
+Vector<const CustomBeaconParser*> CustomBeacon::parsers;
+Vector<const CustomBeaconParser*> CustomBeacon::prefix_parsers;
+const CustomBeaconParser* CustomBeacon::matched = nullptr;
+uint8_t CustomBeacon::decoded[CUSTOM_BEACON_DATA_SIZE];
+
+bool CustomBeacon::addParser(const CustomBeaconParser* parser)
+{
+    if (parser == nullptr || parser->name == nullptr || parser->decode == nullptr || parser->toJson == nullptr)
+    {
+        return false;
+    }
+    bool added = false;
+    SINGLE_THREADED_BLOCK() {
+        if (parser->match == CUSTOM_MATCH_PREFIX)
+        {
+            if (parser->prefix && parser->prefix_len > 0 && parser->prefix_len <= BLE_MAX_ADV_DATA_LEN && !prefix_parsers.contains(parser))
+            {
+                added = prefix_parsers.append(parser);
+            }
+        }
+        else
+        {
+            uint32_t k = key(parser->match, parser->id);
+            int i = 0;
+            while (i < parsers.size() && key(parsers.at(i)->match, parsers.at(i)->id) < k)
+            {
+                i++;
+            }
+            if (i == parsers.size() || key(parsers.at(i)->match, parsers.at(i)->id) != k)
+            {
+                added = parsers.insert(i, parser);
+            }
+        }
+    }
+    return added;
+}
+
+void CustomBeacon::removeParser(const CustomBeaconParser* parser)
+{
+    SINGLE_THREADED_BLOCK() {
+        parsers.removeAll(parser);
+        prefix_parsers.removeAll(parser);
+        // Marked only, the scanner removes them so that they are reported and unlinked
+        for (CustomBeacon& beacon : beacons)
+        {
+            if (beacon.parser == parser)
+            {
+                beacon.parser = nullptr;
+            }
+        }
+    }
+}
+
+const CustomBeaconParser* CustomBeacon::findParser(custom_match_t match, uint16_t id)
+{
+    uint32_t k = key(match, id);
+    int low = 0, high = parsers.size();
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        uint32_t mid_key = key(parsers.at(mid)->match, parsers.at(mid)->id);
+        if (mid_key == k)
+        {
+            return parsers.at(mid);
+        }
+        if (mid_key < k)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return nullptr;
+}
+
+bool CustomBeacon::tryParser(const CustomBeaconParser* parser, const uint8_t* payload, size_t len)
+{
+    if (parser == nullptr)
+    {
+        return false;
+    }
+    memset(decoded, 0, sizeof(decoded));
+    if (!parser->decode(payload, len, decoded))
+    {
+        return false;
+    }
+    matched = parser;
+    return true;
+}
+
+// The payload is decoded here, once, and kept for addOrUpdate(). Both run on the scan thread.
+bool CustomBeacon::isBeacon(const BleScanResult *scanResult)
+{
+    bool found = false;
+    // The application may add or remove types meanwhile
+    SINGLE_THREADED_BLOCK() {
+        found = match(scanResult);
+    }
+    return found;
+}
+
+bool CustomBeacon::match(const BleScanResult *scanResult)
+{
+    matched = nullptr;
+    uint8_t buf[BLE_MAX_ADV_DATA_LEN];
+    size_t len;
+    if (!parsers.isEmpty())
+    {
+        len = ADVERTISING_DATA(scanResult).get(BleAdvertisingDataType::MANUFACTURER_SPECIFIC_DATA, buf, sizeof(buf));
+        if (len >= 2 && tryParser(findParser(CUSTOM_MATCH_COMPANY_ID, buf[0] | (buf[1] << 8)), buf + 2, len - 2))
+        {
+            return true;
+        }
+        len = ADVERTISING_DATA(scanResult).get(BleAdvertisingDataType::SERVICE_DATA, buf, sizeof(buf));
+        if (len >= 2 && tryParser(findParser(CUSTOM_MATCH_SERVICE_UUID, buf[0] | (buf[1] << 8)), buf + 2, len - 2))
+        {
+            return true;
+        }
+    }
+    if (!prefix_parsers.isEmpty())
+    {
+        len = ADVERTISING_DATA(scanResult).get(buf, sizeof(buf));
+        for (const CustomBeaconParser* parser : prefix_parsers)
+        {
+            if (len >= parser->prefix_len && memcmp(buf, parser->prefix, parser->prefix_len) == 0 && tryParser(parser, buf, len))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void CustomBeacon::populateData(const BleScanResult *scanResult)
+{
+    Beacon::populateData(scanResult);
+    address = ADDRESS(scanResult);
+    SINGLE_THREADED_BLOCK() {
+        // removeParser() may have run since isBeacon(). Without its type, the beacon is
+        // removed by the next sweep.
+        const CustomBeaconParser* current = (parsers.contains(matched) || prefix_parsers.contains(matched)) ? matched : nullptr;
+        if (parser != current || memcmp(data, decoded, sizeof(data)) != 0)
+        {
+            changed_fields |= CUSTOM_FIELD_DATA;
+        }
+        parser = current;
+        memcpy(data, decoded, sizeof(data));
+    }
+}
+
+void CustomBeacon::fieldsToJson(JSONWriter *writer) const
+{
+    if (parser)
+    {
+        writer->name("type").value(parser->name);
+        parser->toJson(data, writer);
+    }
+    writer->name("rssi").value(getRssi());
+}
+
+CustomBeacon& CustomBeacon::addOrUpdate(const BleScanResult *scanResult)
+{
+    int i;
+    for (i = 0; i < beacons.size(); ++i)
+    {
+        if (beacons.at(i).getAddress() == ADDRESS(scanResult))
+        {
+            break;
+        }
+    }
+    if (i == beacons.size())
+    {
+        CustomBeacon new_beacon;
+        new_beacon.populateData(scanResult);
+        new_beacon.missed_scan = 0;
+        beacons.append(new_beacon);
+        return beacons.last();
+    }
+    else
+    {
+        CustomBeacon &beacon = beacons.at(i);
+        beacon.populateData(scanResult);
+        beacon.missed_scan = 0;
+        return beacon;
+    }
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2024 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CUSTOM_BEACON_H
+#define CUSTOM_BEACON_H
+
+#include "beacon.h"
+
+// Size of the decoded data of a custom beacon
+#ifndef CUSTOM_BEACON_DATA_SIZE
+#define CUSTOM_BEACON_DATA_SIZE 24
+#endif
+
+// Fields reported as changed with UPDATED callbacks
+enum custom_field_t : uint32_t {
+    CUSTOM_FIELD_DATA           = 0x01      // The decoded data is different
+};
+
+// How the advertisements of a custom beacon type are recognized
+typedef enum {
+  CUSTOM_MATCH_COMPANY_ID,      // Manufacturer specific data of this company ID
+  CUSTOM_MATCH_SERVICE_UUID,    // Service data of this 16-bit service UUID
+  CUSTOM_MATCH_PREFIX           // Advertising data starting with these bytes
+} custom_match_t;
+
+/**
+ * Describes a custom beacon type, so that the scanner stores, ages, calls back and publishes
+ * it like the built-in types. The descriptor must stay valid while it is registered, a static
+ * const is best.
+ */
+struct CustomBeaconParser {
+    // Name of the type, written as "type" in the JSON of each beacon
+    const char* name;
+    custom_match_t match;
+    // Company ID or service UUID, for CUSTOM_MATCH_COMPANY_ID and CUSTOM_MATCH_SERVICE_UUID
+    uint16_t id;
+    // For CUSTOM_MATCH_PREFIX. Up to 31 bytes
+    const uint8_t* prefix;
+    uint8_t prefix_len;
+    /**
+     * Decode an advertisement into data, CUSTOM_BEACON_DATA_SIZE bytes that are zeroed first.
+     * payload is the manufacturer or service data after the ID, or the whole advertising data
+     * for prefixes. Called from the scan thread with threads locked, return false to ignore the
+     * advertisement.
+     */
+    bool (*decode)(const uint8_t* payload, size_t len, uint8_t* data);
+    // Write the decoded data as JSON fields, in less than CUSTOM_JSON_SIZE characters
+    void (*toJson)(const uint8_t* data, JSONWriter* writer);
+};
+
+class CustomBeacon : public Beacon
+{
+public:
+    CustomBeacon() : Beacon(SCAN_CUSTOM), parser(nullptr), data{} {};
+    ~CustomBeacon() = default;
+
+    void fieldsToJson(JSONWriter *writer) const override;
+
+    // nullptr once the type is unregistered, until the beacon is removed
+    const CustomBeaconParser* getParser() const { return parser; }
+    const uint8_t* getData() const { return data; }
+
+    /**
+     * Register a custom beacon type. Types are tried after the built-in ones.
+     *
+     * @return false if the descriptor is incomplete, or another type has the same match key
+     */
+    static bool addParser(const CustomBeaconParser* parser);
+    // Unregister a type. Its beacons are removed by the next sweep of Scanner.loop(), with a REMOVED event.
+    static void removeParser(const CustomBeaconParser* parser);
+
+private:
+    const CustomBeaconParser* parser;
+    uint8_t data[CUSTOM_BEACON_DATA_SIZE];
+
+    friend class Beaconscanner;
+    static Vector<CustomBeacon> beacons;
+    // Company ID and service UUID types, sorted by key() for binary search
+    static Vector<const CustomBeaconParser*> parsers;
+    static Vector<const CustomBeaconParser*> prefix_parsers;
+    // The advertisement matched by isBeacon(), taken by addOrUpdate()
+    static const CustomBeaconParser* matched;
+    static uint8_t decoded[CUSTOM_BEACON_DATA_SIZE];
+
+    void populateData(const BleScanResult *scanResult) override;
+    static bool isBeacon(const BleScanResult *scanResult);
+    static bool match(const BleScanResult *scanResult);
+    static CustomBeacon& addOrUpdate(const BleScanResult *scanResult);
+    static uint32_t key(custom_match_t match, uint16_t id) { return ((uint32_t)match << 16) | id; }
+    static const CustomBeaconParser* findParser(custom_match_t match, uint16_t id);
+    static bool tryParser(const CustomBeaconParser* parser, const uint8_t* payload, size_t len);
+};
+
+#endif
@@ -18,30 +18,155 @@
 
 Vector<Eddystone> Eddystone::beacons;
 
+struct EddystoneExpansion {
+    const char* text;
+    uint8_t len;
+};
+
+// URL scheme prefixes and expansion codes from the Eddystone-URL specification
+static constexpr EddystoneExpansion eddystone_url_schemes[] = {
+    {"http://www.", 11}, {"https://www.", 12}, {"http://", 7}, {"https://", 8}
+};
+static constexpr EddystoneExpansion eddystone_url_expansions[] = {
+    {".com/", 5}, {".org/", 5}, {".edu/", 5}, {".net/", 5}, {".info/", 6}, {".biz/", 5}, {".gov/", 5},
+    {".com", 4}, {".org", 4}, {".edu", 4}, {".net", 4}, {".info", 5}, {".biz", 4}, {".gov", 4}
+};
+
+Eddystone::~Eddystone()
+{
+    freeFrames();
+}
+
+Eddystone::Eddystone(const Eddystone& other) :
+        Beacon(other),
+        uid(other.uid ? new Uid(*other.uid) : nullptr),
+        url(other.url ? new Url(*other.url) : nullptr),
+        tlm(other.tlm ? new Tlm(*other.tlm) : nullptr)
+#ifdef SUPPORT_KKMSMART
+        , kkm(other.kkm ? new Kkm(*other.kkm) : nullptr)
+        , motion(other.motion)
+#endif
+{
+}
+
+Eddystone::Eddystone(Eddystone&& other) :
+        Beacon(other),
+        uid(other.uid),
+        url(other.url),
+        tlm(other.tlm)
+#ifdef SUPPORT_KKMSMART
+        , kkm(other.kkm)
+        , motion(other.motion)
+#endif
+{
+    other.uid = nullptr;
+    other.url = nullptr;
+    other.tlm = nullptr;
+#ifdef SUPPORT_KKMSMART
+    other.kkm = nullptr;
+#endif
+}
+
+Eddystone& Eddystone::operator=(const Eddystone& other)
+{
+    if (this != &other) {
+        Eddystone copy(other);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+Eddystone& Eddystone::operator=(Eddystone&& other)
+{
+    if (this != &other) {
+        freeFrames();
+        Beacon::operator=(other);
+        uid = other.uid;
+        url = other.url;
+        tlm = other.tlm;
+        other.uid = nullptr;
+        other.url = nullptr;
+        other.tlm = nullptr;
+#ifdef SUPPORT_KKMSMART
+        kkm = other.kkm;
+        other.kkm = nullptr;
+        motion = other.motion;
+#endif
+    }
+    return *this;
+}
+
+void Eddystone::freeFrames()
+{
+    delete uid;
+    delete url;
+    delete tlm;
+    uid = nullptr;
+    url = nullptr;
+    tlm = nullptr;
+#ifdef SUPPORT_KKMSMART
+    delete kkm;
+    kkm = nullptr;
+#endif
+}
+
+const Eddystone::Uid& Eddystone::getUid() const
+{
+    static const Uid none;
+    return uid ? *uid : none;
+}
+
+const Eddystone::Url& Eddystone::getUrl() const
+{
+    static const Url none;
+    return url ? *url : none;
+}
+
+const Eddystone::Tlm& Eddystone::getTlm() const
+{
+    static const Tlm none;
+    return tlm ? *tlm : none;
+}
+
+#ifdef SUPPORT_KKMSMART
+const Eddystone::Kkm& Eddystone::getKkm() const
+{
+    static const Kkm none;
+    return kkm ? *kkm : none;
+}
+#endif
+
 void Eddystone::populateData(const BleScanResult *scanResult)
 {
+    Beacon::populateData(scanResult);
     address = ADDRESS(scanResult);
     uint8_t buf[BLE_MAX_ADV_DATA_LEN];
     uint8_t count = ADVERTISING_DATA(scanResult).get(BleAdvertisingDataType::SERVICE_DATA, buf, sizeof(buf));
+    changed_fields = 0;
     if (count > 2 && buf[0] == 0xAA && buf[1] == 0xFE) // Eddystone UUID
     {
         switch (buf[2])
         {
         case 0x00:
-            if (count > 19)
-                uid.populateData(buf, RSSI(scanResult));
+            if (count > 19 && frame(uid) && uid->populateData(buf, RSSI(scanResult)))
+                changed_fields |= EDDYSTONE_FIELD_UID;
             break;
         case 0x10:
-            if (count > 5)
-                url.populateData(buf, RSSI(scanResult), count);
+            if (count > 5 && frame(url) && url->populateData(buf, RSSI(scanResult), count))
+                changed_fields |= EDDYSTONE_FIELD_URL;
             break;
         case 0x20:
-            if (count == 16)      // According to the spec, packet length must be 16
-                tlm.populateData(buf);
+            if (count == 16 && frame(tlm) && tlm->populateData(buf))      // According to the spec, packet length must be 16
+                changed_fields |= EDDYSTONE_FIELD_TLM;
             break;
 #ifdef SUPPORT_KKMSMART
         case 0x21:
-            if (count >= 5) kkm.populateData(buf, count);
+            if (count >= 5 && frame(kkm)) {
+                if (kkm->populateData(buf, count))
+                    changed_fields |= EDDYSTONE_FIELD_KKM;
+                if (kkm->hasAccelData())
+                    motion.update(kkm->getAccelXaxis(), kkm->getAccelYaxis(), kkm->getAccelZaxis());
+            }
             break;
 #endif
         default:
@@ -63,83 +188,94 @@ bool Eddystone::isBeacon(const BleScanResult *scanResult)
     return false;
 }
 
-void Eddystone::toJson(JSONWriter *writer) const
+void Eddystone::fieldsToJson(JSONWriter *writer) const
 {
-        writer->name(address.toString()).beginObject();
-        if (uid.found) 
+        if (uid && uid->found) 
         {
             writer->name("uid").beginObject();
-            writer->name("power").value(uid.getPower());
-            writer->name("namespace").value(uid.namespaceString());
-            writer->name("instance").value(uid.instanceString());
-            writer->name("rssi").value(uid.getRssi());
+            writer->name("power").value(uid->getPower());
+            writer->name("namespace").value(uid->namespaceString());
+            writer->name("instance").value(uid->instanceString());
+            writer->name("rssi").value(uid->getRssi());
             writer->endObject();
         }
-        if (url.found)
+        if (url && url->found)
         {
+            char buf[EDDYSTONE_URL_MAX_LEN];
             writer->name("url").beginObject();
-            writer->name("url").value(url.urlString());
-            writer->name("power").value(url.getPower());
-            writer->name("rssi").value(url.getRssi());
+            writer->name("url").value(buf, url->expand(buf, sizeof(buf)));
+            writer->name("power").value(url->getPower());
+            writer->name("rssi").value(url->getRssi());
             writer->endObject();
         }
-        if (tlm.found)
+        if (tlm && tlm->found)
         {
             writer->name("tlm").beginObject();
-            writer->name("vbatt").value(tlm.getVbatt());
-            writer->name("temp").value(tlm.getTemp());
-            writer->name("adv_cnt").value((unsigned int)tlm.getAdvCnt());
-            writer->name("sec_cnt").value((unsigned int)tlm.getSecCnt());
+            writer->name("vbatt").value(tlm->getVbatt());
+            writer->name("temp").value(tlm->getTemp());
+            writer->name("adv_cnt").value((unsigned int)tlm->getAdvCnt());
+            writer->name("sec_cnt").value((unsigned int)tlm->getSecCnt());
             writer->endObject();
         }
 #ifdef SUPPORT_KKMSMART
-        if (kkm.found)
+        if (kkm && kkm->found)
         {
             writer->name("kkm").beginObject();
-            writer->name("vbatt").value(kkm.getVbatt());
-            writer->name("temp").value(kkm.getTemp());
-            if (kkm.hasAccelData()) {
-                writer->name("x_axis").value(kkm.getAccelXaxis());
-                writer->name("y_axis").value(kkm.getAccelYaxis());
-                writer->name("z_axis").value(kkm.getAccelZaxis());
+            writer->name("vbatt").value(kkm->getVbatt());
+            writer->name("temp").value(kkm->getTemp());
+            if (kkm->hasAccelData()) {
+                writer->name("x_axis").value(kkm->getAccelXaxis());
+                writer->name("y_axis").value(kkm->getAccelYaxis());
+                writer->name("z_axis").value(kkm->getAccelZaxis());
             }
+            if (motion.hasData())
+                writer->name("moving").value(motion.isMoving());
             writer->endObject();
         }
 #endif
-        writer->endObject();
 }
 
-void Eddystone::Uid::populateData(uint8_t *buf, int8_t rssi)
+bool Eddystone::Uid::populateData(uint8_t *buf, int8_t rssi)
 {
+    bool changed = !found || power != (int8_t)buf[3] || memcmp(name, buf+4, 10) || memcmp(instance, buf+14, 6);
     found = true;
     power = (int8_t)buf[3];
     memcpy(name,buf+4,10);
     memcpy(instance, buf+14,6);
     this->rssi+=rssi;
     rssi_count++;
+    return changed;
 }
 
-void Eddystone::Url::populateData(uint8_t *buf, int8_t rssi, uint8_t packet_size)
+bool Eddystone::Url::populateData(uint8_t *buf, int8_t rssi, uint8_t packet_size)
 {
+    uint8_t size = std::min(packet_size - 5, (int)sizeof(locator));
+    bool changed = !found || power != (int8_t)buf[3] || scheme != buf[4] || locator_size != size ||
+        memcmp(locator, buf+5, size);
     found = true;
     power = (int8_t)buf[3];
     scheme = (uint8_t)buf[4];
-    locator_size = packet_size - 5;
+    locator_size = size;
     memcpy(locator, buf+5,locator_size);
     this->rssi+=rssi;
     rssi_count++;
+    return changed;
 }
 
-void Eddystone::Tlm::populateData(uint8_t *buf)
+bool Eddystone::Tlm::populateData(uint8_t *buf)
 {
+    bool changed = false;
     if (buf[3] == 0x00)     // Version. Only one that exists right now
     {
+        uint16_t new_vbatt = (buf[4]<<8)+buf[5];
+        changed = !found || vbatt != new_vbatt || memcmp(temp, buf+6, 2);
         found = true;
-        vbatt = (buf[4]<<8)+buf[5];
+        vbatt = new_vbatt;
         memcpy(temp, buf+6, 2);
         adv_cnt = (buf[8]<<24)+(buf[9]<<16)+(buf[10]<<8)+buf[11];
         sec_cnt = (buf[12]<<24)+(buf[13]<<16)+(buf[14]<<8)+buf[15];
     }
+    return changed;
 }
 
 #ifdef SUPPORT_KKMSMART
@@ -147,115 +283,78 @@ void Eddystone::Tlm::populateData(uint8_t *buf)
 #define KKM_SENSOR_MASK_TEMP        0x2
 #define KKM_SENSOR_MASK_HUME        0x4
 #define KKM_SENSOR_MASK_ACC_AIX     0x8
-void Eddystone::Kkm::populateData(uint8_t *buf, uint8_t size) {
+bool Eddystone::Kkm::populateData(uint8_t *buf, uint8_t size) {
+    const Kkm before = *this;
     found = true;
     uint8_t cursor = 3;
     //uint8_t version = buf[cursor++];
     cursor++;   // Currently not using version. Remove this statement if version is uncommented out.
     uint8_t sensorMask = buf[cursor++];
     if ( (sensorMask & KKM_SENSOR_MASK_VOLTAGE) != 0) {
-        if ( cursor + 2 > size) return;
+        if ( cursor + 2 > size) return changedFrom(before);
         vbatt = buf[cursor] << 8 | buf[cursor+1];
         cursor += 2;
     }
     if ( (sensorMask & KKM_SENSOR_MASK_TEMP) != 0) {
-        if ( cursor + 2 > size) return;
+        if ( cursor + 2 > size) return changedFrom(before);
         temp_integer = buf[cursor++];
         temp_fraction = buf[cursor++]; 
     }
     if ( (sensorMask & KKM_SENSOR_MASK_HUME) != 0) {
-        if (cursor + 2 > size) return;
+        if (cursor + 2 > size) return changedFrom(before);
         // TODO: Add humidity
         cursor +=2;
     }
     if ( (sensorMask & KKM_SENSOR_MASK_ACC_AIX) != 0) {
-        if (cursor + 6 > size) return;
+        if (cursor + 6 > size) return changedFrom(before);
         accel_data = true;
         x_axis = buf[cursor] << 8 | buf[cursor+1];
         y_axis = buf[cursor+2] << 8 | buf[cursor+3];
         z_axis = buf[cursor+4] << 8 | buf[cursor+5];
         cursor += 6;
     }
+    return changedFrom(before);
 }
 #endif
 
-String Eddystone::Url::urlString() const
+size_t Eddystone::Url::expand(char *buf, size_t size) const
 {
-    char buf[50];
-    uint8_t cursor=0;
-    switch(scheme)
+    size_t cursor = 0;
+    if (scheme < sizeof(eddystone_url_schemes) / sizeof(eddystone_url_schemes[0]))
     {
-        case 0x00:
-            cursor+=snprintf(buf,sizeof(buf),"http://www.");
-            break;
-        case 0x01:
-            cursor+=snprintf(buf,sizeof(buf),"https://www.");
-            break;
-        case 0x02:
-            cursor+=snprintf(buf,sizeof(buf),"http://");
-            break;
-        case 0x03:
-            cursor+=snprintf(buf,sizeof(buf),"https://");
-            break;
-        default:
-            break;
-    };
-    for(uint8_t i=0;i<locator_size;i++)
+        const EddystoneExpansion& e = eddystone_url_schemes[scheme];
+        if (e.len > size) return cursor;
+        memcpy(buf, e.text, e.len);
+        cursor += e.len;
+    }
+    for (uint8_t i = 0; i < locator_size; i++)
     {
-        switch(locator[i])
+        if (locator[i] < sizeof(eddystone_url_expansions) / sizeof(eddystone_url_expansions[0]))
+        {
+            const EddystoneExpansion& e = eddystone_url_expansions[locator[i]];
+            if (cursor + e.len > size) break;
+            memcpy(buf + cursor, e.text, e.len);
+            cursor += e.len;
+        }
+        else
         {
-            case 0x00:
-                cursor+=snprintf(buf+cursor,sizeof(buf)-cursor,".com/");
-                break;
-            case 0x01:
-                cursor+=snprintf(buf+cursor,sizeof(buf)-cursor,".org/");
-                break;
-            case 0x02:
-                cursor+=snprintf(buf+cursor,sizeof(buf)-cursor,".edu/");
-                break;
-            case 0x03:
-                cursor+=snprintf(buf+cursor,sizeof(buf)-cursor,".net/");
-                break;
-            case 0x04:
-                cursor+=snprintf(buf+cursor,sizeof(buf)-cursor,".info/");
-                break;
-            case 0x05:
-                cursor+=snprintf(buf+cursor,sizeof(buf)-cursor,".biz/");
-                break;
-            case 0x06:
-                cursor+=snprintf(buf+cursor,sizeof(buf)-cursor,".gov/");
-                break;
-            case 0x07:
-                cursor+=snprintf(buf+cursor,sizeof(buf)-cursor,".com");
-                break;
-            case 0x08:
-                cursor+=snprintf(buf+cursor,sizeof(buf)-cursor,".org");
-                break;
-            case 0x09:
-                cursor+=snprintf(buf+cursor,sizeof(buf)-cursor,".edu");
-                break;
-            case 0x0a:
-                cursor+=snprintf(buf+cursor,sizeof(buf)-cursor,".net");
-                break;
-            case 0x0b:
-                cursor+=snprintf(buf+cursor,sizeof(buf)-cursor,".info");
-                break;
-            case 0x0c:
-                cursor+=snprintf(buf+cursor,sizeof(buf)-cursor,".biz");
-                break;
-            case 0x0d:
-                cursor+=snprintf(buf+cursor,sizeof(buf)-cursor,".gov");
-                break;
-            default:
-                buf[cursor++] = locator[i];
+            if (cursor + 1 > size) break;
+            buf[cursor++] = locator[i];
         }
     }
-    return String::format("%.*s", cursor, buf);
+    return cursor;
+}
+
+String Eddystone::Url::urlString() const
+{
+    char buf[EDDYSTONE_URL_MAX_LEN];
+    size_t len = expand(buf, sizeof(buf));
+    return String::format("%.*s", (int)len, buf);
 }
 
-void Eddystone::addOrUpdate(const BleScanResult *scanResult)
+Eddystone& Eddystone::addOrUpdate(const BleScanResult *scanResult)
 {
-    uint8_t i;
+    int i;
     for (i = 0; i < beacons.size(); ++i) {
         if (beacons.at(i).getAddress() == ADDRESS(scanResult)) {
             break;
@@ -266,10 +365,11 @@ void Eddystone::addOrUpdate(const BleScanResult *scanResult)
         new_beacon.populateData(scanResult);
         new_beacon.missed_scan = 0;
         beacons.append(new_beacon);
+        return beacons.last();
     } else {
         Eddystone& beacon = beacons.at(i);
-        beacon.newly_scanned = false;
         beacon.populateData(scanResult);
         beacon.missed_scan = 0;
+        return beacon;
     }
 }
\ No newline at end of file
@@ -18,14 +18,34 @@
 #define EDDYSTONE_H
 
 #include "beacon.h"
+#include "motion.h"
 
 // Eddystone specification: https://github.com/google/eddystone/blob/master/protocol-specification.md
 
+// Longest URL scheme prefix plus 17 encoded bytes that each expand to at most 6 characters
+#define EDDYSTONE_URL_MAX_LEN (12 + 17 * 6)
+
+// Frames reported as changed with UPDATED callbacks. The TLM counters are not compared, as they change with every frame.
+enum eddystone_field_t : uint32_t {
+  EDDYSTONE_FIELD_UID   = 0x01,
+  EDDYSTONE_FIELD_URL   = 0x02,
+  EDDYSTONE_FIELD_TLM   = 0x04,
+  EDDYSTONE_FIELD_KKM   = 0x08
+};
+
 class Eddystone : public Beacon
 {
 public:
-    Eddystone() : Beacon(SCAN_EDDYSTONE) {};
-    ~Eddystone() = default;
+    Eddystone() : Beacon(SCAN_EDDYSTONE), uid(nullptr), url(nullptr), tlm(nullptr)
+#ifdef SUPPORT_KKMSMART
+        , kkm(nullptr)
+#endif
+        {};
+    ~Eddystone();
+    Eddystone(const Eddystone& other);
+    Eddystone(Eddystone&& other);
+    Eddystone& operator=(const Eddystone& other);
+    Eddystone& operator=(Eddystone&& other);
 
     class Uid {
     public:
@@ -36,6 +56,8 @@ public:
         int8_t getPower() const {return power;}
         uint8_t* getNamespace() {return name;}
         uint8_t* getInstance() {return instance;}
+        const uint8_t* getNamespace() const {return name;}
+        const uint8_t* getInstance() const {return instance;}
         String namespaceString() const {
             return String::format("%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X",
                         name[0],name[1],name[2],name[3],name[4],
@@ -45,7 +67,7 @@ public:
             return String::format("%02X%02X%02X%02X%02X%02X",instance[0],instance[1],instance[2],instance[3],
                         instance[4],instance[5]);
         }
-        void populateData(uint8_t *buf, int8_t rssi);
+        bool populateData(uint8_t *buf, int8_t rssi);
 
         bool found;
     private:
@@ -65,8 +87,13 @@ public:
         int8_t getRssi() const {return (int8_t)(rssi/rssi_count);}
         int8_t getPower() const {return power;}
         String urlString() const;
+        /**
+         * Expand the URL into buf, which should be EDDYSTONE_URL_MAX_LEN long to fit any URL.
+         * Returns the length of the URL, the output is not null terminated.
+         */
+        size_t expand(char *buf, size_t size) const;
         bool found;
-        void populateData(uint8_t *buf, int8_t rssi, uint8_t packet_size);
+        bool populateData(uint8_t *buf, int8_t rssi, uint8_t packet_size);
     private:
         int16_t rssi;
         uint8_t rssi_count;
@@ -87,7 +114,7 @@ public:
         uint32_t getSecCnt() const {return sec_cnt;}
 
         bool found;
-        void populateData(uint8_t *buf);
+        bool populateData(uint8_t *buf);
     private:
         uint16_t vbatt;
         int8_t temp[2];
@@ -116,37 +143,53 @@ public:
         int16_t getAccelYaxis() const { return y_axis; };
         int16_t getAccelZaxis() const { return z_axis; };
         bool found;
-        void populateData(uint8_t *buf, uint8_t size);
+        bool populateData(uint8_t *buf, uint8_t size);
     private:
         uint16_t vbatt;
         int8_t temp_integer;
         uint8_t temp_fraction;
         int16_t x_axis, y_axis, z_axis;
         bool accel_data;
+        bool changedFrom(const Kkm& other) const {
+            return !other.found || vbatt != other.vbatt || temp_integer != other.temp_integer ||
+                temp_fraction != other.temp_fraction || accel_data != other.accel_data ||
+                x_axis != other.x_axis || y_axis != other.y_axis || z_axis != other.z_axis;
+        }
     };
 #endif
 
-    void toJson(JSONWriter *writer) const override;
+    void fieldsToJson(JSONWriter *writer) const override;
 
-    Uid getUid() const {return uid;}
-    Url getUrl() const {return url;}
-    Tlm getTlm() const {return tlm;}
+    /**
+     * Frames are only stored once the beacon has sent them. Until then, these return
+     * an empty frame with found set to false.
+     */
+    const Uid& getUid() const;
+    const Url& getUrl() const;
+    const Tlm& getTlm() const;
 #ifdef SUPPORT_KKMSMART
-    Kkm getKkm() const {return kkm;}
+    const Kkm& getKkm() const;
+    const MotionDetector& getMotion() const { return motion; }
 #endif
 
 private:
-    Uid uid;
-    Url url;
-    Tlm tlm;
+    Uid* uid;
+    Url* url;
+    Tlm* tlm;
 #ifdef SUPPORT_KKMSMART
-    Kkm kkm;
+    Kkm* kkm;
+    MotionDetector motion;
 #endif
+    void freeFrames();
+    template<typename T> static T* frame(T*& f) {
+        if (f == nullptr) f = new T();
+        return f;
+    }
     friend class Beaconscanner;
     static Vector<Eddystone> beacons;
     void populateData(const BleScanResult *scanResult) override;
     static bool isBeacon(const BleScanResult *scanResult);
-    static void addOrUpdate(const BleScanResult *scanResult);
+    static Eddystone& addOrUpdate(const BleScanResult *scanResult);
 };
 
 #endif
\ No newline at end of file
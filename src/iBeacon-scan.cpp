@@ -17,6 +17,67 @@
 #include "iBeacon-scan.h"
 
 Vector<iBeaconScan> iBeaconScan::beacons;
+uint8_t iBeaconScan::uuids[IBEACON_MAX_UUIDS][IBEACON_UUID_LEN];
+uint8_t iBeaconScan::uuid_count = 0;
+uint32_t iBeaconScan::uuid_overflow = 0;
+Vector<iBeaconRegion> iBeaconScan::regions;
+uint16_t iBeaconScan::next_region_id = 0;
+iBeaconRegionCallback iBeaconScan::regionCallback = nullptr;
+
+uint8_t iBeaconScan::internUuid(const uint8_t *uuid)
+{
+    for (uint8_t i = 0; i < uuid_count; i++) {
+        if (!memcmp(uuids[i], uuid, IBEACON_UUID_LEN)) {
+            return i;
+        }
+    }
+    if (uuid_count < IBEACON_MAX_UUIDS) {
+        memcpy(uuids[uuid_count], uuid, IBEACON_UUID_LEN);
+        return uuid_count++;
+    }
+    // Full, reuse an entry that no stored beacon refers to anymore
+    bool used[IBEACON_MAX_UUIDS] = {};
+    SINGLE_THREADED_BLOCK() {
+        for (const iBeaconScan& beacon : beacons) {
+            if (beacon.uuid_index < IBEACON_MAX_UUIDS) {
+                used[beacon.uuid_index] = true;
+            }
+        }
+    }
+    for (uint8_t i = 0; i < IBEACON_MAX_UUIDS; i++) {
+        if (!used[i]) {
+            memcpy(uuids[i], uuid, IBEACON_UUID_LEN);
+            return i;
+        }
+    }
+    return IBEACON_UUID_NONE;
+}
+
+void iBeaconScan::formatUuid(const uint8_t *uuid, char *out)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    for (uint8_t i = 0; i < IBEACON_UUID_LEN; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) {
+            *out++ = '-';
+        }
+        *out++ = hex[uuid[i] >> 4];
+        *out++ = hex[uuid[i] & 0x0F];
+    }
+    *out = '\0';
+}
+
+String iBeaconScan::getUuid() const
+{
+    char buf[37];
+    formatUuid(getUuidBytes(), buf);
+    return String(buf);
+}
+
+const uint8_t* iBeaconScan::getUuidBytes() const
+{
+    static const uint8_t none[IBEACON_UUID_LEN] = {0};
+    return (uuid_index < IBEACON_MAX_UUIDS) ? uuids[uuid_index] : none;
+}
 
 void iBeaconScan::populateData(const BleScanResult *scanResult)
 {
@@ -24,12 +85,22 @@ void iBeaconScan::populateData(const BleScanResult *scanResult)
     address = ADDRESS(scanResult);
     uint8_t custom_data[BLE_MAX_ADV_DATA_LEN];
     ADVERTISING_DATA(scanResult).customData(custom_data, sizeof(custom_data));
-    snprintf(uuid, sizeof(uuid), "%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X",
-                custom_data[4], custom_data[5], custom_data[6], custom_data[7], custom_data[8], custom_data[9], custom_data[10], custom_data[11], custom_data[12],
-                custom_data[13], custom_data[14], custom_data[15], custom_data[16], custom_data[17], custom_data[18], custom_data[19]);
-    major = custom_data[20] * 256 + custom_data[21];
-    minor = custom_data[22] * 256 + custom_data[23];
-    power = (int8_t)custom_data[24];
+    changed_fields = 0;
+    // Beacons almost never change UUID, so check the current one before searching the table.
+    // isBeacon() already interned it.
+    if (uuid_index >= IBEACON_MAX_UUIDS || memcmp(uuids[uuid_index], &custom_data[4], IBEACON_UUID_LEN)) {
+        uuid_index = internUuid(&custom_data[4]);
+        changed_fields |= IBEACON_FIELD_UUID;
+    }
+    uint16_t new_major = custom_data[20] * 256 + custom_data[21];
+    uint16_t new_minor = custom_data[22] * 256 + custom_data[23];
+    int8_t new_power = (int8_t)custom_data[24];
+    if (new_major != major) changed_fields |= IBEACON_FIELD_MAJOR;
+    if (new_minor != minor) changed_fields |= IBEACON_FIELD_MINOR;
+    if (new_power != power) changed_fields |= IBEACON_FIELD_POWER;
+    major = new_major;
+    minor = new_minor;
+    power = new_power;
 }
 
 bool iBeaconScan::isBeacon(const BleScanResult *scanResult)
@@ -40,26 +111,182 @@ bool iBeaconScan::isBeacon(const BleScanResult *scanResult)
     {
         if (custom_data[0] == 0x4c && custom_data[1] == 0x00 && custom_data[2] == 0x02 && custom_data[3] == 0x15)
         {
+            if (!regions.isEmpty() && !matchRegions(custom_data))
+            {
+                return false;
+            }
+            // Not stored without its UUID, rather than with none or a stale one
+            if (internUuid(&custom_data[4]) == IBEACON_UUID_NONE)
+            {
+                if (uuid_overflow++ == 0)
+                {
+                    Log.warn("iBeacon UUID table is full, raise IBEACON_MAX_UUIDS");
+                }
+                return false;
+            }
             return true;
         }
     }
     return false;
 }
 
-void iBeaconScan::toJson(JSONWriter *writer) const
+// FNV-1a
+uint32_t iBeaconScan::hashUuid(const uint8_t *uuid)
+{
+    uint32_t hash = 2166136261UL;
+    for (uint8_t i = 0; i < IBEACON_UUID_LEN; i++) {
+        hash = (hash ^ uuid[i]) * 16777619UL;
+    }
+    return hash;
+}
+
+bool iBeaconScan::matchRegions(const uint8_t *data)
+{
+    const uint8_t *uuid = &data[4];
+    uint16_t major = data[20] * 256 + data[21];
+    uint16_t minor = data[22] * 256 + data[23];
+    uint32_t hash = hashUuid(uuid);
+    bool found = false;
+    SINGLE_THREADED_BLOCK() {
+        // Binary search for the first region with this hash, the regions of a UUID are next to each other
+        int lo = 0, hi = regions.size();
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (regions.at(mid).hash < hash) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for (int i = lo; i < regions.size() && regions.at(i).hash == hash; i++) {
+            iBeaconRegion& r = regions.at(i);
+            if (memcmp(r.uuid, uuid, IBEACON_UUID_LEN) ||
+                (r.match >= iBeaconRegion::MATCH_MAJOR && r.major != major) ||
+                (r.match == iBeaconRegion::MATCH_MINOR && r.minor != minor)) {
+                continue;
+            }
+            // A beacon can be in several regions, such as a UUID and one of its majors
+            r.seen = true;
+            if (!r.inside) {
+                r.inside = true;
+                r.entered = true;
+            }
+            found = true;
+        }
+    }
+    return found;
+}
+
+void iBeaconScan::updateRegions(bool period_done, uint8_t clear_missed)
+{
+    // The callbacks get copies once all the regions are updated, they may add or remove regions
+    struct Edge {
+        iBeaconRegion region;
+        bool entered;
+    };
+    Vector<Edge> edges;
+    SINGLE_THREADED_BLOCK() {
+        for (auto& r : regions) {
+            if (r.entered) {
+                edges.append({r, true});
+            }
+            r.entered = false;
+            if (period_done) {
+                if (r.seen) {
+                    r.missed = 0;
+                } else if (r.inside && ++r.missed >= clear_missed) {
+                    r.inside = false;
+                    edges.append({r, false});
+                }
+                r.seen = false;
+            }
+        }
+    }
+    if (regionCallback) {
+        for (const auto& edge : edges) {
+            regionCallback(edge.region, edge.entered);
+        }
+    }
+}
+
+int iBeaconScan::addRegion(const uint8_t uuid[IBEACON_UUID_LEN], int32_t major, int32_t minor)
+{
+    if (major < IBEACON_ANY || major > 0xFFFF || minor < IBEACON_ANY || minor > 0xFFFF || (major == IBEACON_ANY && minor != IBEACON_ANY)) {
+        return -1;
+    }
+    iBeaconRegion r = {};
+    memcpy(r.uuid, uuid, IBEACON_UUID_LEN);
+    r.hash = hashUuid(uuid);
+    r.match = (minor != IBEACON_ANY) ? iBeaconRegion::MATCH_MINOR : (major != IBEACON_ANY) ? iBeaconRegion::MATCH_MAJOR : iBeaconRegion::MATCH_UUID;
+    r.major = (major != IBEACON_ANY) ? major : 0;
+    r.minor = (minor != IBEACON_ANY) ? minor : 0;
+    r.id = next_region_id++;
+    int i = 0;
+    while (i < regions.size() && regions.at(i).hash <= r.hash) {
+        i++;
+    }
+    SINGLE_THREADED_BLOCK() {
+        regions.insert(i, r);
+    }
+    return r.id;
+}
+
+int iBeaconScan::addRegion(const char* uuid, int32_t major, int32_t minor)
+{
+    uint8_t bytes[IBEACON_UUID_LEN];
+    uint8_t digits = 0;
+    for (; uuid != nullptr && *uuid; uuid++) {
+        char c = *uuid;
+        uint8_t nibble;
+        if (c == '-') continue;
+        else if (c >= '0' && c <= '9') nibble = c - '0';
+        else if (c >= 'a' && c <= 'f') nibble = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') nibble = c - 'A' + 10;
+        else break;
+        if (digits == IBEACON_UUID_LEN * 2) break;
+        bytes[digits / 2] = (digits % 2) ? (bytes[digits / 2] | nibble) : (uint8_t)(nibble << 4);
+        digits++;
+    }
+    if (uuid == nullptr || *uuid || digits != IBEACON_UUID_LEN * 2) {
+        Log.error("iBeacon: region UUID must be %d hex characters", IBEACON_UUID_LEN * 2);
+        return -1;
+    }
+    return addRegion(bytes, major, minor);
+}
+
+void iBeaconScan::removeRegion(int id)
+{
+    SINGLE_THREADED_BLOCK() {
+        for (int i = 0; i < regions.size(); i++) {
+            if (regions.at(i).id == id) {
+                regions.removeAt(i);
+                break;
+            }
+        }
+    }
+}
+
+void iBeaconScan::clearRegions()
+{
+    SINGLE_THREADED_BLOCK() {
+        regions.clear();
+    }
+}
+
+void iBeaconScan::fieldsToJson(JSONWriter *writer) const
 {
-        writer->name(address.toString()).beginObject();
-        writer->name("uuid").value(getUuid());
+        char uuid[37];
+        formatUuid(getUuidBytes(), uuid);
+        writer->name("uuid").value(uuid);
         writer->name("major").value(getMajor());
         writer->name("minor").value(getMinor());
         writer->name("power").value(getPower());
         writer->name("rssi").value(getRssi());
-        writer->endObject();
 }
 
-void iBeaconScan::addOrUpdate(const BleScanResult *scanResult)
+iBeaconScan& iBeaconScan::addOrUpdate(const BleScanResult *scanResult)
 {
-    uint8_t i;
+    int i;
     for (i = 0; i < beacons.size(); ++i) {
         if (beacons.at(i).getAddress() == ADDRESS(scanResult)) {
             break;
@@ -70,10 +297,11 @@ void iBeaconScan::addOrUpdate(const BleScanResult *scanResult)
         new_beacon.populateData(scanResult);
         new_beacon.missed_scan = 0;
         beacons.append(new_beacon);
+        return beacons.last();
     } else {
         iBeaconScan& beacon = beacons.at(i);
-        beacon.newly_scanned = false;
         beacon.populateData(scanResult);
         beacon.missed_scan = 0;
+        return beacon;
     }
 }
\ No newline at end of file
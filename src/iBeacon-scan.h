@@ -19,21 +19,111 @@
 
 #include "beacon.h"
 
+// Maximum number of different proximity UUIDs tracked at the same time. Fleets normally use one or two.
+#ifndef IBEACON_MAX_UUIDS
+#define IBEACON_MAX_UUIDS 16
+#endif
+#define IBEACON_UUID_LEN  16
+#define IBEACON_UUID_NONE 0xFF
+
+// Fields reported as changed with UPDATED callbacks
+enum ibeacon_field_t : uint32_t {
+  IBEACON_FIELD_UUID    = 0x01,
+  IBEACON_FIELD_MAJOR   = 0x02,
+  IBEACON_FIELD_MINOR   = 0x04,
+  IBEACON_FIELD_POWER   = 0x08
+};
+
+// Major or minor of a region that matches any value
+#define IBEACON_ANY -1
+
+/**
+ * A group of iBeacons: all the beacons with a proximity UUID, or with a UUID and major,
+ * or with a UUID, major and minor.
+ */
+class iBeaconRegion {
+public:
+    int getId() const {return id;}
+    const uint8_t* getUuidBytes() const {return uuid;}
+    int32_t getMajor() const {return (match >= MATCH_MAJOR) ? major : IBEACON_ANY;}
+    int32_t getMinor() const {return (match == MATCH_MINOR) ? minor : IBEACON_ANY;}
+    // True from the first beacon heard in the region, until none has been heard for the missed count of scan periods
+    bool isInside() const {return inside;}
+
+private:
+    friend class iBeaconScan;
+    enum Match: uint8_t {
+        MATCH_UUID, MATCH_MAJOR, MATCH_MINOR
+    };
+    uint32_t hash;          // Of the UUID, the regions are sorted on it
+    uint8_t uuid[IBEACON_UUID_LEN];
+    uint16_t major;
+    uint16_t minor;
+    uint16_t id;
+    Match match;
+    uint8_t missed;
+    bool inside, seen, entered;
+};
+
+typedef void (*iBeaconRegionCallback)(const iBeaconRegion& region, bool entered);
+
 class iBeaconScan : public Beacon
 {
 public:
-    iBeaconScan() : Beacon(SCAN_IBEACON) {};
+    iBeaconScan() : Beacon(SCAN_IBEACON), uuid_index(IBEACON_UUID_NONE), major(0), minor(0), power(0) {};
     ~iBeaconScan() = default;
 
-    void toJson(JSONWriter *writer) const override;
+    void fieldsToJson(JSONWriter *writer) const override;
 
-    const char* getUuid() const {return uuid;};
+    String getUuid() const;
+    const uint8_t* getUuidBytes() const;
     uint16_t getMajor() const {return major;}
     uint16_t getMinor() const {return minor;}
     int8_t getPower() const {return power;}
 
+    /**
+     * Only keep the iBeacons of some regions. Once a region is added, advertisements from
+     * iBeacons outside all the regions are ignored as if they were not iBeacons.
+     *
+     * @param uuid  proximity UUID, as 32 hex characters, dashes are ignored
+     * @param major major of the region, or IBEACON_ANY
+     * @param minor minor of the region, or IBEACON_ANY. Requires a major.
+     * @return the ID of the region, or -1 if the arguments are not valid
+     */
+    static int addRegion(const char* uuid, int32_t major = IBEACON_ANY, int32_t minor = IBEACON_ANY);
+    static int addRegion(const uint8_t uuid[IBEACON_UUID_LEN], int32_t major = IBEACON_ANY, int32_t minor = IBEACON_ANY);
+    static void removeRegion(int id);
+    static void clearRegions();
+    static const Vector<iBeaconRegion>& getRegions() {return regions;}
+    /**
+     * Number of advertisements ignored because their UUID didn't fit in the IBEACON_MAX_UUIDS
+     * table, with every entry used by a stored beacon. Entries are reused once their beacons are
+     * removed, a copy of a removed beacon kept by the application may then show another UUID.
+     */
+    static uint32_t getUuidOverflowCount() {return uuid_overflow;}
+    /**
+     * Called from Scanner.loop() when the first beacon of a region is heard, and when none has
+     * been heard for the missed count of scan periods. The region is a copy, the callback may
+     * add or remove regions.
+     */
+    static void setRegionCallback(iBeaconRegionCallback callback) {regionCallback = callback;}
+
 private:
-    char uuid[37];
+    static Vector<iBeaconRegion> regions;
+    static uint16_t next_region_id;
+    static iBeaconRegionCallback regionCallback;
+    static uint32_t hashUuid(const uint8_t *uuid);
+    static bool matchRegions(const uint8_t *data);
+    static void updateRegions(bool period_done, uint8_t clear_missed);
+
+    // Proximity UUIDs are shared by many beacons, so each one is stored once and beacons keep an index
+    static uint8_t uuids[IBEACON_MAX_UUIDS][IBEACON_UUID_LEN];
+    static uint8_t uuid_count;
+    static uint32_t uuid_overflow;
+    static uint8_t internUuid(const uint8_t *uuid);
+    static void formatUuid(const uint8_t *uuid, char *out);
+
+    uint8_t uuid_index;
     uint16_t major;
     uint16_t minor;
     int8_t power;
@@ -41,7 +131,7 @@ private:
     static Vector<iBeaconScan> beacons;
     void populateData(const BleScanResult *scanResult) override;
     static bool isBeacon(const BleScanResult *scanResult);
-    static void addOrUpdate(const BleScanResult *scanResult);
+    static iBeaconScan& addOrUpdate(const BleScanResult *scanResult);
 };
 
 #endif
\ No newline at end of file
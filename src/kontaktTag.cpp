@@ -17,6 +17,144 @@
 #include "kontaktTag.h"
 
 Vector<KontaktTag> KontaktTag::beacons;
+uint32_t KontaktTag::malformed_count = 0;
+
+// Telemetry v1 fields, indexed by field ID
+// Definition is here: https://developer.kontakt.io/hardware/packets/telemetry/
+const KontaktTag::FieldDecoder KontaktTag::field_decoders[] = {
+    {0, nullptr},                                   // 0x00
+    {5, KontaktTag::decodeSystemHealth},            // 0x01 System health: timestamp, battery level
+    {8, KontaktTag::decodeAccelerometer},           // 0x02 Accelerometer: sensitivity, axes, last double tap, last movement
+    {0, nullptr},                                   // 0x03
+    {0, nullptr},                                   // 0x04
+    {2, KontaktTag::decodeSensors},                 // 0x05 Light level and temperature
+    {4, KontaktTag::decodeAccelerometerRaw},        // 0x06 Accelerometer: sensitivity, axes
+    {2, KontaktTag::decodeMovement},                // 0x07 Last movement (threshold) event
+    {2, KontaktTag::decodeDoubleTap},               // 0x08 Last double tap event
+    {2, KontaktTag::decodeTap},                     // 0x09 Last tap event
+    {1, KontaktTag::decodeLight},                   // 0x0A Light level
+    {1, KontaktTag::decodeTemperature},             // 0x0B Temperature, 1 degree C
+    {1, KontaktTag::decodeBattery},                 // 0x0C Battery level
+    {2, KontaktTag::decodeButton},                  // 0x0D Button press
+    {0, nullptr},                                   // 0x0E
+    {4, KontaktTag::decodeUtcTime},                 // 0x0F UTC time
+    {0, nullptr},                                   // 0x10
+    {1, KontaktTag::decodeClickId},                 // 0x11 Button click ID
+    {1, KontaktTag::decodeHumidity},                // 0x12 Relative humidity
+    {2, KontaktTag::decodeTemperature16},           // 0x13 Temperature, 1/256 degree C
+};
+
+void KontaktTag::decodeSystemHealth(KontaktTag& tag, const uint8_t *data)
+{
+    decodeUtcTime(tag, data);
+    decodeBattery(tag, data + 4);
+}
+
+void KontaktTag::decodeAccelerometer(KontaktTag& tag, const uint8_t *data)
+{
+    decodeAccelerometerRaw(tag, data);
+    decodeDoubleTap(tag, data + 4);
+    decodeMovement(tag, data + 6);
+}
+
+void KontaktTag::decodeSensors(KontaktTag& tag, const uint8_t *data)
+{
+    decodeLight(tag, data);
+    decodeTemperature(tag, data + 1);
+}
+
+void KontaktTag::decodeAccelerometerRaw(KontaktTag& tag, const uint8_t *data)
+{
+    tag.accel_sensitivity = data[0];
+    tag.x_axis = (int8_t)data[1];
+    tag.y_axis = (int8_t)data[2];
+    tag.z_axis = (int8_t)data[3];
+    tag.fields |= KONTAKT_FIELD_ACCEL;
+    // Axes are in units of the sensitivity, in mg per digit
+    int32_t mg = tag.accel_sensitivity ? tag.accel_sensitivity : 16;
+    tag.motion.update(tag.x_axis * mg, tag.y_axis * mg, tag.z_axis * mg);
+}
+
+void KontaktTag::decodeMovement(KontaktTag& tag, const uint8_t *data)
+{
+    tag.accel_last_movement = data[0] + data[1] * 256;
+    tag.fields |= KONTAKT_FIELD_MOVEMENT;
+    tag.motion.updateLastEvent(tag.accel_last_movement);
+}
+
+void KontaktTag::decodeDoubleTap(KontaktTag& tag, const uint8_t *data)
+{
+    tag.accel_last_double_tap = data[0] + data[1] * 256;
+    tag.fields |= KONTAKT_FIELD_DOUBLE_TAP;
+}
+
+void KontaktTag::decodeButton(KontaktTag& tag, const uint8_t *data)
+{
+    tag.button_time = data[0] + data[1] * 256;
+    tag.fields |= KONTAKT_FIELD_BUTTON;
+}
+
+void KontaktTag::decodeTap(KontaktTag& tag, const uint8_t *data)
+{
+    tag.accel_last_tap = data[0] + data[1] * 256;
+    tag.fields |= KONTAKT_FIELD_TAP;
+}
+
+void KontaktTag::decodeLight(KontaktTag& tag, const uint8_t *data)
+{
+    tag.light = data[0];
+    tag.fields |= KONTAKT_FIELD_LIGHT;
+}
+
+void KontaktTag::decodeTemperature(KontaktTag& tag, const uint8_t *data)
+{
+    // Tags sending both keep the 16-bit one
+    if (!(tag.fields & KONTAKT_FIELD_TEMPERATURE_16))
+    {
+        tag.temperature = (int16_t)((int8_t)data[0] * 256);
+    }
+    tag.fields |= KONTAKT_FIELD_TEMPERATURE;
+}
+
+void KontaktTag::decodeBattery(KontaktTag& tag, const uint8_t *data)
+{
+    tag.battery = data[0];
+    tag.fields |= KONTAKT_FIELD_BATTERY;
+}
+
+void KontaktTag::decodeUtcTime(KontaktTag& tag, const uint8_t *data)
+{
+    tag.utc_time = (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+    tag.fields |= KONTAKT_FIELD_UTC_TIME;
+}
+
+void KontaktTag::decodeClickId(KontaktTag& tag, const uint8_t *data)
+{
+    tag.click_id = data[0];
+    tag.fields |= KONTAKT_FIELD_CLICK_ID;
+}
+
+void KontaktTag::decodeHumidity(KontaktTag& tag, const uint8_t *data)
+{
+    tag.humidity = data[0];
+    tag.fields |= KONTAKT_FIELD_HUMIDITY;
+}
+
+void KontaktTag::decodeTemperature16(KontaktTag& tag, const uint8_t *data)
+{
+    tag.temperature = (int16_t)(data[0] | (data[1] << 8));
+    tag.fields |= KONTAKT_FIELD_TEMPERATURE | KONTAKT_FIELD_TEMPERATURE_16;
+}
+
+uint32_t KontaktTag::newEvent(kontakt_field_t field, uint16_t seconds, uint16_t prev_seconds, uint16_t prev_fields)
+{
+    if (!(prev_fields & field))
+    {
+        // First time the tag is heard, only a recent event is new
+        return (seconds <= KONTAKT_RECENT_EVENT_SECONDS) ? field : 0;
+    }
+    return (seconds < prev_seconds) ? field : 0;
+}
 
 void KontaktTag::populateData(const BleScanResult *scanResult)
 {
@@ -24,57 +162,63 @@ void KontaktTag::populateData(const BleScanResult *scanResult)
     address = ADDRESS(scanResult);
     uint8_t buf[BLE_MAX_ADV_DATA_LEN];
     uint8_t count = ADVERTISING_DATA(scanResult).get(BleAdvertisingDataType::SERVICE_DATA, buf, sizeof(buf));
-    uint8_t cursor = 0;
-    if (count > 3 && buf[0] == 0x6A && buf[1] == 0xFE) // Kontakt UUID
+    changed_fields = 0;
+    if (count > 3 && buf[0] == 0x6A && buf[1] == 0xFE && buf[2] == 0x03) // Kontakt UUID, Telemetry v1 packet
     {
-        cursor += 2;
-        if (buf[cursor] == 0x03) // Telemetry v1 packet
-        // Definition is here: https://developer.kontakt.io/hardware/packets/telemetry/
+        const uint16_t prev_fields = fields;
+        const uint8_t prev_battery = battery, prev_light = light, prev_sensitivity = accel_sensitivity;
+        const uint8_t prev_humidity = humidity, prev_click = click_id;
+        const int8_t prev_x = x_axis, prev_y = y_axis, prev_z = z_axis;
+        const int16_t prev_temperature = temperature;
+        const uint16_t prev_button = button_time, prev_double_tap = accel_last_double_tap, prev_movement = accel_last_movement;
+        const uint16_t prev_tap = accel_last_tap;
+        // Each field is a length byte (which counts the field ID), the field ID, and the payload
+        uint8_t cursor = 3;
+        while (cursor < count)
         {
-            cursor++;
-            while (cursor < count)
+            uint8_t size = buf[cursor];
+            if (size == 0 || cursor + 1 + size > count)
             {
-                uint8_t size = buf[cursor];
-                cursor++;
-                switch (buf[cursor++])
+                malformed_count++;
+                break;
+            }
+            uint8_t id = buf[cursor + 1];
+            uint8_t len = size - 1;
+            if (id < sizeof(field_decoders) / sizeof(field_decoders[0]) && field_decoders[id].decode)
+            {
+                if (len >= field_decoders[id].min_len)
+                {
+                    field_decoders[id].decode(*this, &buf[cursor + 2]);
+                }
+                else
                 {
-                case 0x01:       // System health
-                    cursor += 4; // Advance to battery level
-                    battery = buf[cursor++];
-                    break;
-                case 0x02:
-                    accel_sensitivity = buf[cursor++];
-                    x_axis = buf[cursor++];
-                    y_axis = buf[cursor++];
-                    z_axis = buf[cursor++];
-                    accel_last_double_tap = buf[cursor] + buf[cursor + 1] * 256;
-                    cursor += 2;
-                    accel_last_movement = buf[cursor] + buf[cursor + 1] * 256;
-                    cursor += 2;
-                    accel_data = true;
-                    break;
-                case 0x05: // Light and temp
-                    // Light sensor is at cursor
-                    cursor++;
-                    // Temp in C is at cursor
-                    temperature = buf[cursor++];
-                    break;
-                case 0x0D: // Button press
-                    button_time = buf[cursor] + buf[cursor + 1] * 256;
-                    cursor += 2;
-                    break;
-                default:
-                    cursor--;
-                    char nbuf[100];
-                    for (uint8_t i = 0; i < size; i++)
-                    {
-                        snprintf(nbuf + i * 2, sizeof(nbuf), "%02X", buf[cursor + i]);
-                    }
-                    nbuf[size * 2] = '\0';
-                    Log.info("%s", nbuf);
-                    cursor += size;
+                    malformed_count++;
                 }
             }
+            // Unknown fields are skipped using their length
+            cursor += 1 + size;
+        }
+        // Fields received for the first time count as changed
+        // The UTC time changes with every packet, it isn't reported as a change
+        changed_fields = fields & ~prev_fields & ~(KONTAKT_FIELD_BUTTON | KONTAKT_FIELD_DOUBLE_TAP | KONTAKT_FIELD_MOVEMENT |
+                                                   KONTAKT_FIELD_TAP | KONTAKT_FIELD_CLICK_ID | KONTAKT_FIELD_UTC_TIME);
+        if (battery != prev_battery) changed_fields |= KONTAKT_FIELD_BATTERY;
+        if (temperature != prev_temperature) changed_fields |= KONTAKT_FIELD_TEMPERATURE;
+        if (light != prev_light) changed_fields |= KONTAKT_FIELD_LIGHT;
+        if (humidity != prev_humidity) changed_fields |= KONTAKT_FIELD_HUMIDITY;
+        // The event fields count the seconds since the event, so only a lower value is a new event
+        changed_fields |= newEvent(KONTAKT_FIELD_BUTTON, button_time, prev_button, prev_fields);
+        changed_fields |= newEvent(KONTAKT_FIELD_DOUBLE_TAP, accel_last_double_tap, prev_double_tap, prev_fields);
+        changed_fields |= newEvent(KONTAKT_FIELD_MOVEMENT, accel_last_movement, prev_movement, prev_fields);
+        changed_fields |= newEvent(KONTAKT_FIELD_TAP, accel_last_tap, prev_tap, prev_fields);
+        // The click ID counts the clicks
+        if ((prev_fields & KONTAKT_FIELD_CLICK_ID) && click_id != prev_click)
+        {
+            changed_fields |= KONTAKT_FIELD_CLICK_ID;
+        }
+        if (x_axis != prev_x || y_axis != prev_y || z_axis != prev_z || accel_sensitivity != prev_sensitivity)
+        {
+            changed_fields |= KONTAKT_FIELD_ACCEL;
         }
     }
 }
@@ -91,27 +235,35 @@ bool KontaktTag::isTag(const BleScanResult *scanResult)
     return false;
 }
 
-void KontaktTag::toJson(JSONWriter *writer) const
+void KontaktTag::fieldsToJson(JSONWriter *writer) const
 {
-        writer->name(address.toString()).beginObject();
-        if (battery != 0xFF)
+        if (hasField(KONTAKT_FIELD_BATTERY))
             writer->name("batt").value(battery);
-        if (temperature != 0xFF)
-            writer->name("temp").value(temperature);
-        if (button_time != 0xFFFF)
+        if (hasField(KONTAKT_FIELD_TEMPERATURE_16))
+            writer->name("temp").value(getPreciseTemperature(), 2);
+        else if (hasField(KONTAKT_FIELD_TEMPERATURE))
+            writer->name("temp").value(getTemperature());
+        if (hasField(KONTAKT_FIELD_HUMIDITY))
+            writer->name("humidity").value(humidity);
+        if (hasField(KONTAKT_FIELD_LIGHT))
+            writer->name("light").value(light);
+        if (hasField(KONTAKT_FIELD_CLICK_ID))
+            writer->name("click_id").value(click_id);
+        if (hasField(KONTAKT_FIELD_BUTTON))
             writer->name("button").value(button_time);
-        if (accel_data)
+        if (hasField(KONTAKT_FIELD_ACCEL))
         {
             writer->name("x_axis").value(x_axis);
             writer->name("y_axis").value(y_axis);
             writer->name("z_axis").value(z_axis);
         }
+        if (motion.hasData())
+            writer->name("moving").value(motion.isMoving());
         writer->name("rssi").value(getRssi());
-        writer->endObject();
 }
 
-void KontaktTag::addOrUpdate(const BleScanResult *scanResult) {
-    uint8_t i;
+KontaktTag& KontaktTag::addOrUpdate(const BleScanResult *scanResult) {
+    int i;
     for (i = 0; i < beacons.size(); i++)
     {
         if (beacons.at(i).getAddress() == ADDRESS(scanResult))
@@ -124,10 +276,11 @@ void KontaktTag::addOrUpdate(const BleScanResult *scanResult) {
         new_beacon.populateData(scanResult);
         new_beacon.missed_scan = 0;
         beacons.append(new_beacon);
+        return beacons.last();
     } else {
         KontaktTag& beacon = beacons.at(i);
-        beacon.newly_scanned = false;
         beacon.populateData(scanResult);
         beacon.missed_scan = 0;
+        return beacon;
     }
 }
\ No newline at end of file
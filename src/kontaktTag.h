@@ -18,41 +18,110 @@
 #define KONTAKT_TAG_H
 
 #include "beacon.h"
+#include "motion.h"
+
+// Telemetry fields that have been received, see hasField()
+enum kontakt_field_t : uint16_t {
+  KONTAKT_FIELD_BATTERY       = 0x0001,
+  KONTAKT_FIELD_ACCEL         = 0x0002,   // Axes
+  KONTAKT_FIELD_DOUBLE_TAP    = 0x0004,
+  KONTAKT_FIELD_MOVEMENT      = 0x0008,
+  KONTAKT_FIELD_LIGHT         = 0x0010,
+  KONTAKT_FIELD_TEMPERATURE   = 0x0020,
+  KONTAKT_FIELD_BUTTON        = 0x0040,
+  KONTAKT_FIELD_TAP           = 0x0080,
+  KONTAKT_FIELD_UTC_TIME      = 0x0100,
+  KONTAKT_FIELD_CLICK_ID      = 0x0200,   // A new value is a new button click
+  KONTAKT_FIELD_HUMIDITY      = 0x0400,
+  KONTAKT_FIELD_TEMPERATURE_16 = 0x0800   // The temperature has 1/256 degree resolution
+};
+
+// When a tag is first heard, a button press or movement reported this many seconds ago still counts as a new event
+#ifndef KONTAKT_RECENT_EVENT_SECONDS
+#define KONTAKT_RECENT_EVENT_SECONDS 10
+#endif
 
 class KontaktTag : public Beacon
 {
 public:
     KontaktTag() : Beacon(SCAN_KONTAKT)
     {
-        battery = temperature = 0xFF;
-        button_time = accel_last_double_tap = accel_last_movement = 0xFFFF;
-        accel_data = false;
+        utc_time = 0;
+        battery = 0xFF;
+        temperature = (int16_t)0xFF00;
+        button_time = accel_last_double_tap = accel_last_movement = accel_last_tap = 0xFFFF;
+        accel_sensitivity = light = humidity = click_id = 0;
+        x_axis = y_axis = z_axis = 0;
+        fields = 0;
     };
     ~KontaktTag() = default;
 
-    void toJson(JSONWriter *writer) const override;
+    void fieldsToJson(JSONWriter *writer) const override;
 
     uint8_t getBattery() const { return battery; };
-    int8_t getTemperature() const { return temperature; };
+    int8_t getTemperature() const { return (int8_t)(temperature / 256); };
+    // In degrees C, with a 1/256 degree resolution for tags sending the 16-bit temperature
+    float getPreciseTemperature() const { return temperature / 256.0f; };
+    uint8_t getHumidity() const { return humidity; };
+    // UTC time of the tag, in seconds since 1970. 0 if the tag clock isn't set
+    uint32_t getUtcTime() const { return utc_time; };
+    uint8_t getClickId() const { return click_id; };
+    uint8_t getLightLevel() const { return light; };
     uint8_t getAccelSensitivity() const { return accel_sensitivity; };
     uint16_t getButtonTime() const { return button_time; };
     uint16_t getAccelLastDoubleTap() const { return accel_last_double_tap; };
     uint16_t getAccelLastMovement() const { return accel_last_movement; };
-    bool hasAccelData() const { return accel_data; };
+    uint16_t getAccelLastTap() const { return accel_last_tap; };
+    bool hasAccelData() const { return hasField(KONTAKT_FIELD_ACCEL); };
+    bool hasField(kontakt_field_t field) const { return fields & field; };
     int8_t getAccelXaxis() const { return x_axis; };
     int8_t getAccelYaxis() const { return y_axis; };
     int8_t getAccelZaxis() const { return z_axis; };
+    const MotionDetector& getMotion() const { return motion; };
+
+    /**
+     * Number of telemetry packets, across all tags, that were truncated or had
+     * fields shorter than the specification.
+     */
+    static uint32_t getMalformedCount() { return malformed_count; };
 
 private:
-    uint8_t battery, accel_sensitivity;
-    uint16_t button_time, accel_last_double_tap, accel_last_movement;
-    int8_t x_axis, y_axis, z_axis, temperature;
-    bool accel_data;
+    uint32_t utc_time;
+    uint16_t fields;
+    uint16_t button_time, accel_last_double_tap, accel_last_movement, accel_last_tap;
+    int16_t temperature;    // 1/256 degree C
+    uint8_t battery, accel_sensitivity, light, humidity, click_id;
+    int8_t x_axis, y_axis, z_axis;
+    MotionDetector motion;
     friend class Beaconscanner;
     static Vector<KontaktTag> beacons;
+    static uint32_t malformed_count;
     static bool isTag(const BleScanResult *scanResult);
     void populateData(const BleScanResult *scanResult) override;
-    static void addOrUpdate(const BleScanResult *scanResult);
+    static KontaktTag& addOrUpdate(const BleScanResult *scanResult);
+    static uint32_t newEvent(kontakt_field_t field, uint16_t seconds, uint16_t prev_seconds, uint16_t prev_fields);
+
+    // Telemetry field decoders, the payload length is checked against the field table before calling
+    struct FieldDecoder {
+        uint8_t min_len;
+        void (*decode)(KontaktTag& tag, const uint8_t *data);
+    };
+    static const FieldDecoder field_decoders[];
+    static void decodeSystemHealth(KontaktTag& tag, const uint8_t *data);
+    static void decodeAccelerometer(KontaktTag& tag, const uint8_t *data);
+    static void decodeSensors(KontaktTag& tag, const uint8_t *data);
+    static void decodeAccelerometerRaw(KontaktTag& tag, const uint8_t *data);
+    static void decodeMovement(KontaktTag& tag, const uint8_t *data);
+    static void decodeDoubleTap(KontaktTag& tag, const uint8_t *data);
+    static void decodeButton(KontaktTag& tag, const uint8_t *data);
+    static void decodeTap(KontaktTag& tag, const uint8_t *data);
+    static void decodeLight(KontaktTag& tag, const uint8_t *data);
+    static void decodeTemperature(KontaktTag& tag, const uint8_t *data);
+    static void decodeBattery(KontaktTag& tag, const uint8_t *data);
+    static void decodeUtcTime(KontaktTag& tag, const uint8_t *data);
+    static void decodeClickId(KontaktTag& tag, const uint8_t *data);
+    static void decodeHumidity(KontaktTag& tag, const uint8_t *data);
+    static void decodeTemperature16(KontaktTag& tag, const uint8_t *data);
 };
 
 #endif
\ No newline at end of file
@@ -19,11 +19,33 @@
 #include "lairdbt510.h"
 
 #define RECEIVE_TIMEOUT_LOOPS     20    // Each loop is approximately 1 second
+#define CONNECT_TIMEOUT_LOOPS     10
+#define MAX_BACKOFF_SHIFT         6     // Retry delays stop doubling after this many attempts
 #define MAX_MANUFACTURER_DATA_LEN 37
+#define VSP_SERVICE_UUID          "569a1101-b87f-490c-92cb-11ba5ea5167c"
+#define VSP_RX_UUID               "569a2001-b87f-490c-92cb-11ba5ea5167c"
+#define VSP_TX_UUID               "569a2000-b87f-490c-92cb-11ba5ea5167c"
 
 LairdBt510EventCallback LairdBt510::_eventCallback = nullptr;
 LairdBt510EventCallback LairdBt510::_alarmCallback = nullptr;
+system_tick_t LairdBt510::_alarmRenotify = 0;
+
+// Alarm flags of the advertisement, and the event they are reported with
+static constexpr struct {
+    lairdbt510_flags flag;
+    lairdbt510_event_type event;
+} alarm_events[] = {
+    {lairdbt510_flags::LOW_BATTERY_ALARM, lairdbt510_event_type::BATTERY_BAD},
+    {lairdbt510_flags::HIGH_TEMP_ALARM_0, lairdbt510_event_type::ALARM_HIGH_TEMP_1},
+    {lairdbt510_flags::HIGH_TEMP_ALARM_1, lairdbt510_event_type::ALARM_HIGH_TEMP_2},
+    {lairdbt510_flags::LOW_TEMP_ALARM_0,  lairdbt510_event_type::ALARM_LOW_TEMP_1},
+    {lairdbt510_flags::LOW_TEMP_ALARM_1,  lairdbt510_event_type::ALARM_LOW_TEMP_2},
+    {lairdbt510_flags::DELTA_TEMP_ALARM,  lairdbt510_event_type::ALARM_DELTA_TEMP},
+    {lairdbt510_flags::MOVEMENT_ALARM,    lairdbt510_event_type::MOVEMENT},
+};
 Vector<LairdBt510> LairdBt510::beacons;
+Vector<LairdBt510::AppliedConfig> LairdBt510::applied;
+LairdBt510Scheduler* LairdBt510Scheduler::_instance = nullptr;
 
 void LairdBt510::populateData(const BleScanResult *scanResult)
 {
@@ -31,13 +53,25 @@ void LairdBt510::populateData(const BleScanResult *scanResult)
     address = ADDRESS(scanResult);
     uint8_t buf[MAX_MANUFACTURER_DATA_LEN];
     uint8_t count = ADVERTISING_DATA(scanResult).get(BleAdvertisingDataType::MANUFACTURER_SPECIFIC_DATA, buf, MAX_MANUFACTURER_DATA_LEN);
-    uint16_t prev_record = _record_number;
+    changed_fields = 0;
     if (count > 25) {   // Advertising data is correct, either table 1 or table 3
         bool prev_magnet = _magnet_state;
+        int16_t prev_temp = _temp;
+        uint16_t prev_batt = _batt_voltage;
         uint16_t flags = buf[7] << 8 | buf[6];
         _magnet_state = (flags & (uint16_t)lairdbt510_flags::MAGNET_STATE);
-        _record_number = buf[16] << 8 | buf[15];
+        uint16_t record = buf[16] << 8 | buf[15];
         lairdbt510_event_type event = (lairdbt510_event_type)buf[14];
+        // The same record is advertised many times, and on both PHYs. Older records can
+        // still be heard after a newer one, only a reset restarts the numbering. The reset
+        // record is repeated too, so it is only new once, and later records count from it.
+        bool new_record = !_record_valid ||
+            ((event == lairdbt510_event_type::RESET) ? record != _record_number : (int16_t)(record - _record_number) > 0);
+        if (new_record) {
+            _record_number = record;
+            _record_valid = true;
+            changed_fields |= LAIRDBT510_FIELD_RECORD;
+        }
         switch (event)
         {
         case lairdbt510_event_type::TEMPERATURE:
@@ -73,6 +107,7 @@ void LairdBt510::populateData(const BleScanResult *scanResult)
                 _name.clear();
                 _name.append((const char*)buf, count);
                 _name.append('\0');
+                changed_fields |= LAIRDBT510_FIELD_NAME;
                 Log.trace("New device name: %s", _name.data());
             }
         }
@@ -84,32 +119,49 @@ void LairdBt510::populateData(const BleScanResult *scanResult)
                 _name.clear();
                 _name.append((const char*)buf, count);
                 _name.append('\0');
+                changed_fields |= LAIRDBT510_FIELD_NAME;
                 Log.trace("New device name: %s", _name.data());
             }
         }
-        if (_eventCallback && _record_number != prev_record)
+        if (_eventCallback && new_record)
             _eventCallback(*this, event);
+        uint16_t alarms = 0;
+        for (const auto& a : alarm_events) {
+            alarms |= (flags & (uint16_t)a.flag);
+        }
+        uint16_t notify = alarms ^ _alarm_flags;
+        if (_alarmRenotify && alarms && (millis() - _alarm_notified) >= _alarmRenotify) {
+            notify |= alarms;
+        }
+        if (alarms != _alarm_flags) changed_fields |= LAIRDBT510_FIELD_ALARMS;
+        if (_temp != prev_temp) changed_fields |= LAIRDBT510_FIELD_TEMPERATURE;
+        if (_batt_voltage != prev_batt) changed_fields |= LAIRDBT510_FIELD_BATTERY;
+        if (_magnet_state != prev_magnet) changed_fields |= LAIRDBT510_FIELD_MAGNET;
+        _alarm_flags = alarms;
+        if (notify) {
+            _alarm_notified = millis();
+        }
         if (_alarmCallback != nullptr) {
-            if (flags & (uint16_t)lairdbt510_flags::LOW_BATTERY_ALARM)
-                _alarmCallback(*this, lairdbt510_event_type::BATTERY_BAD);
-            if (flags & (uint16_t)lairdbt510_flags::HIGH_TEMP_ALARM_0)
-                _alarmCallback(*this, lairdbt510_event_type::ALARM_HIGH_TEMP_1);
-            if (flags & (uint16_t)lairdbt510_flags::HIGH_TEMP_ALARM_1)
-                _alarmCallback(*this, lairdbt510_event_type::ALARM_HIGH_TEMP_2);
-            if (flags & (uint16_t)lairdbt510_flags::LOW_TEMP_ALARM_0)
-                _alarmCallback(*this, lairdbt510_event_type::ALARM_LOW_TEMP_1);
-            if (flags & (uint16_t)lairdbt510_flags::LOW_TEMP_ALARM_1)
-                _alarmCallback(*this, lairdbt510_event_type::ALARM_LOW_TEMP_2);
-            if (flags & (uint16_t)lairdbt510_flags::DELTA_TEMP_ALARM)
-                _alarmCallback(*this, lairdbt510_event_type::ALARM_DELTA_TEMP);
-            if (flags & (uint16_t)lairdbt510_flags::MOVEMENT_ALARM)
-                _alarmCallback(*this, lairdbt510_event_type::MOVEMENT);
+            for (const auto& a : alarm_events) {
+                if (notify & (uint16_t)a.flag) {
+                    _alarmCallback(*this, a.event);
+                }
+            }
             if (prev_magnet != _magnet_state)
                 _alarmCallback(*this, lairdbt510_event_type::MAGNET_PROXIMITY);
         }
     }
 }
 
+bool LairdBt510::isAlarmActive(lairdbt510_event_type alarm) const {
+    for (const auto& a : alarm_events) {
+        if (a.event == alarm) {
+            return _alarm_flags & (uint16_t)a.flag;
+        }
+    }
+    return false;
+}
+
 bool LairdBt510::isBeacon(const BleScanResult *scanResult)
 {
     uint8_t buf[9];
@@ -121,19 +173,17 @@ bool LairdBt510::isBeacon(const BleScanResult *scanResult)
     return false;
 }
 
-void LairdBt510::toJson(JSONWriter *writer) const
+void LairdBt510::fieldsToJson(JSONWriter *writer) const
 {
-        writer->name(address.toString()).beginObject();
         writer->name("magnet_near").value(magnetNear());
         writer->name("temp").value(getTemperature());
         writer->name("record").value(getRecordNumber());
         writer->name("batt").value(getBattVoltage());
         writer->name("rssi").value(getRssi());
-        writer->endObject();
 }
 
-void LairdBt510::addOrUpdate(const BleScanResult *scanResult) {
-    uint8_t i;
+LairdBt510& LairdBt510::addOrUpdate(const BleScanResult *scanResult) {
+    int i;
     for (i = 0; i < beacons.size(); ++i)
     {
         if (beacons.at(i).getAddress() == ADDRESS(scanResult))
@@ -146,48 +196,376 @@ void LairdBt510::addOrUpdate(const BleScanResult *scanResult) {
         new_beacon.populateData(scanResult);
         new_beacon.missed_scan = 0;
         beacons.append(new_beacon);
+        return beacons.last();
     } else {
         LairdBt510& beacon = beacons.at(i);
-        beacon.newly_scanned = false;
         beacon.populateData(scanResult);
         beacon.missed_scan = 0;
+        return beacon;
     }
 }
 
-class JSONVectorWriter: public JSONWriter {
+// Serializes straight into chunks that fit the ATT MTU, and writes each one as soon as it is full.
+// The writes are acknowledged, so the sensor paces the transfer.
+class JSONChunkWriter: public JSONWriter {
 public:
-    JSONVectorWriter(): v_(Vector<char>()) {}
-    ~JSONVectorWriter() = default;
-    Vector<char> vector() const {return v_;}
-    size_t vectorSize() const {return v_.size();}
+    JSONChunkWriter(BleCharacteristic& characteristic, size_t chunk_size):
+        characteristic_(characteristic),
+        chunk_size_(std::min(chunk_size, sizeof(buf_))),
+        size_(0),
+        sent_(0),
+        error_(0) {}
+    ~JSONChunkWriter() = default;
+    /**
+     * Write what is left in the buffer.
+     * @return the error of the first failed write, or 0
+     */
+    int flush() {
+        if (size_ > 0 && error_ == 0) {
+            int ret = characteristic_.setValue(buf_, size_, BleTxRxType::ACK);
+            if (ret < 0) {
+                error_ = ret;
+            } else {
+                sent_ += size_;
+            }
+        }
+        size_ = 0;
+        return error_;
+    }
+    size_t sent() const {return sent_;}
 
 protected:
     virtual void write(const char *data, size_t size) override {
-        v_.append(data, (int)size);
+        while (size > 0 && error_ == 0) {
+            size_t n = std::min(size, chunk_size_ - size_);
+            memcpy(buf_ + size_, data, n);
+            size_ += n;
+            data += n;
+            size -= n;
+            if (size_ == chunk_size_) {
+                flush();
+            }
+        }
     }
 
 private:
-    Vector<char> v_;
+    BleCharacteristic& characteristic_;
+    uint8_t buf_[LAIRDBT510_GATT_CHUNK_SIZE];
+    size_t chunk_size_, size_, sent_;
+    int error_;
 };
 
 void LairdBt510::onDataReceived(const uint8_t* data, size_t size, const BlePeerDevice& peer, void* context) {
-    LairdBt510* ctx = (LairdBt510*)context;
-    // TODO: Check the returned JSON to make sure it is ok
+    // The context pointer is not used, as the beacons vector may have been reallocated
+    // since the subscription was made. Look the device up by its address instead.
+    LairdBt510* dev = find(peer.address());
+    if (!dev || dev->state_ != RECEIVING) {
+        return;
+    }
     Log.trace("Received %d bytes", size);
-    uint8_t buf[size+1];
-    memcpy(buf, data, size);
-    buf[size] = 0;
-    Log.trace((char*)buf);
-    ctx->state_ = DISCONNECT;
+    if (dev->response_.append(data, size)) {
+        dev->handleResponse();
+    }
 }
 
-void LairdBt510::onPairingEvent(const BlePairingEvent& event) {
-    LairdBt510* dev = nullptr;
+void LairdBt510::handleResponse() {
+    if (response_.overflowed()) {
+        Log.error("Response is too large");
+        complete(Error::TOO_LARGE);
+        state_ = DISCONNECT;
+        return;
+    }
+    Log.trace(response_.data());
+    JSONValue reply = JSONValue::parseCopy(response_.data(), response_.size());
+    if (!reply.isValid() || !reply.isObject()) {
+        Log.error("Invalid response");
+        complete(Error::PROTOCOL);
+        state_ = DISCONNECT;
+        return;
+    }
+    JSONObjectIterator iter(reply);
+    JSONValue result;
+    int id = -1;
+    bool success = false;
+    while (iter.next()) {
+        if (iter.name() == "id") {
+            id = iter.value().toInt();
+        } else if (iter.name() == "result") {
+            result = iter.value();
+            success = true;
+        } else if (iter.name() == "error") {
+            Log.error("Sensor returned an error");
+        }
+    }
+    if (id != configId_) {
+        // Reply to an earlier request, keep waiting for ours
+        response_.reset();
+        return;
+    }
+    if (!success) {
+        complete(Error::PROTOCOL);
+        state_ = DISCONNECT;
+    } else if (operation_ == DOWNLOAD_LOG) {
+        handleLogResult(result);
+    } else {
+        rememberApplied();
+        state_ = DISCONNECT;
+    }
+}
+
+void LairdBt510::handleLogResult(const JSONValue& result) {
+    switch (log_step_)
+    {
+    case LOG_PREPARE:
+        log_remaining_ = result.toInt();
+        log_step_ = LOG_READ;
+        Log.trace("%u events in the log", log_remaining_);
+        break;
+    case LOG_READ:
+    {
+        // The result is [count, "base64 encoded events"]
+        JSONArrayIterator iter(result);
+        size_t count = 0;
+        if (iter.next() && iter.value().toInt() > 0 && iter.next()) {
+            JSONString events = iter.value().toString();
+            count = decodeLog(events.data(), events.size());
+        }
+        // An empty read means the sensor has nothing more for us
+        log_remaining_ = (count == 0) ? 0 : log_remaining_ - std::min((size_t)log_remaining_, count);
+        log_unacked_ += count;
+        if (log_unacked_ >= LAIRDBT510_LOG_ACK_BATCH || ((log_remaining_ == 0 || logFull()) && log_unacked_ > 0)) {
+            log_step_ = LOG_ACK;
+        }
+        break;
+    }
+    case LOG_ACK:
+        log_unacked_ = 0;
+        log_step_ = LOG_READ;
+        break;
+    }
+    // The next request is sent right away by loop(), without waiting for the timer.
+    // Reading on with a full log would overwrite events that are already deleted from the sensor.
+    if (log_step_ == LOG_READ && (log_remaining_ == 0 || logFull())) {
+        state_ = DISCONNECT;
+    } else {
+        state_ = REQUESTING;
+    }
+}
+
+static int8_t base64Value(char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+size_t LairdBt510::decodeLog(const char* data, size_t size) {
+    // Each event is 8 bytes: timestamp (4), data (2), type (1), salt (1), little endian
+    uint8_t record[8];
+    size_t filled = 0, count = 0;
+    uint32_t bits = 0;
+    uint8_t nbits = 0;
+    for (size_t i = 0; i < size; i++) {
+        int8_t v = base64Value(data[i]);
+        if (v < 0) {
+            continue;       // Padding
+        }
+        bits = (bits << 6) | v;
+        nbits += 6;
+        if (nbits < 8) {
+            continue;
+        }
+        nbits -= 8;
+        record[filled++] = (uint8_t)(bits >> nbits);
+        if (filled == sizeof(record)) {
+            LairdBt510LogEvent event;
+            event.timestamp = (uint32_t)record[3] << 24 | record[2] << 16 | record[1] << 8 | record[0];
+            event.data = record[5] << 8 | record[4];
+            event.type = record[6];
+            event.salt = record[7];
+            log_.push(event);
+            filled = 0;
+            count++;
+        }
+    }
+    return count;
+}
+
+bool LairdBt510::discover() {
+    peer_.discoverAllServices();
+    if (!full_discovery_) {
+        // Only discover the characteristics of the VSP service, which is much quicker than
+        // discovering every service of the sensor
+        BleService service;
+        if (peer_.getServiceByUUID(service, BleUuid(VSP_SERVICE_UUID))) {
+            peer_.discoverCharacteristicsOfService(service);
+            if (peer_.getCharacteristicByUUID(rx, BleUuid(VSP_RX_UUID)) && peer_.getCharacteristicByUUID(tx, BleUuid(VSP_TX_UUID))) {
+                return true;
+            }
+        }
+        Log.trace("VSP service not found, discovering all characteristics");
+        full_discovery_ = true;
+    }
+    peer_.discoverAllCharacteristics();
+    return peer_.getCharacteristicByUUID(rx, BleUuid(VSP_RX_UUID)) && peer_.getCharacteristicByUUID(tx, BleUuid(VSP_TX_UUID));
+}
+
+void LairdBt510::sendRequest() {
+    response_.reset();
+    timeout_ = 0;
+    state_ = RECEIVING;
+    // 3 bytes of each ATT packet are the opcode and handle
+    JSONChunkWriter writer(rx, att_mtu_ - 3);
+    if (operation_ == CONFIGURE) {
+        config_.createJson(writer, configId_);
+    } else {
+        const char* method = "readLog";
+        unsigned int param = LAIRDBT510_LOG_READ_COUNT;
+        if (log_step_ == LOG_PREPARE) {
+            method = "prepareLog";
+            param = 0;      // Oldest events first
+        } else if (log_step_ == LOG_ACK) {
+            method = "ackLog";
+            param = log_unacked_;
+        }
+        writer.beginObject();
+        writer.name("jsonrpc").value("2.0");
+        writer.name("method").value(method);
+        writer.name("params").beginArray().value(param).endArray();
+        writer.name("id").value(++configId_);
+        writer.endObject();
+    }
+    int ret = writer.flush();
+    if (ret < 0 && !full_discovery_) {
+        // The characteristics found by the targeted discovery did not work, find everything and retry
+        Log.trace("Sending request failed: %d, rediscovering", ret);
+        full_discovery_ = true;
+        // A sensor that got the start of the request would read the retry after a truncated
+        // JSON prefix, so it has to start over on a new connection
+        state_ = (writer.sent() > 0) ? RECONNECTING : SENDING;
+        return;
+    }
+    if (ret < 0) {
+        Log.error("Sending request failed: %d", ret);
+        complete(Error::IO);
+        state_ = CLEANUP;
+        return;
+    }
+    Log.trace("Sent %u bytes", writer.sent());
+}
+
+const LairdBt510LogEvent& LairdBt510Log::at(size_t index) const {
+    return events_.at((head_ + index) % LAIRDBT510_LOG_CAPACITY);
+}
+
+bool LairdBt510Log::takeFirst(LairdBt510LogEvent& event) {
+    if (count_ == 0) {
+        return false;
+    }
+    event = events_.at(head_);
+    head_ = (head_ + 1) % LAIRDBT510_LOG_CAPACITY;
+    count_--;
+    return true;
+}
+
+void LairdBt510Log::push(const LairdBt510LogEvent& event) {
+    if (events_.isEmpty() && !events_.resize(LAIRDBT510_LOG_CAPACITY)) {
+        dropped_++;
+        return;
+    }
+    events_.at((head_ + count_) % LAIRDBT510_LOG_CAPACITY) = event;
+    if (count_ < LAIRDBT510_LOG_CAPACITY) {
+        count_++;
+    } else {
+        head_ = (head_ + 1) % LAIRDBT510_LOG_CAPACITY;
+        dropped_++;
+    }
+}
+
+void LairdBt510Log::clear() {
+    events_.clear();
+    events_.trimToSize();
+    head_ = count_ = 0;
+    dropped_ = 0;
+}
+
+bool LairdBt510Response::append(const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size && !complete_; i++) {
+        char c = (char)data[i];
+        if (depth_ == 0 && c != '{') {
+            continue;       // Skip anything before the reply starts
+        }
+        if (in_string_) {
+            if (escape_) {
+                escape_ = false;
+            } else if (c == '\\') {
+                escape_ = true;
+            } else if (c == '"') {
+                in_string_ = false;
+            }
+        } else if (c == '"') {
+            in_string_ = true;
+        } else if (c == '{' || c == '[') {
+            depth_++;
+        } else if (c == '}' || c == ']') {
+            complete_ = (--depth_ == 0);
+        }
+        if (!overflow_) {
+            if (buf_.size() < LAIRDBT510_MAX_RESPONSE_LEN) {
+                buf_.append(c);
+            } else {
+                overflow_ = true;
+            }
+        }
+    }
+    if (complete_) {
+        buf_.append('\0');
+    }
+    return complete_;
+}
+
+void LairdBt510Response::reset() {
+    buf_.clear();
+    buf_.trimToSize();
+    depth_ = 0;
+    in_string_ = escape_ = complete_ = overflow_ = false;
+}
+
+LairdBt510* LairdBt510::find(const BleAddress& address) {
     for (auto& i : beacons) {
-        if (i.getAddress() == event.peer.address()) {
-            dev = &i;
+        if (i.getAddress() == address) {
+            return &i;
+        }
+    }
+    return nullptr;
+}
+
+void LairdBt510::complete(Error::Type error) {
+    if (handler_data_) {
+        auto p = Promise<bool>::fromDataPtr(handler_data_);
+        if (error == Error::NONE) {
+            // A download that stopped on a full log leaves events on the sensor
+            p.setResult(operation_ != DOWNLOAD_LOG || log_remaining_ == 0);
+        } else {
+            p.setError(error);
         }
+        handler_data_ = nullptr;
     }
+}
+
+// The scanner drops the sensor, end the request so its future and connection are released
+void LairdBt510::abort() {
+    if (state_ != IDLE && peer_.connected()) {
+        peer_.disconnect();
+    }
+    state_ = IDLE;
+    complete(Error::ABORTED);
+}
+
+void LairdBt510::onPairingEvent(const BlePairingEvent& event) {
+    LairdBt510* dev = find(event.peer.address());
     if (dev) {
         switch (event.type)
         {
@@ -207,19 +585,14 @@ void LairdBt510::onPairingEvent(const BlePairingEvent& event) {
                 Log.trace("Pairing complete for: %s", dev->getAddress().toString().c_str());
                 break;
             case BLE_GAP_SEC_STATUS_CONFIRM_VALUE:
-                dev->state_ = DISCONNECT;
                 Log.error("Passkey is incorrect");
-                if (dev->state_ != CLEANUP) {
-                    auto p = Promise<bool>::fromDataPtr(dev->handler_data_);
-                    p.setError(Error::INVALID_ARGUMENT);
-                    dev->state_ = CLEANUP;
-                }
+                dev->complete(Error::INVALID_ARGUMENT);
+                dev->state_ = CLEANUP;
                 break;
 #endif
             default:
                 if (dev->state_ != CLEANUP) {
-                    auto p = Promise<bool>::fromDataPtr(dev->handler_data_);
-                    p.setError(Error::INVALID_ARGUMENT);
+                    dev->complete(Error::INVALID_ARGUMENT);
                     dev->state_ = CLEANUP;
                 }
                 Log.error("Other pairing error: %02X", event.payload.status.status);
@@ -236,95 +609,174 @@ void LairdBt510::onPairingEvent(const BlePairingEvent& event) {
     }
 }
 
+void LairdBt510::onAttMtuExchanged(const BlePeerDevice& peer, size_t mtu, void* context) {
+    LairdBt510* dev = find(peer.address());
+    if (dev) {
+        dev->att_mtu_ = std::max(std::min(mtu, (size_t)LAIRDBT510_DESIRED_ATT_MTU), (size_t)LAIRDBT510_MIN_ATT_MTU);
+    }
+}
+
 void LairdBt510::onDisconnected(const BlePeerDevice& peer) {
-    for (auto& i : beacons) {
-        if (i.getAddress() == peer.address() && i.state_ != CLEANUP) {
-            auto p = Promise<bool>::fromDataPtr(i.handler_data_);
-            p.setError(Error::ABORTED);
-            i.state_ = IDLE;
-            break;
-        }
+    LairdBt510* dev = find(peer.address());
+    if (dev && dev->state_ != IDLE && dev->state_ != CLEANUP && dev->state_ != RECONNECTING) {
+        dev->complete(Error::ABORTED);
+        dev->state_ = IDLE;
     }
 }
 
 void LairdBt510::loop() {
-    static unsigned int timer = System.uptime();
-    static uint8_t timeout = 0;
-    if (state_ != prev_state_ || timer != System.uptime()) {
+    if (state_ != prev_state_ || timer_ != System.uptime()) {
         prev_state_ = state_;
         switch (state_)
         {
         case CONNECTING:
+            att_mtu_ = LAIRDBT510_MIN_ATT_MTU;
             peer_ = BLE.connect(getAddress(), false);
             if (peer_.connected()) {
                 state_ = PAIRING;
+                timeout_ = 0;
+            } else if (++timeout_ > CONNECT_TIMEOUT_LOOPS) {
+                Log.trace("Connection timed out: %s", getAddress().toString().c_str());
+                complete(Error::TIMEOUT);
+                state_ = IDLE;
             }
             break;
         case PAIRING:
+            if (++timeout_ > RECEIVE_TIMEOUT_LOOPS) {
+                Log.trace("Pairing timed out: %s", getAddress().toString().c_str());
+                complete(Error::TIMEOUT);
+                state_ = CLEANUP;
+                break;
+            }
             BLE.startPairing(peer_);
             Log.trace("Pairing");
             break;
         case SENDING:
         {
-            peer_.discoverAllServices();
-            peer_.discoverAllCharacteristics();
-            peer_.getCharacteristicByUUID(rx, BleUuid("569a2001-b87f-490c-92cb-11ba5ea5167c"));
-            peer_.getCharacteristicByUUID(tx, BleUuid("569a2000-b87f-490c-92cb-11ba5ea5167c"));
+            if (!discover()) {
+                Log.error("Configuration characteristics not found");
+                complete(Error::NOT_FOUND);
+                state_ = CLEANUP;
+                break;
+            }
             tx.onDataReceived(onDataReceived, this);
             tx.subscribe(true);
-            JSONVectorWriter writer_;
-            config_.createJson(writer_, configId_);
-            char buf[writer_.vectorSize()];
-            for (size_t i = 0; i < writer_.vectorSize(); ++i) {
-                buf[i] = writer_.vector().at(i);
-            }
-            Log.trace("Send value: %s", buf);
-            Log.trace("set value return: %d",rx.setValue(reinterpret_cast<const uint8_t*>(writer_.vector().data()), writer_.vectorSize(), BleTxRxType::ACK));
-            if (state_ == SENDING) {
-                state_ = RECEIVING;
-                timeout = 0;
-            }
+            sendRequest();
             break;
         }
+        case REQUESTING:
+            sendRequest();
+            break;
         case RECEIVING:
         // The state change is handled automatically by the onReceive callback, but we should
         // have a timeout here in case something went wrong.
         {
-            if (++timeout > RECEIVE_TIMEOUT_LOOPS) {
+            if (++timeout_ > RECEIVE_TIMEOUT_LOOPS) {
                 state_ = DISCONNECT;
             }
             break;
         }
         case DISCONNECT:
-        {
-            auto p = Promise<bool>::fromDataPtr(handler_data_);
-            if (timeout > RECEIVE_TIMEOUT_LOOPS) {
-                p.setError(Error::TIMEOUT);
+            complete((timeout_ > RECEIVE_TIMEOUT_LOOPS) ? Error::TIMEOUT : Error::NONE);
+            state_ = CLEANUP;
+            break;
+        case RECONNECTING:
+            // Connect again once the sensor is disconnected
+            if (peer_.connected()) {
+                peer_.disconnect();
             } else {
-                p.setResult(true);
+                timeout_ = 0;
+                state_ = CONNECTING;
             }
-            state_ = CLEANUP;
             break;
-        }
         case CLEANUP:
             state_ = IDLE;
+            response_.reset();
             peer_.disconnect();
             break;
         case IDLE:
             break;
         }
-        timer = System.uptime();
+        timer_ = System.uptime();
     }
 }
 
 particle::Future<bool> LairdBt510::configure(LairdBt510Config config) {
+    AppliedConfig* last = findApplied(getAddress());
+    if (last) {
+        config = config.diff(last->config);
+        if (config.isEmpty()) {
+            Log.trace("Configuration unchanged for: %s", getAddress().toString().c_str());
+            Promise<bool> p;
+            p.setResult(true);
+            return p.future();
+        }
+    }
+    return start(config, CONFIGURE);
+}
+
+void LairdBt510::forgetConfig(const BleAddress& address) {
+    for (int i = 0; i < applied.size(); i++) {
+        if (applied.at(i).address == address) {
+            applied.removeAt(i);
+            return;
+        }
+    }
+}
+
+uint16_t LairdBt510::getAppliedConfigId() const {
+    for (const auto& a : applied) {
+        if (a.address == getAddress()) {
+            return a.configId;
+        }
+    }
+    return 0;
+}
+
+LairdBt510::AppliedConfig* LairdBt510::findApplied(const BleAddress& address) {
+    for (auto& a : applied) {
+        if (a.address == address) {
+            return &a;
+        }
+    }
+    return nullptr;
+}
+
+void LairdBt510::rememberApplied() {
+    AppliedConfig* last = findApplied(getAddress());
+    if (last) {
+        last->config.merge(config_);
+        last->configId = configId_;
+    } else {
+        AppliedConfig a;
+        a.address = getAddress();
+        a.config = config_;
+        a.configId = configId_;
+        applied.append(a);
+    }
+}
+
+particle::Future<bool> LairdBt510::downloadLog(const char* passkey) {
+    LairdBt510Config config;
+    config.currentPasskey(passkey);
+    return start(config, DOWNLOAD_LOG);
+}
+
+particle::Future<bool> LairdBt510::start(const LairdBt510Config& config, uint8_t operation) {
     Promise<bool> p;
     if (state_ == IDLE) {
         BLE.onPairingEvent(onPairingEvent);
         BLE.setPairingIoCaps(BlePairingIoCaps::KEYBOARD_ONLY);
         BLE.onDisconnected(onDisconnected);
+        BLE.setDesiredAttMtu(LAIRDBT510_DESIRED_ATT_MTU);
+        BLE.onAttMtuExchanged(onAttMtuExchanged, nullptr);
         handler_data_ = p.dataPtr();
         config_ = config;
+        operation_ = (Operation)operation;
+        log_step_ = LOG_PREPARE;
+        log_remaining_ = log_unacked_ = 0;
+        full_discovery_ = false;
+        timeout_ = 0;
         state_ = CONNECTING;
     }
     else {
@@ -333,6 +785,172 @@ particle::Future<bool> LairdBt510::configure(LairdBt510Config config) {
     return p.future();
 }
 
+LairdBt510Scheduler& LairdBt510Scheduler::instance() {
+    if (!_instance) {
+        _instance = new LairdBt510Scheduler();
+    }
+    return *_instance;
+}
+
+LairdBt510Scheduler& LairdBt510Scheduler::maxConnections(uint8_t count) {
+    max_connections_ = std::max(count, (uint8_t)1);
+    return *this;
+}
+
+LairdBt510Scheduler& LairdBt510Scheduler::maxAttempts(uint8_t count) {
+    max_attempts_ = std::max(count, (uint8_t)1);
+    return *this;
+}
+
+LairdBt510Scheduler& LairdBt510Scheduler::retryBackoff(system_tick_t ms) {
+    backoff_ = ms;
+    return *this;
+}
+
+LairdBt510Scheduler& LairdBt510Scheduler::onCompleted(CompletedCallback callback) {
+    completed_ = callback;
+    return *this;
+}
+
+LairdBt510Scheduler& LairdBt510Scheduler::configureFunction(ConfigureFunction function) {
+    configure_ = function ? function : configureScanned;
+    return *this;
+}
+
+bool LairdBt510Scheduler::add(const BleAddress& address, const LairdBt510Config& config) {
+    for (auto& job : jobs_) {
+        if (job.address == address) {
+            if (job.state == JobState::ACTIVE) {
+                return false;
+            }
+            job.config = config;
+            job.attempts = 0;
+            job.not_before = millis();
+            job.state = JobState::QUEUED;
+            return true;
+        }
+    }
+    Job job;
+    job.address = address;
+    job.config = config;
+    job.not_before = millis();
+    job.attempts = 0;
+    job.state = JobState::QUEUED;
+    return jobs_.append(job);
+}
+
+bool LairdBt510Scheduler::cancel(const BleAddress& address) {
+    for (int i = 0; i < jobs_.size(); i++) {
+        if (jobs_.at(i).address == address) {
+            if (jobs_.at(i).state == JobState::ACTIVE) {
+                return false;
+            }
+            jobs_.removeAt(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+void LairdBt510Scheduler::clearFinished() {
+    for (int i = 0; i < jobs_.size(); i++) {
+        if (jobs_.at(i).state == JobState::SUCCEEDED || jobs_.at(i).state == JobState::FAILED) {
+            jobs_.removeAt(i);
+            i--;
+        }
+    }
+}
+
+LairdBt510Scheduler::Progress LairdBt510Scheduler::progress() const {
+    Progress p = {};
+    for (const auto& job : jobs_) {
+        switch (job.state)
+        {
+        case JobState::QUEUED:
+            p.pending++;
+            break;
+        case JobState::ACTIVE:
+            p.active++;
+            break;
+        case JobState::SUCCEEDED:
+            p.succeeded++;
+            break;
+        case JobState::FAILED:
+            p.failed++;
+            break;
+        }
+    }
+    return p;
+}
+
+bool LairdBt510Scheduler::isDone() const {
+    for (const auto& job : jobs_) {
+        if (job.state == JobState::QUEUED || job.state == JobState::ACTIVE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void LairdBt510Scheduler::finish(Job& job, bool success) {
+    job.state = success ? JobState::SUCCEEDED : JobState::FAILED;
+    Progress p = progress();
+    Log.trace("BT510 %s %s, %u done, %u failed, %u left", job.address.toString().c_str(), success ? "configured" : "failed",
+            p.succeeded, p.failed, p.pending + p.active);
+}
+
+void LairdBt510Scheduler::loop() {
+    system_tick_t now = millis();
+    // The callbacks run after both passes, they may add, cancel or clear jobs
+    Vector<Job> finished;
+    // Collect the results first, so that the freed connections can be reused right away
+    for (auto& job : jobs_) {
+        if (job.state != JobState::ACTIVE || !job.result.isDone()) {
+            continue;
+        }
+        active_--;
+        if (job.result.isSucceeded()) {
+            finish(job, true);
+            finished.append(job);
+        } else if (job.attempts >= max_attempts_ || job.result.error().type() == Error::INVALID_ARGUMENT) {
+            // A wrong passkey will not get better by retrying
+            finish(job, false);
+            finished.append(job);
+        } else {
+            job.not_before = now + (backoff_ << std::min(job.attempts - 1, MAX_BACKOFF_SHIFT));
+            job.state = JobState::QUEUED;
+            Log.trace("BT510 %s attempt %u failed, retrying", job.address.toString().c_str(), job.attempts);
+        }
+    }
+    for (auto& job : jobs_) {
+        if (active_ >= max_connections_) {
+            break;
+        }
+        if (job.state != JobState::QUEUED || (int32_t)(now - job.not_before) < 0) {
+            continue;
+        }
+        job.attempts++;
+        job.result = configure_(job.address, job.config);
+        job.state = JobState::ACTIVE;
+        active_++;
+    }
+    if (completed_) {
+        for (const auto& job : finished) {
+            completed_(job.address, job.state == JobState::SUCCEEDED, *this);
+        }
+    }
+}
+
+particle::Future<bool> LairdBt510Scheduler::configureScanned(const BleAddress& address, const LairdBt510Config& config) {
+    LairdBt510* dev = LairdBt510::find(address);
+    if (dev) {
+        return dev->configure(config);
+    }
+    Promise<bool> p;
+    p.setError(Error::NOT_FOUND);
+    return p.future();
+}
+
 LairdBt510Config& LairdBt510Config::currentPasskey(const char* passkey) {
     if (strlen(passkey) == 6) {
         for(size_t i = 0; i < 6; ++i) {
@@ -405,7 +1023,7 @@ LairdBt510Config& LairdBt510Config::useCodedPhy(bool coded) {
     return *this;
 }
 
-void LairdBt510Config::createJson(JSONVectorWriter& writer, uint16_t& configId) const {
+void LairdBt510Config::createJson(JSONWriter& writer, uint16_t& configId) const {
     writer.beginObject();
     writer.name("jsonrpc").value("2.0");
     writer.name("method").value("set");
@@ -423,7 +1041,57 @@ void LairdBt510Config::createJson(JSONVectorWriter& writer, uint16_t& configId)
     writer.endObject();
     writer.name("id").value(++configId);
     writer.endObject();
-    writer.vector().append((char)0);
+}
+
+LairdBt510Config LairdBt510Config::diff(const LairdBt510Config& applied) const {
+    LairdBt510Config d;
+    memcpy(d.passkey_, passkey_, sizeof(passkey_));
+    if (!name_.isEmpty() && (name_.size() != applied.name_.size() || memcmp(name_.data(), applied.name_.data(), name_.size()))) {
+        d.name_ = name_;
+    }
+    if (tempSenseInterval_ <= 86400 && tempSenseInterval_ != applied.tempSenseInterval_) {
+        d.tempSenseInterval_ = tempSenseInterval_;
+    }
+    if (battSenseInterval_ <= 86400 && battSenseInterval_ != applied.battSenseInterval_) {
+        d.battSenseInterval_ = battSenseInterval_;
+    }
+    uint8_t changed = configFlags_ & ~applied.configFlags_;
+    if ((configFlags_ & ConfigHighTempAlarm1) && highTempAlarm1_ != applied.highTempAlarm1_) changed |= ConfigHighTempAlarm1;
+    if ((configFlags_ & ConfigHighTempAlarm2) && highTempAlarm2_ != applied.highTempAlarm2_) changed |= ConfigHighTempAlarm2;
+    if ((configFlags_ & ConfigLowTempAlarm1) && lowTempAlarm1_ != applied.lowTempAlarm1_) changed |= ConfigLowTempAlarm1;
+    if ((configFlags_ & ConfigLowTempAlarm2) && lowTempAlarm2_ != applied.lowTempAlarm2_) changed |= ConfigLowTempAlarm2;
+    if ((configFlags_ & ConfigDeltaTempAlarm) && deltaTempAlarm_ != applied.deltaTempAlarm_) changed |= ConfigDeltaTempAlarm;
+    if ((configFlags_ & ConfigNewPasskey) && memcmp(newPasskey_, applied.newPasskey_, sizeof(newPasskey_))) changed |= ConfigNewPasskey;
+    d.configFlags_ = changed;
+    d.highTempAlarm1_ = highTempAlarm1_;
+    d.highTempAlarm2_ = highTempAlarm2_;
+    d.lowTempAlarm1_ = lowTempAlarm1_;
+    d.lowTempAlarm2_ = lowTempAlarm2_;
+    d.deltaTempAlarm_ = deltaTempAlarm_;
+    memcpy(d.newPasskey_, newPasskey_, sizeof(newPasskey_));
+    if (coded_ < 2 && coded_ != applied.coded_) {
+        d.coded_ = coded_;
+    }
+    return d;
+}
+
+bool LairdBt510Config::isEmpty() const {
+    return name_.isEmpty() && tempSenseInterval_ > 86400 && battSenseInterval_ > 86400 &&
+            configFlags_ == Bt510ConfigFields::NONE && coded_ >= 2;
+}
+
+void LairdBt510Config::merge(const LairdBt510Config& other) {
+    if (!other.name_.isEmpty()) name_ = other.name_;
+    if (other.tempSenseInterval_ <= 86400) tempSenseInterval_ = other.tempSenseInterval_;
+    if (other.battSenseInterval_ <= 86400) battSenseInterval_ = other.battSenseInterval_;
+    if (other.configFlags_ & ConfigHighTempAlarm1) highTempAlarm1_ = other.highTempAlarm1_;
+    if (other.configFlags_ & ConfigHighTempAlarm2) highTempAlarm2_ = other.highTempAlarm2_;
+    if (other.configFlags_ & ConfigLowTempAlarm1) lowTempAlarm1_ = other.lowTempAlarm1_;
+    if (other.configFlags_ & ConfigLowTempAlarm2) lowTempAlarm2_ = other.lowTempAlarm2_;
+    if (other.configFlags_ & ConfigDeltaTempAlarm) deltaTempAlarm_ = other.deltaTempAlarm_;
+    if (other.configFlags_ & ConfigNewPasskey) memcpy(newPasskey_, other.newPasskey_, sizeof(newPasskey_));
+    configFlags_ |= other.configFlags_;
+    if (other.coded_ < 2) coded_ = other.coded_;
 }
 
 LairdBt510Config::LairdBt510Config():
@@ -21,7 +21,31 @@
 
 class LairdBt510;
 class LairdBt510Config;
-class JSONVectorWriter;
+class LairdBt510Scheduler;
+
+// ATT MTU asked for when connecting. Each GATT write carries up to the negotiated MTU
+// minus 3 bytes, and 20 bytes if no MTU was negotiated.
+#ifndef LAIRDBT510_DESIRED_ATT_MTU
+#define LAIRDBT510_DESIRED_ATT_MTU      247
+#endif
+#define LAIRDBT510_MIN_ATT_MTU          23
+#define LAIRDBT510_GATT_CHUNK_SIZE      (LAIRDBT510_DESIRED_ATT_MTU - 3)
+// Largest JSON-RPC reply that is kept. Longer replies are dropped.
+#ifndef LAIRDBT510_MAX_RESPONSE_LEN
+#define LAIRDBT510_MAX_RESPONSE_LEN     512
+#endif
+// Number of events kept from a log download, the oldest are dropped when full
+#ifndef LAIRDBT510_LOG_CAPACITY
+#define LAIRDBT510_LOG_CAPACITY         256
+#endif
+// Events asked for in each readLog request. 32 events fit in a 512 byte reply.
+#ifndef LAIRDBT510_LOG_READ_COUNT
+#define LAIRDBT510_LOG_READ_COUNT       32
+#endif
+// Events read before they are acknowledged, and deleted, on the sensor
+#ifndef LAIRDBT510_LOG_ACK_BATCH
+#define LAIRDBT510_LOG_ACK_BATCH        128
+#endif
 
 class LairdBt510Config {
 public:
@@ -96,8 +120,16 @@ public:
      * Use Coded PHY (Bluetooth 5.0 long range)
      */
     LairdBt510Config& useCodedPhy(bool coded);
-    void createJson(JSONVectorWriter& writer, uint16_t& configId) const;
+    void createJson(JSONWriter& writer, uint16_t& configId) const;
+    /**
+     * The settings of this configuration that are not already in the applied one.
+     * The passkey used for pairing is kept.
+     */
+    LairdBt510Config diff(const LairdBt510Config& applied) const;
+    // True when no setting is set
+    bool isEmpty() const;
 protected:
+    void merge(const LairdBt510Config& other);
     Vector<char> name_, location_;
     uint32_t tempSenseInterval_, battSenseInterval_;
     uint16_t advInterval_, connTimeout_;
@@ -117,6 +149,40 @@ protected:
     uint8_t passkey_[6], newPasskey_[6];
 };
 
+/**
+ * Reassembles a JSON-RPC reply that arrives split over several notifications.
+ * Only the nesting of the outer object is tracked, which is enough to know
+ * when the reply is complete without parsing it.
+ */
+class LairdBt510Response {
+public:
+    LairdBt510Response() :
+        depth_(0),
+        in_string_(false),
+        escape_(false),
+        complete_(false),
+        overflow_(false)
+        {};
+    ~LairdBt510Response() = default;
+
+    /**
+     * Add the contents of a notification. Anything after the end of the reply is ignored.
+     * @return true once the whole reply has been received
+     */
+    bool append(const uint8_t* data, size_t size);
+    void reset();
+    bool isComplete() const { return complete_; };
+    // The reply was longer than LAIRDBT510_MAX_RESPONSE_LEN, only its end was detected
+    bool overflowed() const { return overflow_; };
+    const char* data() const { return buf_.data(); };
+    size_t size() const { return buf_.isEmpty() ? 0 : buf_.size() - 1; };
+
+private:
+    Vector<char> buf_;
+    uint8_t depth_;
+    bool in_string_, escape_, complete_, overflow_;
+};
+
 enum class lairdbt510_event_type {
     TEMPERATURE         = 1,
     MAGNET_PROXIMITY    = 2,
@@ -148,24 +214,96 @@ enum class lairdbt510_flags {
     MAGNET_STATE        = 0x8000
 };
 
+// Fields reported as changed with UPDATED callbacks
+enum lairdbt510_field_t : uint32_t {
+    LAIRDBT510_FIELD_TEMPERATURE    = 0x01,
+    LAIRDBT510_FIELD_MAGNET         = 0x02,
+    LAIRDBT510_FIELD_RECORD         = 0x04,     // A new event record was advertised
+    LAIRDBT510_FIELD_BATTERY        = 0x08,
+    LAIRDBT510_FIELD_ALARMS         = 0x10,
+    LAIRDBT510_FIELD_NAME           = 0x20
+};
+
 typedef void (*LairdBt510EventCallback)(LairdBt510& beacon, lairdbt510_event_type evt);
 
+// One entry of the sensor event log, as stored by the sensor
+struct LairdBt510LogEvent {
+    uint32_t timestamp;     // Seconds since 1970, from the sensor clock
+    uint16_t data;          // Depends on the event, temperature in hundredths of degree, battery in mV...
+    uint8_t type;           // lairdbt510_event_type
+    uint8_t salt;
+};
+
+/**
+ * Ring of events downloaded from the sensor log, oldest first.
+ * Memory is only allocated when a download starts, and released by clear().
+ */
+class LairdBt510Log {
+public:
+    LairdBt510Log() :
+        head_(0),
+        count_(0),
+        dropped_(0)
+        {};
+    ~LairdBt510Log() = default;
+
+    size_t size() const { return count_; };
+    bool isEmpty() const { return count_ == 0; };
+    // Room left before the oldest events are overwritten
+    size_t available() const { return LAIRDBT510_LOG_CAPACITY - count_; };
+    // Number of events that were overwritten because the ring was full
+    uint32_t dropped() const { return dropped_; };
+    const LairdBt510LogEvent& at(size_t index) const;
+    bool takeFirst(LairdBt510LogEvent& event);
+    void clear();
+
+private:
+    friend class LairdBt510;
+    void push(const LairdBt510LogEvent& event);
+    Vector<LairdBt510LogEvent> events_;
+    uint16_t head_, count_;
+    uint32_t dropped_;
+};
+
 class LairdBt510 : public Beacon
 {
 public:
     LairdBt510() : 
         Beacon(SCAN_LAIRDBT510),
+        handler_data_(nullptr),
+        _temp(0),
+        _batt_voltage(0),
+        _alarm_flags(0),
+        _alarm_notified(0),
+        _magnet_state(false),
+        _record_valid(false),
         state_(IDLE),
         prev_state_(IDLE),
-        configId_(0)
+        operation_(CONFIGURE),
+        log_step_(LOG_PREPARE),
+        log_remaining_(0),
+        log_unacked_(0),
+        configId_(0),
+        timer_(0),
+        timeout_(0),
+        att_mtu_(LAIRDBT510_MIN_ATT_MTU),
+        full_discovery_(false)
         { };
     ~LairdBt510() = default;
 
-    void toJson(JSONWriter *writer) const override;
+    void fieldsToJson(JSONWriter *writer) const override;
 
-    // Register callbacks for events and alarms
+    // Register callbacks for events and alarms. The event callback is called once for each new
+    // record number. The alarm callback is called when an alarm is raised and when it clears,
+    // isAlarmActive() tells which.
     static void setEventCallback(LairdBt510EventCallback callback) { LairdBt510::_eventCallback = callback; };
     static void setAlarmCallback(LairdBt510EventCallback callback) { LairdBt510::_alarmCallback = callback; };
+    /**
+     * Call the alarm callback again for alarms that stay raised. 0, the default, only reports changes.
+     */
+    static void setAlarmRenotify(uint32_t seconds) { LairdBt510::_alarmRenotify = seconds * 1000; };
+    bool isAlarmActive(lairdbt510_event_type alarm) const;
+    uint16_t getAlarmFlags() const { return _alarm_flags; };
 
     // Get the sensor data
     int16_t getTemperature() const { return _temp; };
@@ -174,32 +312,189 @@ public:
     uint16_t getBattVoltage() const { return _batt_voltage; };
     const char* getName() const { return _name.data(); };
 
-    // Configure the device
+    /**
+     * Configure the device. Only the settings that differ from the last configuration
+     * applied to this sensor are sent, and no connection is made if nothing changed.
+     * The future fails with Error::ABORTED if the sensor is published or cleared by the
+     * scanner before the configuration is done.
+     */
     particle::Future<bool> configure(LairdBt510Config config);
+    /**
+     * Forget what was applied to a sensor, so that the next configure() sends
+     * every setting. Use it after a sensor was reset or configured elsewhere.
+     */
+    static void forgetConfig(const BleAddress& address);
+    // Id of the last configuration request the sensor accepted, or 0
+    uint16_t getAppliedConfigId() const;
+
+    /**
+     * Download the events stored on the sensor into getLog(). Events are deleted
+     * from the sensor once they have been received.
+     *
+     * The download stops when getLog() has no room for another read, so that no event
+     * is deleted from the sensor before it can be kept. The result is then false: take
+     * the events from getLog() and call downloadLog() again for the rest.
+     *
+     * @param passkey the pairing passkey of the sensor
+     * @return true once the whole log has been downloaded, false if some is left on the sensor
+     */
+    particle::Future<bool> downloadLog(const char* passkey = "123456");
+    LairdBt510Log& getLog() { return log_; };
 
 private:
     void* handler_data_;
     friend class Beaconscanner;
+    friend class LairdBt510Scheduler;
     void loop();
+    void complete(Error::Type error);
+    void abort();
+    void handleResponse();
+    void handleLogResult(const JSONValue& result);
+    size_t decodeLog(const char* data, size_t size);
+    bool logFull() const { return log_.available() < LAIRDBT510_LOG_READ_COUNT; };
+    void sendRequest();
+    bool discover();
+    particle::Future<bool> start(const LairdBt510Config& config, uint8_t operation);
+    static LairdBt510* find(const BleAddress& address);
     static bool isBeacon(const BleScanResult *scanResult);
     void populateData(const BleScanResult *scanResult) override;
     static Vector<LairdBt510> beacons;
-    static void addOrUpdate(const BleScanResult *scanResult);
+    static LairdBt510& addOrUpdate(const BleScanResult *scanResult);
+    struct AppliedConfig {
+        BleAddress address;
+        LairdBt510Config config;
+        uint16_t configId;
+    };
+    // Kept for sensors that go out of range, so they are not reconfigured when they come back
+    static Vector<AppliedConfig> applied;
+    static AppliedConfig* findApplied(const BleAddress& address);
+    void rememberApplied();
     int16_t _temp;
-    uint16_t _record_number, _batt_voltage;
-    bool _magnet_event, _magnet_state, _movement;
+    uint16_t _record_number, _batt_voltage, _alarm_flags;
+    system_tick_t _alarm_notified;
+    bool _magnet_event, _magnet_state, _movement, _record_valid;
     static LairdBt510EventCallback _eventCallback, _alarmCallback;
+    static system_tick_t _alarmRenotify;
     Vector<char> _name;
     static void onDataReceived(const uint8_t* data, size_t size, const BlePeerDevice& peer, void* context);
     static void onPairingEvent(const BlePairingEvent& event);
     static void onDisconnected(const BlePeerDevice& peer);
+    static void onAttMtuExchanged(const BlePeerDevice& peer, size_t mtu, void* context);
     enum State: uint8_t {
-        IDLE, CONNECTING, PAIRING, SENDING, DISCONNECT, RECEIVING, CLEANUP
+        IDLE, CONNECTING, PAIRING, SENDING, DISCONNECT, RECEIVING, CLEANUP, REQUESTING,
+        RECONNECTING    // A request was cut short, the sensor must start over on a new connection
     } state_, prev_state_;
+    enum Operation: uint8_t {
+        CONFIGURE, DOWNLOAD_LOG
+    } operation_;
+    enum LogStep: uint8_t {
+        LOG_PREPARE, LOG_READ, LOG_ACK
+    } log_step_;
+    uint16_t log_remaining_, log_unacked_;
+    LairdBt510Log log_;
     BlePeerDevice peer_;
     BleCharacteristic tx, rx;
+    LairdBt510Response response_;
     LairdBt510Config config_;
     uint16_t configId_;
+    unsigned int timer_;
+    uint8_t timeout_;
+    uint16_t att_mtu_;
+    bool full_discovery_;
+};
+
+/**
+ * Configures a fleet of BT510 sensors. Devices are queued with add() and
+ * configured a few at a time, so that the number of simultaneous BLE
+ * connections stays bounded. Failed attempts are retried with an exponential
+ * backoff. The scheduler is driven from Scanner.loop(), and it needs the
+ * sensors to be seen by the scanner before they can be configured.
+ */
+class LairdBt510Scheduler {
+public:
+    /**
+     * Starts the configuration of one device. The default implementation
+     * looks the device up in the scanned BT510 sensors and calls configure()
+     * on it. It can be replaced to drive the scheduler against a simulated peer.
+     */
+    typedef particle::Future<bool> (*ConfigureFunction)(const BleAddress& address, const LairdBt510Config& config);
+    typedef void (*CompletedCallback)(const BleAddress& address, bool success, const LairdBt510Scheduler& scheduler);
+
+    struct Progress {
+        uint16_t pending;       // Queued, or waiting for a retry
+        uint16_t active;
+        uint16_t succeeded;
+        uint16_t failed;
+    };
+
+    static LairdBt510Scheduler& instance();
+
+    /**
+     * Maximum number of devices being configured at the same time. Default is 2.
+     */
+    LairdBt510Scheduler& maxConnections(uint8_t count);
+    /**
+     * Number of times a device is tried before it is marked as failed. Default is 5.
+     */
+    LairdBt510Scheduler& maxAttempts(uint8_t count);
+    /**
+     * Delay before the first retry. It doubles on each following attempt.
+     * Default is 5000 ms.
+     */
+    LairdBt510Scheduler& retryBackoff(system_tick_t ms);
+    /**
+     * Called each time a device succeeds, or fails its last attempt. It runs from loop() once the
+     * jobs have been updated, and may call add(), cancel() or clearFinished().
+     */
+    LairdBt510Scheduler& onCompleted(CompletedCallback callback);
+    LairdBt510Scheduler& configureFunction(ConfigureFunction function);
+
+    /**
+     * Queue a device for configuration. If the device is already queued, its
+     * configuration is replaced and its attempts are reset.
+     * @return false if the device is currently being configured
+     */
+    bool add(const BleAddress& address, const LairdBt510Config& config);
+    /**
+     * Remove a device that is not currently being configured.
+     */
+    bool cancel(const BleAddress& address);
+    /**
+     * Forget the devices that have succeeded or failed.
+     */
+    void clearFinished();
+    Progress progress() const;
+    bool isDone() const;
+    void loop();
+
+private:
+    enum class JobState: uint8_t {
+        QUEUED, ACTIVE, SUCCEEDED, FAILED
+    };
+    struct Job {
+        BleAddress address;
+        LairdBt510Config config;
+        particle::Future<bool> result;
+        system_tick_t not_before;
+        uint8_t attempts;
+        JobState state;
+    };
+    friend class Beaconscanner;
+    static LairdBt510Scheduler* _instance;
+    static particle::Future<bool> configureScanned(const BleAddress& address, const LairdBt510Config& config);
+    void finish(Job& job, bool success);
+    Vector<Job> jobs_;
+    ConfigureFunction configure_;
+    CompletedCallback completed_;
+    system_tick_t backoff_;
+    uint8_t max_connections_, max_attempts_, active_;
+    LairdBt510Scheduler() :
+        configure_(configureScanned),
+        completed_(nullptr),
+        backoff_(5000),
+        max_connections_(2),
+        max_attempts_(5),
+        active_(0) {};
 };
 
 #endif
\ No newline at end of file
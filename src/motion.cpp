@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2024 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "motion.h"
+
+// Moving averages as shifts: orientation follows 1/8 of each sample, activity 1/4
+#define MOTION_BASE_SHIFT       3
+#define MOTION_ACTIVITY_SHIFT   2
+
+uint16_t MotionDetector::moved_mg_ = 150;
+uint16_t MotionDetector::still_mg_ = 50;
+uint32_t MotionDetector::still_ms_ = 30000;
+
+void MotionDetector::setThresholds(uint16_t moved_mg, uint16_t still_mg, uint16_t still_seconds)
+{
+    if (still_mg > moved_mg) return;
+    moved_mg_ = moved_mg;
+    still_mg_ = still_mg;
+    still_ms_ = still_seconds * 1000UL;
+}
+
+void MotionDetector::update(int32_t x, int32_t y, int32_t z)
+{
+    int32_t sample[3] = {x, y, z};
+    if (!(flags_ & HAS_BASE)) {
+        for (uint8_t i = 0; i < 3; i++) {
+            base_[i] = (int16_t)sample[i];
+        }
+        flags_ |= HAS_BASE | INITIALIZED;
+        last_motion_ = millis();
+        return;
+    }
+    // Distance from the resting orientation, as the sum of the axes to avoid a square root
+    int32_t deviation = 0;
+    for (uint8_t i = 0; i < 3; i++) {
+        int32_t diff = sample[i] - base_[i];
+        deviation += diff < 0 ? -diff : diff;
+        base_[i] += diff / (1 << MOTION_BASE_SHIFT);
+    }
+    if (deviation > 0xFFFF) deviation = 0xFFFF;
+    activity_ += (deviation - (int32_t)activity_) / (1 << MOTION_ACTIVITY_SHIFT);
+
+    if (activity_ >= moved_mg_) {
+        motionDetected();
+    } else if (activity_ > still_mg_) {
+        // Between the thresholds, keep the current state but don't start the still timer
+        last_motion_ = millis();
+    }
+}
+
+void MotionDetector::updateCounter(uint16_t counter)
+{
+    if ((flags_ & HAS_COUNTER) && counter != last_counter_) {
+        motionDetected();
+    }
+    last_counter_ = counter;
+    flags_ |= HAS_COUNTER | INITIALIZED;
+}
+
+void MotionDetector::updateLastEvent(uint16_t seconds_since)
+{
+    if ((flags_ & HAS_COUNTER) && seconds_since < last_counter_) {
+        motionDetected();
+    }
+    last_counter_ = seconds_since;
+    flags_ |= HAS_COUNTER | INITIALIZED;
+}
+
+void MotionDetector::motionDetected()
+{
+    last_motion_ = millis();
+    if (!(flags_ & MOVING)) {
+        flags_ |= MOVING | PENDING;
+    }
+}
+
+bool MotionDetector::takeTransition()
+{
+    if ((flags_ & MOVING) && millis() - last_motion_ >= still_ms_) {
+        flags_ = (flags_ & ~MOVING) | PENDING;
+    }
+    if (flags_ & PENDING) {
+        flags_ &= ~PENDING;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2024 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MOTION_H
+#define MOTION_H
+
+#include "Particle.h"
+
+/**
+ * Per beacon motion detection from accelerometer samples and movement counters.
+ *
+ * Samples are in milli-g. A slow moving average tracks the orientation (gravity) of the
+ * tag, and a faster one tracks how far the samples are from it. The tag is MOVED as soon
+ * as that deviation goes above the moved threshold, or a movement counter changes, and is
+ * STILL once the deviation has stayed under the still threshold for the still time.
+ * All the math is integer.
+ */
+class MotionDetector {
+public:
+    MotionDetector() :
+        base_{},
+        activity_(0),
+        last_counter_(0),
+        last_motion_(0),
+        flags_(0) {};
+    ~MotionDetector() = default;
+
+    /**
+     * Set the thresholds used by all beacons.
+     *
+     * @param moved_mg      deviation from the resting orientation above which the tag is moving. Default 150 mg
+     * @param still_mg      deviation below which the tag is considered at rest. Default 50 mg
+     * @param still_seconds how long the tag must be at rest before it is STILL. Default 30 seconds
+     */
+    static void setThresholds(uint16_t moved_mg, uint16_t still_mg, uint16_t still_seconds);
+
+    // Feed a new accelerometer sample, in milli-g
+    void update(int32_t x, int32_t y, int32_t z);
+    // Feed a movement counter that is incremented by the tag on each movement
+    void updateCounter(uint16_t counter);
+    // Feed a "seconds since the last movement" value, a lower value than before means a new movement
+    void updateLastEvent(uint16_t seconds_since);
+
+    bool hasData() const { return flags_ & INITIALIZED; }
+    bool isMoving() const { return flags_ & MOVING; }
+
+    /**
+     * Returns true once per change between MOVED and STILL. Also checks whether a moving
+     * tag has been at rest long enough, so it should be called periodically. The scanner
+     * calls it for each advertisement, and for each tag at the end of every scan period.
+     */
+    bool takeTransition();
+
+private:
+    enum Flags: uint8_t {
+        INITIALIZED     = 0x01,     // Any data, accelerometer or counter
+        HAS_COUNTER     = 0x02,
+        MOVING          = 0x04,
+        PENDING         = 0x08,
+        HAS_BASE        = 0x10      // The resting orientation has been set by a first sample
+    };
+    int16_t base_[3];
+    uint16_t activity_;
+    uint16_t last_counter_;
+    uint32_t last_motion_;
+    uint8_t flags_;
+
+    static uint16_t moved_mg_, still_mg_;
+    static uint32_t still_ms_;
+
+    void motionDetected();
+};
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2024 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "proximity.h"
+
+int8_t ProximityFilter::immediate_dbm_ = -55;
+int8_t ProximityFilter::near_dbm_ = -75;
+uint8_t ProximityFilter::hysteresis_db_ = 4;
+uint8_t ProximityFilter::shift_ = 2;
+uint32_t ProximityFilter::dwell_ms_ = 5000;
+
+void ProximityFilter::setZones(int8_t immediate_dbm, int8_t near_dbm, uint8_t hysteresis_db, uint32_t dwell_ms)
+{
+    if (near_dbm >= immediate_dbm) return;
+    immediate_dbm_ = immediate_dbm;
+    near_dbm_ = near_dbm;
+    hysteresis_db_ = hysteresis_db;
+    dwell_ms_ = dwell_ms;
+}
+
+void ProximityFilter::setSmoothing(uint8_t shift)
+{
+    if (shift > 6) return;
+    shift_ = shift;
+}
+
+uint8_t ProximityFilter::zoneFor(int16_t rssi) const
+{
+    // Boundaries move away from the current zone, so the RSSI must clearly cross them
+    int16_t h = (zone_ == ZONE_UNKNOWN) ? 0 : hysteresis_db_ * 16;
+    int16_t immediate = immediate_dbm_ * 16 + ((zone_ == ZONE_IMMEDIATE) ? -h : h);
+    int16_t near = near_dbm_ * 16 + ((zone_ == ZONE_IMMEDIATE || zone_ == ZONE_NEAR) ? -h : h);
+    if (rssi >= immediate) return ZONE_IMMEDIATE;
+    if (rssi >= near) return ZONE_NEAR;
+    return ZONE_FAR;
+}
+
+void ProximityFilter::update(int8_t rssi)
+{
+    if (zone_ == ZONE_UNKNOWN) {
+        rssi_ = rssi * 16;
+        zone_ = candidate_ = zoneFor(rssi_);
+        return;
+    }
+    rssi_ += (rssi * 16 - rssi_) / (1 << shift_);
+    uint8_t zone = zoneFor(rssi_);
+    if (zone == zone_) {
+        candidate_ = zone_;
+    } else if (zone != candidate_) {
+        candidate_ = zone;
+        candidate_since_ = millis();
+    }
+    if (candidate_ != zone_ && millis() - candidate_since_ >= dwell_ms_) {
+        zone_ = candidate_;
+        pending_ = true;
+    }
+}
+
+bool ProximityFilter::takeTransition()
+{
+    if (pending_) {
+        pending_ = false;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2024 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PROXIMITY_H
+#define PROXIMITY_H
+
+#include "Particle.h"
+
+// Proximity zones, from closest to farthest
+typedef enum {
+  ZONE_UNKNOWN      = 0,
+  ZONE_IMMEDIATE    = 1,
+  ZONE_NEAR         = 2,
+  ZONE_FAR          = 3
+} proximity_zone_t;
+
+/**
+ * Per beacon RSSI filter and proximity zone.
+ *
+ * The RSSI is smoothed with an exponential moving average, kept in 1/16 dBm. The zone
+ * comes from the smoothed RSSI, with each boundary moved by the hysteresis away from
+ * the current zone, and a new zone is only taken once the RSSI has stayed in it for
+ * the dwell time. All the math is integer.
+ */
+class ProximityFilter {
+public:
+    ProximityFilter() :
+        rssi_(0),
+        candidate_since_(0),
+        zone_(ZONE_UNKNOWN),
+        candidate_(ZONE_UNKNOWN),
+        pending_(false) {};
+    ~ProximityFilter() = default;
+
+    /**
+     * Set the zones used by all beacons.
+     *
+     * @param immediate_dbm smoothed RSSI at or above which a beacon is immediate. Default -55 dBm
+     * @param near_dbm      smoothed RSSI at or above which a beacon is near, it is far below. Default -75 dBm
+     * @param hysteresis_db how far past a boundary the RSSI must go to change zone. Default 4 dB
+     * @param dwell_ms      how long the RSSI must stay in a new zone before the beacon changes zone. Default 5000 ms
+     */
+    static void setZones(int8_t immediate_dbm, int8_t near_dbm, uint8_t hysteresis_db, uint32_t dwell_ms);
+    /**
+     * Set how much each sample moves the average, as a power of 2: each sample counts for 1/2^shift.
+     * Default 2, for 1/4. 0 turns the filter off.
+     */
+    static void setSmoothing(uint8_t shift);
+
+    // Feed a new RSSI sample, in dBm
+    void update(int8_t rssi);
+
+    bool hasData() const { return zone_ != ZONE_UNKNOWN; }
+    int8_t getRssi() const { return (int8_t)((rssi_ + (rssi_ < 0 ? -8 : 8)) / 16); }
+    proximity_zone_t getZone() const { return (proximity_zone_t)zone_; }
+
+    // Returns true once per change of zone, not for the first zone
+    bool takeTransition();
+
+private:
+    int16_t rssi_;          // 1/16 dBm
+    uint32_t candidate_since_;
+    uint8_t zone_, candidate_;
+    bool pending_;
+
+    static int8_t immediate_dbm_, near_dbm_;
+    static uint8_t hysteresis_db_, shift_;
+    static uint32_t dwell_ms_;
+
+    uint8_t zoneFor(int16_t rssi) const;
+};
+
+#endif
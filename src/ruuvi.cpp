@@ -15,23 +15,46 @@
  */
 
 #include "ruuvi.h"
+#include <math.h>
 
 inline bool Ruuvi::isRuuvi(uint8_t lsb, uint8_t msb) { return (0x99 == lsb) && (0x04 == msb); } // Ruuvi UUID is 0x9904
 
 Vector<Ruuvi> Ruuvi::beacons;
+uint32_t Ruuvi::unparsed = 0;
 #define MAX_MANUFACTURER_DATA_LEN 37
+// Format E1 is sent in an extended advertisement, and is longer than a legacy one
+#define RUUVI_MAX_DATA_LEN        48
+
+// Length of each format, including the manufacturer ID
+#define RUUVI_RAWV1_LEN           16
+#define RUUVI_RAWV2_LEN           26
+#define RUUVI_AIR_LEN             22
+#define RUUVI_AIR_EXTENDED_LEN    42
+
+// Values that the tag sends when a measurement is not available
+#define RUUVI_INVALID_I16         ((int16_t)0x8000)
+#define RUUVI_INVALID_U16         0xFFFF
+#define RUUVI_INVALID_U24         0xFFFFFF
+#define RUUVI_INVALID_INDEX       0x1FF
+#define RUUVI_INVALID_TX_POWER    127
+
+static inline uint16_t ruuviU16(const uint8_t *buf) { return (uint16_t)((buf[0] << 8) | buf[1]); }
+static inline uint32_t ruuviU24(const uint8_t *buf) { return ((uint32_t)buf[0] << 16) | ((uint32_t)buf[1] << 8) | buf[2]; }
 
 void Ruuvi::populateData(const BleScanResult *scanResult)
 {
     Beacon::populateData(scanResult);
     address = ADDRESS(scanResult);
 
-    uint8_t buf[MAX_MANUFACTURER_DATA_LEN];
-    uint8_t count = ADVERTISING_DATA(scanResult).get(BleAdvertisingDataType::MANUFACTURER_SPECIFIC_DATA, buf, MAX_MANUFACTURER_DATA_LEN);
+    uint8_t buf[RUUVI_MAX_DATA_LEN];
+    uint8_t count = ADVERTISING_DATA(scanResult).get(BleAdvertisingDataType::MANUFACTURER_SPECIFIC_DATA, buf, RUUVI_MAX_DATA_LEN);
 
+    changed_fields = 0;
+    // Counted instead of logged, tags with other data formats would flood the log
     if (!parseRuuviAdvertisement(buf, count))
     {
-        Log.error("Ruuvi: advertisement parsing failed");
+        unparsed++;
+        Log.trace("Ruuvi: advertisement parsing failed");
     }
 }
 
@@ -55,16 +78,78 @@ bool Ruuvi::isBeacon(const BleScanResult *scanResult)
     return false;
 }
 
-void Ruuvi::toJson(JSONWriter *writer) const
+String Ruuvi::getMac() const
+{
+    return String::format("%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+float Ruuvi::getLuminosity() const
 {
-    writer->name(address.toString()).beginObject();
-    writer->name("temperature").value(getTemperature());
-    writer->endObject();
+    if (format == RUUVI_FORMAT_AIR_EXTENDED)
+    {
+        return data.air.luminosity / 100.0f;
+    }
+    if (format == RUUVI_FORMAT_AIR)
+    {
+        // Logarithmic code between 0 and 254 for 0 to 65535 lux
+        return expf(data.air.luminosity * logf(65536.0f) / 254.0f) - 1.0f;
+    }
+    return 0.0f;
+}
+
+void Ruuvi::fieldsToJson(JSONWriter *writer) const
+{
+    if (format == 0)
+    {
+        writer->name("rssi").value(getRssi());
+        return;
+    }
+    if (temperature != RUUVI_INVALID_I16)
+        writer->name("temperature").value(getTemperature());
+    if (humidity != RUUVI_INVALID_U16)
+        writer->name("humidity").value(getHumidity());
+    if (pressure != RUUVI_INVALID_U16)
+        writer->name("pressure").value(getPressure());
+    if (hasAirQuality())
+    {
+        static const char* const pm_names[] = { "pm1_0", "pm2_5", "pm4_0", "pm10_0" };
+        for (uint8_t i = 0; i < 4; i++)
+        {
+            if (data.air.pm[i] != RUUVI_INVALID_U16)
+                writer->name(pm_names[i]).value(data.air.pm[i] / 10.0f);
+        }
+        if (data.air.co2 != RUUVI_INVALID_U16)
+            writer->name("co2").value(data.air.co2);
+        if (data.air.voc != RUUVI_INVALID_INDEX)
+            writer->name("voc").value(data.air.voc);
+        if (data.air.nox != RUUVI_INVALID_INDEX)
+            writer->name("nox").value(data.air.nox);
+        if ((format == RUUVI_FORMAT_AIR && data.air.luminosity != 0xFF) || (format == RUUVI_FORMAT_AIR_EXTENDED && data.air.luminosity != RUUVI_INVALID_U24))
+            writer->name("luminosity").value(getLuminosity());
+    }
+    else
+    {
+        if (data.tag.acceleration[0] != RUUVI_INVALID_I16)
+        {
+            writer->name("accelX").value(getAccelerationX());
+            writer->name("accelY").value(getAccelerationY());
+            writer->name("accelZ").value(getAccelerationZ());
+        }
+        if (data.tag.batteryVoltage != RUUVI_INVALID_U16)
+            writer->name("battery").value(getBatteryVoltage());
+        if (format == RUUVI_FORMAT_RAWV2)
+            writer->name("movement").value(getMovementCounter());
+    }
+    if (motion.hasData())
+        writer->name("moving").value(motion.isMoving());
+    if (format != RUUVI_FORMAT_RAWV1)
+        writer->name("sequence").value((unsigned int)measurementSequenceNumber);
+    writer->name("rssi").value(getRssi());
 }
 
-void Ruuvi::addOrUpdate(const BleScanResult *scanResult)
+Ruuvi& Ruuvi::addOrUpdate(const BleScanResult *scanResult)
 {
-    uint8_t i;
+    int i;
     for (i = 0; i < beacons.size(); ++i)
     {
         if (beacons.at(i).getAddress() == ADDRESS(scanResult))
@@ -78,100 +163,175 @@ void Ruuvi::addOrUpdate(const BleScanResult *scanResult)
         new_beacon.populateData(scanResult);
         new_beacon.missed_scan = 0;
         beacons.append(new_beacon);
+        return beacons.last();
     }
     else
     {
         Ruuvi &beacon = beacons.at(i);
-        beacon.newly_scanned = false;
         beacon.populateData(scanResult);
         beacon.missed_scan = 0;
+        return beacon;
     }
 }
 
-// The Ruuvi data is in this format:
-// https://docs.ruuvi.com/communication/bluetooth-advertisements/data-format-5-rawv2
-// example: 99040516142d8fc4c7fc9401c8fffc8ed6f6cba8fc4c2295c482
+// The Ruuvi data formats are specified at:
+// https://docs.ruuvi.com/communication/bluetooth-advertisements
+// example (format 5): 99040516142d8fc4c7fc9401c8fffc8ed6f6cba8fc4c2295c482
+//
+// The values are kept as sent by the tag, and are only converted to units by the getters.
+// All formats are stored in the units of format 5.
 bool Ruuvi::parseRuuviAdvertisement(const uint8_t *buf, size_t len)
 {
-    if (len < 26)
+    // Manufacturer ID, least significant byte first: 0x0499 = Ruuvi Innovations Ltd
+    if (len < 3 || !isRuuvi(buf[0], buf[1]))
     {
-        Log.info("len is less than 26, too short for a Ruuvi sensor, skipping");
+        Log.trace("manufacturer ID is not 0x0499 - Ruuvi Innovations Ltd, skipping");
         return false;
     }
 
-    int index = 0;
-
-    // Manufacturer ID, least significant byte first: 0x0499 = Ruuvi Innovations Ltd
-    if (!isRuuvi(buf[0], buf[1]))
+    // Data format (8bit), the fields of each format are relative to it
+    const uint8_t *data = &buf[2];
+    const Ruuvi before = *this;
+    switch (data[0])
     {
-        Log.info("manufacturer ID is not 0x0499 - Ruuvi Innovations Ltd, skipping");
+    case RUUVI_FORMAT_RAWV1:
+        if (len < RUUVI_RAWV1_LEN)
+            return false;
+        parseRawV1(data);
+        break;
+    case RUUVI_FORMAT_RAWV2:
+        if (len < RUUVI_RAWV2_LEN)
+            return false;
+        parseRawV2(data);
+        break;
+    case RUUVI_FORMAT_AIR:
+        if (len < RUUVI_AIR_LEN)
+            return false;
+        parseAir(data);
+        break;
+    case RUUVI_FORMAT_AIR_EXTENDED:
+        if (len < RUUVI_AIR_EXTENDED_LEN)
+            return false;
+        parseAirExtended(data);
+        break;
+    default:
+        Log.trace("Ruuvi data format %02X not supported, skipping", data[0]);
         return false;
     }
+    format = data[0];
+    changed_fields = changedFrom(before);
+    return true;
+}
 
-    index += 2;
-
-    // Data format (8bit)
-    uint8_t format = buf[index];
-    index++;
-
-    if (format != 5)
+uint32_t Ruuvi::changedFrom(const Ruuvi& other) const
+{
+    uint32_t changed = RUUVI_FIELD_TEMPERATURE | RUUVI_FIELD_HUMIDITY | RUUVI_FIELD_PRESSURE | RUUVI_FIELD_SEQUENCE |
+        (hasAirQuality() ? RUUVI_FIELD_AIR : RUUVI_FIELD_ACCELERATION | RUUVI_FIELD_BATTERY | RUUVI_FIELD_MOVEMENT);
+    // Everything the new format reports is new when the format changes, except the movement
+    // counter, which only means something when it moves
+    if (format != other.format)
     {
-        Log.info("Data format is not 5, skipping");
-        return false;
+        return changed & ~RUUVI_FIELD_MOVEMENT;
     }
+    if (temperature == other.temperature) changed &= ~RUUVI_FIELD_TEMPERATURE;
+    if (humidity == other.humidity) changed &= ~RUUVI_FIELD_HUMIDITY;
+    if (pressure == other.pressure) changed &= ~RUUVI_FIELD_PRESSURE;
+    if (measurementSequenceNumber == other.measurementSequenceNumber) changed &= ~RUUVI_FIELD_SEQUENCE;
+    if (hasAirQuality())
+    {
+        if (!memcmp(&data.air, &other.data.air, sizeof(data.air))) changed &= ~RUUVI_FIELD_AIR;
+    }
+    else
+    {
+        if (!memcmp(data.tag.acceleration, other.data.tag.acceleration, sizeof(data.tag.acceleration))) changed &= ~RUUVI_FIELD_ACCELERATION;
+        if (data.tag.batteryVoltage == other.data.tag.batteryVoltage) changed &= ~RUUVI_FIELD_BATTERY;
+        if (data.tag.movementCounter == other.data.tag.movementCounter) changed &= ~RUUVI_FIELD_MOVEMENT;
+    }
+    return changed;
+}
 
-    // Temperature in 0.005 degrees Celsius
-    int16_t rawTemperature = (buf[index] << 8) | buf[index + 1];
-    temperature = rawTemperature * 0.005;
-    index += 2;
-
-    // Humidity (16bit unsigned) in 0.0025% (0-163.83% range, though realistically 0-100%)
-    uint16_t rawHumidity = (buf[index] << 8) | buf[index + 1];
-    humidity = rawHumidity * 0.0025;
-    index += 2;
-
-    // Pressure (16bit unsigned) in 1 Pa units, with offset of -50 000 Pa
-    uint16_t rawPressure = (buf[index] << 8) | buf[index + 1];
-    pressure = rawPressure + 50000;
-    index += 2;
-
-    // Acceleration-X (Most Significant Byte first)
-    int16_t rawAccelerationX = (buf[index] << 8) | buf[index + 1];
-    accelerationX = rawAccelerationX / 1000.0;
-    index += 2;
-
-    // Acceleration-Y (Most Significant Byte first)
-    int16_t rawAccelerationY = (buf[index] << 8) | buf[index + 1];
-    accelerationY = rawAccelerationY / 1000.0;
-    index += 2;
-
-    // Acceleration-Z (Most Significant Byte first)
-    int16_t rawAccelerationZ = (buf[index] << 8) | buf[index + 1];
-    accelerationZ = rawAccelerationZ / 1000.0;
-    index += 2;
-
-    // Power info (11+5bit unsigned)
-    uint16_t rawPowerInfo = (buf[index] << 8) | buf[index + 1];
-    batteryVoltage = ((rawPowerInfo >> 5) + 1600) / 1000.0;
-    txPower = (rawPowerInfo & 0x1F) * 2 - 40;
-    index += 2;
-
-    // Movement counter (8 bit unsigned)
-    movementCounter = buf[index];
-    index++;
+// Formats 3 and 6 don't include the whole MAC address, take it from the advertisement
+static void ruuviMacFromAddress(const BleAddress &address, uint8_t *mac)
+{
+    for (uint8_t i = 0; i < 6; i++)
+    {
+        mac[i] = address[5 - i];
+    }
+}
 
-    // Measurement sequence number (16 bit unsigned)
-    measurementSequenceNumber = (buf[index] << 8) | buf[index + 1];
-    index += 2;
+// https://docs.ruuvi.com/communication/bluetooth-advertisements/data-format-3-rawv1
+void Ruuvi::parseRawV1(const uint8_t *buf)
+{
+    // Humidity in 0.5%
+    humidity = buf[1] * 200;
+    // Temperature: sign bit and integer degrees, then hundredths
+    int16_t t = (buf[2] & 0x7F) * 200 + buf[3] * 2;
+    temperature = (buf[2] & 0x80) ? -t : t;
+    pressure = ruuviU16(&buf[4]);
+    data.tag.acceleration[0] = (int16_t)ruuviU16(&buf[6]);
+    data.tag.acceleration[1] = (int16_t)ruuviU16(&buf[8]);
+    data.tag.acceleration[2] = (int16_t)ruuviU16(&buf[10]);
+    data.tag.batteryVoltage = ruuviU16(&buf[12]);
+    motion.update(data.tag.acceleration[0], data.tag.acceleration[1], data.tag.acceleration[2]);
+    data.tag.txPower = RUUVI_INVALID_TX_POWER;
+    data.tag.movementCounter = 0;
+    measurementSequenceNumber = 0;
+    ruuviMacFromAddress(address, mac);
+}
 
-    // MAC address (48bit)
-    snprintf(mac, sizeof(mac), "%02x:%02x:%02x:%02x:%02x:%02x",
-             buf[index], buf[index + 1], buf[index + 2], buf[index + 3], buf[index + 4], buf[index + 5]);
-    index += 6;
+// https://docs.ruuvi.com/communication/bluetooth-advertisements/data-format-5-rawv2
+void Ruuvi::parseRawV2(const uint8_t *buf)
+{
+    temperature = (int16_t)ruuviU16(&buf[1]);
+    humidity = ruuviU16(&buf[3]);
+    pressure = ruuviU16(&buf[5]);
+    data.tag.acceleration[0] = (int16_t)ruuviU16(&buf[7]);
+    data.tag.acceleration[1] = (int16_t)ruuviU16(&buf[9]);
+    data.tag.acceleration[2] = (int16_t)ruuviU16(&buf[11]);
+    // Power info (11+5bit unsigned): battery voltage above 1.6V in mV, TX power above -40dBm in 2dBm steps
+    uint16_t power = ruuviU16(&buf[13]);
+    data.tag.batteryVoltage = ((power >> 5) == 0x7FF) ? RUUVI_INVALID_U16 : (power >> 5) + 1600;
+    data.tag.txPower = ((power & 0x1F) == 0x1F) ? RUUVI_INVALID_TX_POWER : (power & 0x1F) * 2 - 40;
+    data.tag.movementCounter = buf[15];
+    if (data.tag.acceleration[0] != RUUVI_INVALID_I16)
+        motion.update(data.tag.acceleration[0], data.tag.acceleration[1], data.tag.acceleration[2]);
+    if (data.tag.movementCounter != 0xFF)
+        motion.updateCounter(data.tag.movementCounter);
+    measurementSequenceNumber = ruuviU16(&buf[16]);
+    memcpy(mac, &buf[18], 6);
+}
 
-    // Log the parsed data
-    Log.trace("T: %.2f, Humidity: %.2f, Pressure: %.2f, Accel: [%.3f, %.3f, %.3f] g, Batt: %.3f, TXPower: %d dBm, Move: %d, Seq: %d, MAC: %s",
-              temperature, humidity, pressure, accelerationX, accelerationY, accelerationZ, batteryVoltage, txPower, movementCounter, measurementSequenceNumber, mac);
+// https://docs.ruuvi.com/communication/bluetooth-advertisements/data-format-6
+void Ruuvi::parseAir(const uint8_t *buf)
+{
+    temperature = (int16_t)ruuviU16(&buf[1]);
+    humidity = ruuviU16(&buf[3]);
+    pressure = ruuviU16(&buf[5]);
+    data.air.pm[0] = data.air.pm[2] = data.air.pm[3] = RUUVI_INVALID_U16;
+    data.air.pm[1] = ruuviU16(&buf[7]);
+    data.air.co2 = ruuviU16(&buf[9]);
+    // VOC and NOx indexes are 9 bits, the least significant bits are in the flags
+    data.air.voc = (buf[11] << 1) | ((buf[16] >> 7) & 0x01);
+    data.air.nox = (buf[12] << 1) | ((buf[16] >> 6) & 0x01);
+    data.air.luminosity = buf[13];
+    measurementSequenceNumber = buf[15];
+    ruuviMacFromAddress(address, mac);
+}
 
-    return true;
+// https://docs.ruuvi.com/communication/bluetooth-advertisements/data-format-e1
+void Ruuvi::parseAirExtended(const uint8_t *buf)
+{
+    temperature = (int16_t)ruuviU16(&buf[1]);
+    humidity = ruuviU16(&buf[3]);
+    pressure = ruuviU16(&buf[5]);
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        data.air.pm[i] = ruuviU16(&buf[7 + i * 2]);
+    }
+    data.air.co2 = ruuviU16(&buf[15]);
+    data.air.voc = (buf[17] << 1) | ((buf[28] >> 7) & 0x01);
+    data.air.nox = (buf[18] << 1) | ((buf[28] >> 6) & 0x01);
+    data.air.luminosity = ruuviU24(&buf[19]);
+    measurementSequenceNumber = ruuviU24(&buf[25]);
+    memcpy(mac, &buf[34], 6);
 }
@@ -23,47 +23,107 @@
 #define RUUVI_H
 
 #include "beacon.h"
+#include "motion.h"
+
+#define RUUVI_FORMAT_RAWV1          0x03
+#define RUUVI_FORMAT_RAWV2          0x05
+#define RUUVI_FORMAT_AIR            0x06
+#define RUUVI_FORMAT_AIR_EXTENDED   0xE1
+
+// Fields reported as changed with UPDATED callbacks
+enum ruuvi_field_t : uint32_t {
+    RUUVI_FIELD_TEMPERATURE     = 0x01,
+    RUUVI_FIELD_HUMIDITY        = 0x02,
+    RUUVI_FIELD_PRESSURE        = 0x04,
+    RUUVI_FIELD_ACCELERATION    = 0x08,
+    RUUVI_FIELD_BATTERY         = 0x10,
+    RUUVI_FIELD_MOVEMENT        = 0x20,     // Movement counter
+    RUUVI_FIELD_AIR             = 0x40,     // Any of the air quality values
+    RUUVI_FIELD_SEQUENCE        = 0x80      // New measurement
+};
 
 class Ruuvi : public Beacon
 {
 public:
-    Ruuvi() : Beacon(SCAN_RUUVI){};
+    Ruuvi() : Beacon(SCAN_RUUVI), format(0) {};
     ~Ruuvi() = default;
 
-    void toJson(JSONWriter *writer) const override;
-
-    float getTemperature() const { return temperature; }
-    float getHumidity() const { return humidity; }
-    float getPressure() const { return pressure; }
-    float getAccelerationX() const { return accelerationX; }
-    float getAccelerationY() const { return accelerationY; }
-    float getAccelerationZ() const { return accelerationZ; }
-    float getBatteryVoltage() const { return batteryVoltage; }
-    float getTxPower() const { return txPower; }
-    int getMovementCounter() const { return movementCounter; }
+    void fieldsToJson(JSONWriter *writer) const override;
+
+    // Data format of the last advertisement: 3, 5, 6 or 0xE1. 0 until a supported advertisement is parsed
+    uint8_t getFormat() const { return format; }
+    // Formats 6 and E1 are sent by Ruuvi Air, which reports air quality instead of motion and battery
+    bool hasAirQuality() const { return format == RUUVI_FORMAT_AIR || format == RUUVI_FORMAT_AIR_EXTENDED; }
+
+    float getTemperature() const { return temperature * 0.005f; }
+    float getHumidity() const { return humidity * 0.0025f; }
+    float getPressure() const { return pressure + 50000.0f; }
+    float getAccelerationX() const { return hasAirQuality() ? 0.0f : data.tag.acceleration[0] / 1000.0f; }
+    float getAccelerationY() const { return hasAirQuality() ? 0.0f : data.tag.acceleration[1] / 1000.0f; }
+    float getAccelerationZ() const { return hasAirQuality() ? 0.0f : data.tag.acceleration[2] / 1000.0f; }
+    float getBatteryVoltage() const { return hasAirQuality() ? 0.0f : data.tag.batteryVoltage / 1000.0f; }
+    float getTxPower() const { return hasAirQuality() ? 0.0f : data.tag.txPower; }
+    int getMovementCounter() const { return hasAirQuality() ? 0 : data.tag.movementCounter; }
     int getMeasurementSequenceNumber() const { return measurementSequenceNumber; }
-    const char *getMac() const { return mac; }
+    String getMac() const;
+    const MotionDetector& getMotion() const { return motion; }
+
+    // Number of advertisements in a data format that isn't supported, or too short for their format
+    static uint32_t getUnparsedCount() { return unparsed; }
+
+    // Air quality, formats 6 and E1. Particulate matter in ug/m3, format 6 only reports PM2.5
+    float getPm1_0() const { return hasAirQuality() ? data.air.pm[0] / 10.0f : 0.0f; }
+    float getPm2_5() const { return hasAirQuality() ? data.air.pm[1] / 10.0f : 0.0f; }
+    float getPm4_0() const { return hasAirQuality() ? data.air.pm[2] / 10.0f : 0.0f; }
+    float getPm10_0() const { return hasAirQuality() ? data.air.pm[3] / 10.0f : 0.0f; }
+    uint16_t getCo2() const { return hasAirQuality() ? data.air.co2 : 0; }
+    uint16_t getVocIndex() const { return hasAirQuality() ? data.air.voc : 0; }
+    uint16_t getNoxIndex() const { return hasAirQuality() ? data.air.nox : 0; }
+    float getLuminosity() const;
+
+    // Values as sent by the tag, in the units of data format 5
+    int16_t getTemperatureRaw() const { return temperature; }
+    uint16_t getHumidityRaw() const { return humidity; }
+    uint16_t getPressureRaw() const { return pressure; }
 
 private:
-    uint8_t format;                     // byte 0: Data format (8bit)
-    float temperature;                  // bytes 1-2: Temperature in 0.005 degrees Celsius
-    float humidity;                     // bytes 3-4: Humidity (16bit unsigned) in 0.0025% (0-163.83% range, though realistically 0-100%)
-    float pressure;                     // bytes 5-6: Pressure (16bit unsigned) in 1 Pa units, with offset of -50 000 Pa
-    float accelerationX;                // bytes 7-8: Acceleration-X (Most Significant Byte first)
-    float accelerationY;                // bytes 9-10: Acceleration-Y (Most Significant Byte first)
-    float accelerationZ;                // bytes 11-12: Acceleration-Z (Most Significant Byte first)
-    float batteryVoltage;               // bytes 13-14: Power info (11+5bit unsigned), first 11 bits is the battery voltage above 1.6V, in millivolts (1.6V to 3.646V range).
-    int8_t txPower;                     // bytes 13-14: Last 5 bits unsigned are the TX power above -40dBm, in 2dBm steps. (-40dBm to +20dBm range)
-    uint8_t movementCounter;            // byte 15: Movement counter (8 bit unsigned), incremented by motion detection interrupts from accelerometer
-    uint16_t measurementSequenceNumber; // bytes 16-17: Measurement sequence number (16 bit unsigned), each time a measurement is taken, this is incremented by one, used for measurement de-duplication. Depending on the transmit interval, multiple packets with the same measurements can be sent, and there may be measurements that never were sent.
-    char mac[18];                       // bytes 18-23: MAC address (48bit)
+    uint8_t format;                     // Data format (8bit)
+    uint8_t mac[6];                     // MAC address, most significant byte first
+    int16_t temperature;                // Temperature in 0.005 degrees Celsius
+    uint16_t humidity;                  // Humidity in 0.0025% (0-163.83% range, though realistically 0-100%)
+    uint16_t pressure;                  // Pressure in 1 Pa units, with offset of -50 000 Pa
+    uint32_t measurementSequenceNumber; // Incremented for each measurement, used for de-duplication. 8, 16 or 24 bits depending on the format
+
+    struct TagData {
+        int16_t acceleration[3];        // X, Y, Z in mG
+        uint16_t batteryVoltage;        // mV
+        int8_t txPower;                 // dBm
+        uint8_t movementCounter;        // Incremented by motion detection interrupts from accelerometer
+    };
+    struct AirData {
+        uint16_t pm[4];                 // PM1.0, PM2.5, PM4.0, PM10.0 in 0.1 ug/m3
+        uint16_t co2;                   // ppm
+        uint16_t voc, nox;              // Sensirion indexes, 9 bits
+        uint32_t luminosity;            // Format E1: 0.01 lux. Format 6: logarithmic code
+    };
+    union {
+        TagData tag;
+        AirData air;
+    } data;
+    MotionDetector motion;
 
     friend class Beaconscanner;
     static Vector<Ruuvi> beacons;
+    static uint32_t unparsed;
     void populateData(const BleScanResult *scanResult) override;
     static bool isBeacon(const BleScanResult *scanResult);
-    static void addOrUpdate(const BleScanResult *scanResult);
+    static Ruuvi& addOrUpdate(const BleScanResult *scanResult);
     bool parseRuuviAdvertisement(const uint8_t *buf, size_t len);
+    uint32_t changedFrom(const Ruuvi& other) const;
+    void parseRawV1(const uint8_t *buf);
+    void parseRawV2(const uint8_t *buf);
+    void parseAir(const uint8_t *buf);
+    void parseAirExtended(const uint8_t *buf);
 
     static inline bool isRuuvi(uint8_t lsb, uint8_t msb);
 };